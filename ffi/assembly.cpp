@@ -1,28 +1,35 @@
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
 #include "llvm/AsmParser/Parser.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/TimeProfiler.h"
 #include "llvm/Support/raw_ostream.h"
 
 #include "llvm-c/Core.h"
 #include "core.h"
 
+#include <algorithm>
+#include <atomic>
 #include <string>
 #include <cstdio>
+#include <thread>
+#include <vector>
 
 
-extern "C" {
+namespace {
 
-API_EXPORT(LLVMModuleRef)
-LLVMPY_ParseAssembly(LLVMContextRef context,
-                     const char *ir,
-                     const char **outmsg)
+LLVMModuleRef
+parseAssemblyBuffer(LLVMContextRef context,
+                    llvm::MemoryBufferRef buffer,
+                    const char **outmsg)
 {
     using namespace llvm;
 
     SMDiagnostic error;
 
-    Module *m = parseAssemblyString(ir, error, *unwrap(context)).release();
+    Module *m = parseAssembly(buffer, error, *unwrap(context)).release();
     if (!m) {
         // Error occurred
         std::string osbuf;
@@ -35,4 +42,127 @@ LLVMPY_ParseAssembly(LLVMContextRef context,
     return wrap(m);
 }
 
+/*
+ * Parse the len bytes of IR at ir, copying them first if they are not
+ * followed by a NUL character, which the lexer relies on.
+ */
+LLVMModuleRef
+parseAssemblyData(LLVMContextRef context,
+                  const char *ir,
+                  size_t len,
+                  int nullterminated,
+                  const char **outmsg)
+{
+    using namespace llvm;
+
+    StringRef data(ir, len);
+    if (nullterminated) {
+        return parseAssemblyBuffer(context,
+                                   MemoryBufferRef(data, "<string>"),
+                                   outmsg);
+    }
+    std::unique_ptr<MemoryBuffer> copy =
+        MemoryBuffer::getMemBufferCopy(data, "<string>");
+    return parseAssemblyBuffer(context, copy->getMemBufferRef(), outmsg);
+}
+
+} // end anonymous namespace
+
+extern "C" {
+
+/*
+ * Parse the len bytes of IR at ir.  The lexer relies on a NUL character
+ * after the end of the buffer: if there is none (nullterminated is false),
+ * the IR is copied.
+ */
+API_EXPORT(LLVMModuleRef)
+LLVMPY_ParseAssembly(LLVMContextRef context,
+                     const char *ir,
+                     size_t len,
+                     int nullterminated,
+                     const char **outmsg)
+{
+    llvm::TimeTraceScope timeScope("ParseAssembly", "");
+    return parseAssemblyData(context, ir, len, nullterminated, outmsg);
+}
+
+/*
+ * Parse Count IR buffers, as LLVMPY_ParseAssembly() does, each into a new
+ * context of its own so that they can be parsed in parallel by up to
+ * NumThreads threads (one per hardware thread if 0).  For each buffer,
+ * either the context and module are returned in OutContexts and
+ * OutModules, or an error in OutErrors.  Only the memory passed in is
+ * touched, so no lock needs to be held.
+ */
+API_EXPORT(void)
+LLVMPY_ParseAssemblyBatch(const char **irs,
+                          const size_t *lens,
+                          const int *nullterminated,
+                          size_t Count,
+                          unsigned NumThreads,
+                          LLVMContextRef *OutContexts,
+                          LLVMModuleRef *OutModules,
+                          const char **outmsgs)
+{
+    // The time trace profiler is thread-local, so only the calling thread
+    // records this scope and the worker threads record nothing.  Before
+    // LLVM 11 it is shared by all threads, parse on the calling thread only.
+    llvm::TimeTraceScope timeScope("ParseAssemblyBatch", "");
+#if LLVM_VERSION_MAJOR < 11
+    if (llvm::timeTraceProfilerEnabled())
+        NumThreads = 1;
+#endif
+    std::atomic<size_t> next(0);
+    auto parse = [&]() {
+        size_t i;
+        while ((i = next++) < Count) {
+            LLVMContextRef context = LLVMContextCreate();
+            outmsgs[i] = NULL;
+            LLVMModuleRef m = parseAssemblyData(context, irs[i], lens[i],
+                                                nullterminated[i],
+                                                &outmsgs[i]);
+            if (!m) {
+                LLVMContextDispose(context);
+                context = NULL;
+            }
+            OutContexts[i] = context;
+            OutModules[i] = m;
+        }
+    };
+
+    if (NumThreads == 0)
+        NumThreads = std::max(std::thread::hardware_concurrency(), 1u);
+    size_t numWorkers = std::min<size_t>(NumThreads, Count);
+    // The calling thread parses too
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < numWorkers; ++i)
+        workers.emplace_back(parse);
+    parse();
+    for (std::thread &worker : workers)
+        worker.join();
+}
+
+/*
+ * Parse the IR file at path, which is mapped into memory rather than read
+ * if large enough.
+ */
+API_EXPORT(LLVMModuleRef)
+LLVMPY_ParseAssemblyFile(LLVMContextRef context,
+                         const char *path,
+                         const char **outmsg)
+{
+    using namespace llvm;
+
+    TimeTraceScope timeScope("ParseAssembly", path);
+    ErrorOr<std::unique_ptr<MemoryBuffer>> buffer =
+        MemoryBuffer::getFile(path);
+    if (!buffer) {
+        *outmsg = LLVMPY_CreateString(
+            (Twine(path) + ": " + buffer.getError().message()).str().c_str());
+        return NULL;
+    }
+    return parseAssemblyBuffer(context, (*buffer)->getMemBufferRef(),
+                               outmsg);
+}
+
 } // end extern "C"
@@ -3,17 +3,108 @@
 
 #include "core.h"
 
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <string>
+#include <vector>
+
+namespace {
+
+typedef void (*BitcodeWriteFunc)(void *, const char *, size_t);
+
+/*
+ * An output stream handing its data to a callback, which must consume it
+ * before returning.  Large writes, such as the bitcode buffer written in
+ * one go by the bitcode writer, are passed through without copies.
+ */
+class CallbackOstream : public llvm::raw_ostream {
+public:
+    CallbackOstream(BitcodeWriteFunc Write, void *Opaque)
+        : write(Write), opaque(Opaque), pos(0)
+    {
+        SetUnbuffered();
+    }
+
+    ~CallbackOstream() override { flush(); }
+
+private:
+    void write_impl(const char *Ptr, size_t Size) override {
+        write(opaque, Ptr, Size);
+        pos += Size;
+    }
+
+    uint64_t current_pos() const override { return pos; }
+
+    BitcodeWriteFunc write;
+    void *opaque;
+    uint64_t pos;
+};
+
+/*
+ * Write the modules as a single bitcode file.  A single module is written
+ * as by WriteBitcodeToFile(); several modules are written one after the
+ * other, followed by the symbol and string tables shared by all of them,
+ * and can be read back with getBitcodeModuleList().
+ */
+void
+writeModules(llvm::ArrayRef<LLVMModuleRef> Modules, llvm::raw_ostream &OS)
+{
+    using namespace llvm;
+    if (Modules.size() == 1) {
+        WriteBitcodeToFile(*unwrap(Modules[0]), OS);
+        return;
+    }
+    SmallVector<char, 0> buffer;
+    buffer.reserve(256 * 1024);
+    BitcodeWriter writer(buffer);
+    for (LLVMModuleRef M : Modules)
+        writer.writeModule(*unwrap(M));
+    writer.writeSymtab();
+    writer.writeStrtab();
+    OS.write(buffer.data(), buffer.size());
+}
+
+} // end anonymous namespace
 
 extern "C" {
 
-API_EXPORT(void)
-LLVMPY_WriteBitcodeToString(LLVMModuleRef M,
-                            const char **outbuf, size_t *outlen)
+/*
+ * Write the bitcode of the Count modules either to the file descriptor
+ * FD, if non-negative, or through the Write callback.  The bitcode is
+ * written in as few calls as possible, from LLVM's own buffer.
+ */
+API_EXPORT(int)
+LLVMPY_WriteBitcode(LLVMModuleRef *Modules,
+                    size_t Count,
+                    int FD,
+                    BitcodeWriteFunc Write,
+                    void *Opaque,
+                    const char **OutError)
 {
-    LLVMMemoryBufferRef MB = LLVMWriteBitcodeToMemoryBuffer(M);
-    *outlen = LLVMGetBufferSize(MB);
-    *outbuf = LLVMPY_CreateByteString(LLVMGetBufferStart(MB), *outlen);
-    LLVMDisposeMemoryBuffer(MB);
+    using namespace llvm;
+    TimeTraceScope timeScope("WriteBitcode", "");
+    ArrayRef<LLVMModuleRef> modules(Modules, Count);
+    if (FD < 0) {
+        CallbackOstream os(Write, Opaque);
+        writeModules(modules, os);
+        return 0;
+    }
+    raw_fd_ostream os(FD, /*shouldClose=*/false);
+    writeModules(modules, os);
+    os.flush();
+    if (os.has_error()) {
+        *OutError = LLVMPY_CreateString(os.error().message().c_str());
+        os.clear_error();
+        return 1;
+    }
+    return 0;
 }
 
 API_EXPORT(LLVMModuleRef)
@@ -21,6 +112,7 @@ LLVMPY_ParseBitcode(LLVMContextRef context,
                     const char *bitcode, size_t bitcodelen,
                     char **outmsg)
 {
+    llvm::TimeTraceScope timeScope("ParseBitcode", "");
     LLVMModuleRef ref;
     LLVMMemoryBufferRef mem = LLVMCreateMemoryBufferWithMemoryRange(
         bitcode, bitcodelen,
@@ -33,4 +125,104 @@ LLVMPY_ParseBitcode(LLVMContextRef context,
     return ref;
 }
 
+/*
+ * Parse a module lazily: function bodies are only read when materialized.
+ * The module refers to the bitcode, which must outlive it or its full
+ * materialization.
+ */
+API_EXPORT(LLVMModuleRef)
+LLVMPY_ParseLazyBitcode(LLVMContextRef context,
+                        const char *bitcode, size_t bitcodelen,
+                        const char **outmsg)
+{
+    using namespace llvm;
+    TimeTraceScope timeScope("ParseBitcode", "");
+    MemoryBufferRef buf(StringRef(bitcode, bitcodelen), "");
+    Expected<std::unique_ptr<Module>> M =
+        getLazyBitcodeModule(buf, *unwrap(context));
+    if (!M) {
+        *outmsg = LLVMPY_CreateString(toString(M.takeError()).c_str());
+        return nullptr;
+    }
+    return wrap(M->release());
+}
+
+/*
+ * Parse a module from a bitcode file, which is mapped into memory if
+ * large enough.  A lazily parsed module owns the mapping.
+ */
+API_EXPORT(LLVMModuleRef)
+LLVMPY_ParseBitcodeFile(LLVMContextRef context,
+                        const char *path,
+                        int lazy,
+                        const char **outmsg)
+{
+    using namespace llvm;
+    TimeTraceScope timeScope("ParseBitcode", path);
+    ErrorOr<std::unique_ptr<MemoryBuffer>> buf = MemoryBuffer::getFile(
+        path, /*FileSize=*/-1, /*RequiresNullTerminator=*/false);
+    if (!buf) {
+        *outmsg = LLVMPY_CreateString(buf.getError().message().c_str());
+        return nullptr;
+    }
+    Expected<std::unique_ptr<Module>> M =
+        lazy ? getOwningLazyBitcodeModule(std::move(*buf), *unwrap(context))
+             : parseBitcodeFile((*buf)->getMemBufferRef(), *unwrap(context));
+    if (!M) {
+        *outmsg = LLVMPY_CreateString(toString(M.takeError()).c_str());
+        return nullptr;
+    }
+    return wrap(M->release());
+}
+
+/*
+ * Return the number of modules in a bitcode file, or -1 on error.
+ */
+API_EXPORT(int)
+LLVMPY_GetBitcodeModuleCount(const char *bitcode, size_t bitcodelen,
+                             const char **outmsg)
+{
+    using namespace llvm;
+    MemoryBufferRef buf(StringRef(bitcode, bitcodelen), "");
+    Expected<std::vector<BitcodeModule>> modules = getBitcodeModuleList(buf);
+    if (!modules) {
+        *outmsg = LLVMPY_CreateString(toString(modules.takeError()).c_str());
+        return -1;
+    }
+    return modules->size();
+}
+
+/*
+ * Parse all the modules of a bitcode file into the array Out, whose size
+ * is given by LLVMPY_GetBitcodeModuleCount().  Nothing is returned on
+ * error.
+ */
+API_EXPORT(int)
+LLVMPY_ParseBitcodeModules(LLVMContextRef context,
+                           const char *bitcode, size_t bitcodelen,
+                           LLVMModuleRef *Out,
+                           const char **outmsg)
+{
+    using namespace llvm;
+    TimeTraceScope timeScope("ParseBitcode", "");
+    MemoryBufferRef buf(StringRef(bitcode, bitcodelen), "");
+    Expected<std::vector<BitcodeModule>> modules = getBitcodeModuleList(buf);
+    if (!modules) {
+        *outmsg = LLVMPY_CreateString(toString(modules.takeError()).c_str());
+        return 1;
+    }
+    std::vector<std::unique_ptr<Module>> parsed;
+    for (BitcodeModule &BM : *modules) {
+        Expected<std::unique_ptr<Module>> M = BM.parseModule(*unwrap(context));
+        if (!M) {
+            *outmsg = LLVMPY_CreateString(toString(M.takeError()).c_str());
+            return 1;
+        }
+        parsed.push_back(std::move(*M));
+    }
+    for (size_t i = 0; i < parsed.size(); ++i)
+        Out[i] = wrap(parsed[i].release());
+    return 0;
+}
+
 } // end extern "C"
@@ -5,11 +5,20 @@
 #include "llvm/Pass.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/CFG.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
 
-#include "llvm/ADT/SmallSet.h"
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/IntrusiveRefCntPtr.h"
+#include "llvm/ADT/SCCIterator.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/StringMap.h"
 
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Analysis/CallGraph.h"
+#include "llvm/Analysis/LoopInfo.h"
 #include "llvm/Analysis/Passes.h"
 #include "llvm/Analysis/PostDominators.h"
 
@@ -18,7 +27,12 @@
 #include "llvm/InitializePasses.h"
 #include "llvm/LinkAllPasses.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <iostream>
+#include <mutex>
+#include <string>
 #include <vector>
 
 // #define DEBUG_PRINT 1
@@ -32,76 +46,295 @@ namespace llvm {
 }
 
 /**
- * Checks if a call instruction is an incref
- *
- * Parameters:
- *  - call_inst, a call instruction
- *
- * Returns:
- *  - true if call_inst is an incref, false otherwise
+ * The names of the functions whose calls are refops, increfs or decrefs of
+ * the pointer passed as their first argument.
  */
-bool IsIncRef(CallInst *call_inst) {
-    Value *callee = call_inst->getCalledOperand();
-    return callee->getName() == "NRT_incref";
-}
+struct RefOpNames {
+    std::vector<std::string> increfs = {"NRT_incref"};
+    std::vector<std::string> decrefs = {"NRT_decref"};
+};
 
 /**
- * Checks if a call instruction is an decref
- *
- * Parameters:
- *  - call_inst, a call instruction
- *
- * Returns:
- *  - true if call_inst is an decref, false otherwise
+ * The effects a function may have on the count of a pointer argument, as
+ * summarized from its body and from the summaries of its callees.
  */
-bool IsDecRef(CallInst *call_inst) {
-    Value *callee = call_inst->getCalledOperand();
-    return callee->getName() == "NRT_decref";
-}
-
+enum RefOpEffect {
+    REFOP_NEUTRAL = 0,      // leaves the count alone
+    REFOP_RETURNS = 1,      // may keep a new reference, e.g. to return it
+    REFOP_CONSUMES = 2,     // may release a reference it was passed
+};
 
 /**
- * Checks if an instruction is a "refop" (either an incref or a decref).
- *
- * Parameters:
- *  - ii, the instruction to check
- *
- * Returns:
- *  - the instruction ii, if it is a "refop", NULL otherwise
+ * The callees of the refops of a module, resolved from their names once per
+ * module so that calls are classified by comparing pointers, and the effects
+ * of the functions defined in the module on the counts of their arguments.
  */
-CallInst* GetRefOpCall(Instruction *ii) {
-    if (ii->getOpcode() == Instruction::Call) {
-        CallInst *call_inst = dyn_cast<CallInst>(ii);
-        if ( IsIncRef(call_inst) || IsDecRef(call_inst) ) {
-            return call_inst;
+class RefOpCallees {
+public:
+    explicit RefOpCallees(const RefOpNames &names) : names(names) {}
+
+    /**
+     * Resolves the callees of module M, unless they already are.
+     */
+    void resolve(Module &M) {
+        if (&M == module)
+            return;
+        reset();
+        module = &M;
+        for (const std::string &name : names.increfs)
+            if (GlobalValue *callee = M.getNamedValue(name))
+                increfs.insert(callee);
+        for (const std::string &name : names.decrefs)
+            if (GlobalValue *callee = M.getNamedValue(name))
+                decrefs.insert(callee);
+    }
+
+    /**
+     * Forgets the callees resolved, as their module may go away.
+     */
+    void reset() {
+        module = nullptr;
+        increfs.clear();
+        decrefs.clear();
+        summarized = false;
+        effects.clear();
+    }
+
+    /**
+     * Returns true if the module has no refop callees, so nothing to prune.
+     */
+    bool empty() const {
+        return increfs.empty() && decrefs.empty();
+    }
+
+    bool isIncRef(CallInst *call_inst) const {
+        return increfs.count(call_inst->getCalledOperand());
+    }
+
+    bool isDecRef(CallInst *call_inst) const {
+        return decrefs.count(call_inst->getCalledOperand());
+    }
+
+    /**
+     * Returns the RefOpEffect bits of a call, which is not a refop, on the
+     * count of its operand ptr, or of any of its operands if ptr is NULL.
+     * The functions of the module are summarized on the first query.  Calls
+     * to functions outside of the module, or through pointers, are assumed
+     * to be neutral, as all calls were before summaries.
+     */
+    unsigned getCallEffect(CallInst *call_inst, const Value *ptr) {
+        if (!summarized)
+            summarize();
+        return lookupCallEffect(call_inst, ptr);
+    }
+
+private:
+    unsigned lookupCallEffect(CallInst *call_inst, const Value *ptr) const {
+        auto found = effects.find(call_inst->getCalledFunction());
+        if (found == effects.end())
+            return REFOP_NEUTRAL;
+        unsigned effect = REFOP_NEUTRAL;
+        unsigned count = std::min<unsigned>(found->second.size(),
+                                            call_inst->arg_size());
+        for (unsigned i = 0; i < count; ++i) {
+            if (ptr == NULL || call_inst->getArgOperand(i) == ptr)
+                effect |= found->second[i];
         }
+        return effect;
     }
-    return NULL;
-}
+
+    /**
+     * Summarizes the functions defined in the module, callees first.  The
+     * functions calling each other are summarized again until their effects
+     * stop growing.
+     */
+    void summarize() {
+        summarized = true;
+        if (empty())
+            return;
+        CallGraph callgraph(*module);
+        for (auto scc = scc_begin(&callgraph); !scc.isAtEnd(); ++scc) {
+            bool changed;
+            do {
+                changed = false;
+                for (CallGraphNode *node : *scc) {
+                    Function *F = node->getFunction();
+                    if (F == NULL || F->isDeclaration())
+                        continue;
+                    auto &summary = effects[F];
+                    summary.resize(F->arg_size(), REFOP_NEUTRAL);
+                    for (Argument &arg : F->args()) {
+                        if (!arg.getType()->isPointerTy())
+                            continue;
+                        unsigned effect = summary[arg.getArgNo()]
+                                          | summarizeArgument(arg);
+                        if (effect != summary[arg.getArgNo()]) {
+                            summary[arg.getArgNo()] = effect;
+                            changed = true;
+                        }
+                    }
+                }
+            } while (changed && scc.hasCycle());
+        }
+    }
+
+    /**
+     * Summarizes the effects of a function on the count of an argument.
+     * The refops on it, and the calls passing it, are balanced along the
+     * paths from the entry of the function: a decref reached with no incref
+     * outstanding may release the reference passed, and an incref still
+     * outstanding when the function exits may keep a new one.  If the paths
+     * reaching a block disagree on the increfs outstanding, e.g. around a
+     * loop which doesn't balance them, the refops are balanced a block at a
+     * time instead, as the per block pruning would.
+     */
+    unsigned summarizeArgument(Argument &arg) const {
+        Function &F = *arg.getParent();
+        unsigned effect = REFOP_NEUTRAL;
+        // the increfs of arg outstanding on entry to the blocks reached
+        DenseMap<const BasicBlock*, size_t> entry_balance;
+        SmallVector<BasicBlock*, 16> worklist;
+        entry_balance[&F.getEntryBlock()] = 0;
+        worklist.push_back(&F.getEntryBlock());
+        while (!worklist.empty()) {
+            BasicBlock *bb = worklist.pop_back_val();
+            size_t balance = entry_balance.lookup(bb);
+            effect |= balanceBlock(*bb, arg, balance);
+            if (succ_empty(bb) && balance > 0)
+                effect |= REFOP_RETURNS;
+            for (BasicBlock *succ : successors(bb)) {
+                auto inserted = entry_balance.insert({succ, balance});
+                if (inserted.second)
+                    worklist.push_back(succ);
+                else if (inserted.first->second != balance)
+                    return summarizeArgumentPerBlock(arg);
+            }
+        }
+        return effect;
+    }
+
+    /**
+     * Summarizes the effects of a function on the count of an argument,
+     * balancing the refops a block at a time: a decref not preceded by an
+     * incref in its block may release the reference passed, and an incref
+     * left in a block may keep a new one.
+     */
+    unsigned summarizeArgumentPerBlock(Argument &arg) const {
+        unsigned effect = REFOP_NEUTRAL;
+        for (BasicBlock &bb : *arg.getParent()) {
+            size_t balance = 0;
+            effect |= balanceBlock(bb, arg, balance);
+            if (balance > 0)
+                effect |= REFOP_RETURNS;
+        }
+        return effect;
+    }
+
+    /**
+     * Balances the refops on arg, and the calls passing it, in block bb.
+     * balance is the number of increfs of arg not balanced yet, updated
+     * through the block.  Returns REFOP_CONSUMES if a decref is reached
+     * with none left, REFOP_NEUTRAL otherwise.
+     */
+    unsigned balanceBlock(BasicBlock &bb, Argument &arg,
+                          size_t &balance) const {
+        unsigned effect = REFOP_NEUTRAL;
+        for (Instruction &ii : bb) {
+            CallInst *call_inst = dyn_cast<CallInst>(&ii);
+            if (call_inst == NULL)
+                continue;
+            unsigned call_effect;
+            if (isIncRef(call_inst) || isDecRef(call_inst)) {
+                if (call_inst->getArgOperand(0) != &arg)
+                    continue;
+                call_effect = isIncRef(call_inst) ? REFOP_RETURNS
+                                                  : REFOP_CONSUMES;
+            } else {
+                call_effect = lookupCallEffect(call_inst, &arg);
+            }
+            if (call_effect & REFOP_CONSUMES) {
+                if (balance > 0)
+                    --balance;
+                else
+                    effect |= REFOP_CONSUMES;
+            }
+            if (call_effect & REFOP_RETURNS)
+                ++balance;
+        }
+        return effect;
+    }
+
+    RefOpNames names;
+    Module *module = nullptr;
+    SmallPtrSet<const Value*, 4> increfs, decrefs;
+    // The RefOpEffect bits of each argument of the functions summarized
+    bool summarized = false;
+    DenseMap<const Function*, SmallVector<unsigned char, 4> > effects;
+};
 
 /**
- * RAII push-pop of elements onto a stack.
- *
- * Template parameter <Tstack>:
- *  - the type of the stack
+ * Base of the passes working on refops, which tells them apart with the
+ * refop callees of the module being run.
  */
-template <class Tstack>
-struct raiiStack {
-    Tstack &stack;
+struct RefOpPass : public FunctionPass {
+    RefOpCallees callees;
 
-    typedef typename Tstack::value_type value_type;
+    RefOpPass(char &ID, const RefOpNames &names)
+        : FunctionPass(ID), callees(names) {}
+
+    bool doInitialization(Module &M) override {
+        callees.reset();
+        return false;
+    }
+
+    bool doFinalization(Module &M) override {
+        callees.reset();
+        return false;
+    }
 
     /**
-     * ctor pushes `elem` onto `stack`
+     * Checks if a call instruction is an incref
+     *
+     * Parameters:
+     *  - call_inst, a call instruction
+     *
+     * Returns:
+     *  - true if call_inst is an incref, false otherwise
      */
-    raiiStack(Tstack &stack, value_type& elem) :stack(stack) {
-        stack.push_back(elem);
+    bool IsIncRef(CallInst *call_inst) const {
+        return callees.isIncRef(call_inst);
     }
+
+    /**
+     * Checks if a call instruction is an decref
+     *
+     * Parameters:
+     *  - call_inst, a call instruction
+     *
+     * Returns:
+     *  - true if call_inst is an decref, false otherwise
+     */
+    bool IsDecRef(CallInst *call_inst) const {
+        return callees.isDecRef(call_inst);
+    }
+
     /**
-     * dtor pops back of `stack`
+     * Checks if an instruction is a "refop" (either an incref or a decref).
+     *
+     * Parameters:
+     *  - ii, the instruction to check
+     *
+     * Returns:
+     *  - the instruction ii, if it is a "refop", NULL otherwise
      */
-    ~raiiStack() {
-        stack.pop_back();
+    CallInst* GetRefOpCall(Instruction *ii) const {
+        if (ii->getOpcode() == Instruction::Call) {
+            CallInst *call_inst = dyn_cast<CallInst>(ii);
+            if ( IsIncRef(call_inst) || IsDecRef(call_inst) ) {
+                return call_inst;
+            }
+        }
+        return NULL;
     }
 };
 
@@ -109,14 +342,19 @@ struct raiiStack {
  * A FunctionPass to reorder incref/decref instructions such that decrefs occur
  * logically after increfs. This is a pre-requisite pass to the pruner passes.
  */
-struct RefNormalizePass : public FunctionPass {
+struct RefNormalizePass : public RefOpPass {
     static char ID;
-    RefNormalizePass() : FunctionPass(ID) {
+    RefNormalizePass(const RefOpNames &names=RefOpNames())
+        : RefOpPass(ID, names) {
         initializeRefNormalizePassPass(*PassRegistry::getPassRegistry());
     }
 
     bool runOnFunction(Function &F) override {
         bool mutated = false;
+        callees.resolve(*F.getParent());
+        if (callees.empty())
+            return mutated;
+
         // For each basic block in F
         for (BasicBlock &bb : F) {
             //This find a incref in the basic block
@@ -163,16 +401,146 @@ struct RefNormalizePass : public FunctionPass {
     }
 };
 
-struct RefPrunePass : public FunctionPass {
+/**
+ * Struct for holding statistics about the amount of pruning performed by
+ * each type of pruning algorithm.  Loop hoisting moves refops rather than
+ * pruning them, so it counts the incref/decref pairs hoisted instead.
+ */
+typedef struct PruneStats {
+    size_t basicblock;
+    size_t diamond;
+    size_t fanout;
+    size_t fanout_raise;
+    size_t hoisted;
+} PRUNESTATS;
+
+
+/**
+ * The subpasses that statistics are kept for, in the order of the fields of
+ * PRUNESTATS.
+ */
+enum PruneSubpass {
+    PRUNE_PER_BB,
+    PRUNE_DIAMOND,
+    PRUNE_FANOUT,
+    PRUNE_FANOUT_RAISE,
+    PRUNE_LOOP_HOIST,
+    NUM_PRUNE_SUBPASSES
+};
+
+/**
+ * The refops pruned by each subpass in a function, and the time in seconds
+ * each subpass took, accumulated over the runs on functions of that name.
+ */
+struct FunctionPruneStats {
+    size_t runs = 0;
+    size_t pruned[NUM_PRUNE_SUBPASSES] = {};
+    double times[NUM_PRUNE_SUBPASSES] = {};
+};
+
+/**
+ * Statistics shared by the RefPrunePass instances of a pass manager.  The
+ * totals are updated atomically and the per-function breakdown under a lock,
+ * so that several pass managers can run in parallel.  It is reference
+ * counted, as it is owned both by the caller and by the passes.
+ */
+class LLVMPYRefPruneStats
+    : public ThreadSafeRefCountedBase<LLVMPYRefPruneStats> {
+public:
+    void add(StringRef name, const FunctionPruneStats &stats) {
+        for (int i = 0; i < NUM_PRUNE_SUBPASSES; ++i)
+            pruned[i] += stats.pruned[i];
+        std::lock_guard<std::mutex> guard(lock);
+        FunctionPruneStats &entry = functions[name];
+        entry.runs += stats.runs;
+        for (int i = 0; i < NUM_PRUNE_SUBPASSES; ++i) {
+            entry.pruned[i] += stats.pruned[i];
+            entry.times[i] += stats.times[i];
+        }
+    }
+
+    std::atomic<size_t> pruned[NUM_PRUNE_SUBPASSES] = {};
+    std::mutex lock;
+    StringMap<FunctionPruneStats> functions;
+};
+
+typedef LLVMPYRefPruneStats *LLVMPYRefPruneStatsRef;
+
+/**
+ * Fills the PRUNESTATS from an array of counts indexed by PruneSubpass.
+ */
+template <typename Counts>
+static void setPruneStats(PRUNESTATS *buf, const Counts &pruned) {
+    buf->basicblock = pruned[PRUNE_PER_BB];
+    buf->diamond = pruned[PRUNE_DIAMOND];
+    buf->fanout = pruned[PRUNE_FANOUT];
+    buf->fanout_raise = pruned[PRUNE_FANOUT_RAISE];
+    buf->hoisted = pruned[PRUNE_LOOP_HOIST];
+}
+
+struct RefPrunePass : public RefOpPass {
     static char ID;
-    static size_t stats_per_bb;
-    static size_t stats_diamond;
-    static size_t stats_fanout;
-    static size_t stats_fanout_raise;
+    // The refops pruned by all the instances, for LLVMPY_DumpRefPruneStats()
+    static std::atomic<size_t> total_pruned[NUM_PRUNE_SUBPASSES];
+
+    // Where the statistics of the function being pruned are accumulated
+    FunctionPruneStats function_stats;
+    IntrusiveRefCntPtr<LLVMPYRefPruneStats> stats;
 
-    // Fixed size for how deep to recurse in the fanout case prior to giving up.
-    static const size_t FANOUT_RECURSE_DEPTH= 15;
-    typedef SmallSet<BasicBlock*, FANOUT_RECURSE_DEPTH> SmallBBSet;
+    // Each fanout search may visit this many blocks before giving up.  The
+    // budget is per incref, so that failed searches don't starve the
+    // searches of the increfs after them.
+    enum { FANOUT_SEARCH_BUDGET = 1024 };
+
+    /**
+     * Facts about the blocks of a function memoized for the searches of the
+     * subpasses: a number for each block, the entry block first, its decrefs
+     * in order, whether it raises and whether it calls a function that may
+     * release a reference.  The decrefs are kept up to date as they are
+     * pruned.
+     */
+    struct BlockFacts {
+        DenseMap<const BasicBlock*, unsigned> ids;
+        std::vector<BasicBlock*> blocks;
+        std::vector<SmallVector<CallInst*, 2> > decrefs;
+        BitVector raising;
+        BitVector releasing;
+
+        unsigned size() const { return blocks.size(); }
+
+        unsigned id(const BasicBlock *bb) const { return ids.lookup(bb); }
+
+        /**
+         * Returns the first decref of ptr in block bb, NULL if none.
+         */
+        CallInst* findDecref(unsigned bb, const Value *ptr) const {
+            for (CallInst *decref : decrefs[bb]) {
+                if (decref->getArgOperand(0) == ptr) return decref;
+            }
+            return NULL;
+        }
+
+        /**
+         * Returns true if block bb has a decref, or a call releasing a
+         * reference, of any pointer.
+         */
+        bool hasAnyDecref(unsigned bb) const {
+            return !decrefs[bb].empty() || releasing.test(bb);
+        }
+
+        /**
+         * Erases a decref from its block.
+         */
+        void eraseDecref(CallInst *decref) {
+            auto &list = decrefs[id(decref->getParent())];
+            list.erase(std::find(list.begin(), list.end(), decref));
+            decref->eraseFromParent();
+        }
+    };
+
+    // Refops grouped by the pointer they operate on, so that an incref is
+    // only ever compared with the related decrefs.
+    typedef DenseMap<Value*, SmallVector<CallInst*, 4> > RefOpsByArg;
 
     /**
      * Enum for setting which subpasses to run, there is no interdependence.
@@ -183,14 +551,19 @@ struct RefPrunePass : public FunctionPass {
         Diamond         = 0b0010,
         Fanout          = 0b0100,
         FanoutRaise     = 0b1000,
+        LoopHoist       = 0b10000,
+        // Loop hoisting is opt-in, it is not part of All
         All             = PerBasicBlock | Diamond | Fanout | FanoutRaise
     } flags;
 
-    RefPrunePass(Subpasses flags=Subpasses::All) : FunctionPass(ID), flags(flags) {
+    RefPrunePass(Subpasses flags=Subpasses::All,
+                 LLVMPYRefPruneStats *stats=nullptr,
+                 const RefOpNames &names=RefOpNames())
+        : RefOpPass(ID, names), stats(stats), flags(flags) {
         initializeRefPrunePassPass(*PassRegistry::getPassRegistry());
     }
 
-    bool isSubpassEnabledFor(Subpasses expected) {
+    bool isSubpassEnabledFor(Subpasses expected) const {
         return (flags & expected) == expected;
     }
 
@@ -198,22 +571,64 @@ struct RefPrunePass : public FunctionPass {
         // state for LLVM function pass mutated IR
         bool mutated = false;
 
+        // modules without refop callees have nothing to prune
+        callees.resolve(*F.getParent());
+        if (callees.empty())
+            return mutated;
+
+        function_stats = FunctionPruneStats();
+        function_stats.runs = 1;
+
         // local state for capturing mutation by any selected pass, any mutation
         // at all propagates into mutated for return.
         bool local_mutated;
         do {
             local_mutated = false;
             if (isSubpassEnabledFor(Subpasses::PerBasicBlock))
-                local_mutated |= runPerBasicBlockPrune(F);
+                local_mutated |= timeSubpass(PRUNE_PER_BB, [&] {
+                    return runPerBasicBlockPrune(F);
+                });
             if (isSubpassEnabledFor(Subpasses::Diamond))
-                local_mutated |= runDiamondPrune(F);
+                local_mutated |= timeSubpass(PRUNE_DIAMOND, [&] {
+                    return runDiamondPrune(F);
+                });
             if (isSubpassEnabledFor(Subpasses::Fanout))
-                local_mutated |= runFanoutPrune(F, /*prune_raise*/false);
+                local_mutated |= timeSubpass(PRUNE_FANOUT, [&] {
+                    return runFanoutPrune(F, /*prune_raise*/false);
+                });
             if (isSubpassEnabledFor(Subpasses::FanoutRaise))
-                local_mutated |= runFanoutPrune(F, /*prune_raise*/true);
+                local_mutated |= timeSubpass(PRUNE_FANOUT_RAISE, [&] {
+                    return runFanoutPrune(F, /*prune_raise*/true);
+                });
+            if (isSubpassEnabledFor(Subpasses::LoopHoist))
+                local_mutated |= timeSubpass(PRUNE_LOOP_HOIST, [&] {
+                    return runLoopPrune(F);
+                });
             mutated |= local_mutated;
         } while(local_mutated);
 
+        // publish the statistics of the function
+        for (int i = 0; i < NUM_PRUNE_SUBPASSES; ++i)
+            total_pruned[i] += function_stats.pruned[i];
+        if (stats)
+            stats->add(F.getName(), function_stats);
+
+        return mutated;
+    }
+
+    /**
+     * Runs the subpass and adds the time it took to its statistics.
+     *
+     * Returns:
+     *  - what the subpass returns, whether pruning took place
+     */
+    template <typename Subpass>
+    bool timeSubpass(PruneSubpass which, Subpass subpass) {
+        auto start = std::chrono::steady_clock::now();
+        bool mutated = subpass();
+        std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+        function_stats.times[which] += elapsed.count();
         return mutated;
     }
 
@@ -222,7 +637,9 @@ struct RefPrunePass : public FunctionPass {
      *
      * Assumes all increfs are before all decrefs.
      * Cleans up all refcount operations on NULL pointers.
-     * Cleans up all redundant incref/decref pairs.
+     * Cleans up all redundant incref/decref pairs, unless a call between
+     * them may release a reference to their pointer, as the pair keeps the
+     * pointer alive across the call.
      *
      * This pass works on a block at a time and does not change the CFG.
      * Incref/Decref removal is restricted to the basic block.
@@ -255,14 +672,21 @@ struct RefPrunePass : public FunctionPass {
         for (BasicBlock &bb : F) {
             // allocate some buffers
             SmallVector<CallInst*, 10> incref_list, decref_list, null_list;
+            // the calls that may release a reference to each pointer, and
+            // the positions of these calls and of the refops in the block
+            RefOpsByArg releases_by_arg;
+            DenseMap<const CallInst*, unsigned> positions;
 
             // This is a scanning phase looking to classify instructions into
             // inrefs, decrefs and operations on already NULL pointers.
             // walk the instructions in the current basic block
+            unsigned position = 0;
             for (Instruction &ii : bb) {
+                ++position;
                 // If the instruction is a refop
                 CallInst* ci;
                 if ( (ci = GetRefOpCall(&ii)) ) {
+                    positions[ci] = position;
                     if (!isNonNullFirstArg(ci)) {
                         // Drop refops on NULL pointers
                         null_list.push_back(ci);
@@ -272,6 +696,14 @@ struct RefPrunePass : public FunctionPass {
                     else if ( IsDecRef(ci) ) {
                         decref_list.push_back(ci);
                     }
+                } else if ( (ci = dyn_cast<CallInst>(&ii)) ) {
+                    // or another call which may release a pointer
+                    for (Value *arg : ci->args()) {
+                        if (mayRelease(ci, arg)) {
+                            releases_by_arg[arg].push_back(ci);
+                            positions[ci] = position;
+                        }
+                    }
                 }
             }
 
@@ -282,37 +714,41 @@ struct RefPrunePass : public FunctionPass {
 
                 // Do we care about differentiating between prunes of NULL
                 // and prunes of pairs?
-                stats_per_bb += 1;
+                function_stats.pruned[PRUNE_PER_BB] += 1;
             }
 
-            // Second: Find matching pairs of incref decref
+            // Second: Find matching pairs of incref decref.
+            // Group the decrefs by pointer, each group in reverse order so
+            // that its back is the first decref not matched yet.
+            RefOpsByArg decrefs_by_arg;
+            for (auto it = decref_list.rbegin(); it != decref_list.rend(); ++it) {
+                decrefs_by_arg[(*it)->getArgOperand(0)].push_back(*it);
+            }
             while (incref_list.size() > 0) {
                 // get an incref
                 CallInst* incref = incref_list.pop_back_val();
-                // walk decrefs
-                for (size_t i=0; i < decref_list.size(); ++i){
-                    CallInst* decref = decref_list[i];
-                    // is this instruction a decref thats non-NULL and
-                    // the decref related to the incref?
-                    if (decref && isRelatedDecref(incref, decref)) {
-                        if (DEBUG_PRINT) {
-                            errs() << "Prune: matching pair in BB:\n";
-                            incref->dump();
-                            decref->dump();
-                            incref->getParent()->dump();
-                        }
-                        // strip incref and decref from blck
-                        incref->eraseFromParent();
-                        decref->eraseFromParent();
-
-                        // set stripped decref to null
-                        decref_list[i] = NULL;
-                        // set mutated bit and update prune stats
-                        mutated = true;
-                        stats_per_bb += 2;
-                        break;
-                    }
+                // find the first remaining decref related to the incref
+                auto related = decrefs_by_arg.find(incref->getArgOperand(0));
+                if (related == decrefs_by_arg.end() || related->second.empty())
+                    continue;
+                CallInst* decref = related->second.back();
+                if (isReleasedBetween(releases_by_arg, positions,
+                                      incref, decref))
+                    continue;
+                related->second.pop_back();
+                if (DEBUG_PRINT) {
+                    errs() << "Prune: matching pair in BB:\n";
+                    incref->dump();
+                    decref->dump();
+                    incref->getParent()->dump();
                 }
+                // strip incref and decref from blck
+                incref->eraseFromParent();
+                decref->eraseFromParent();
+
+                // set mutated bit and update prune stats
+                mutated = true;
+                function_stats.pruned[PRUNE_PER_BB] += 2;
             }
         }
         return mutated;
@@ -371,38 +807,51 @@ struct RefPrunePass : public FunctionPass {
         // Find all increfs and decrefs in the Function and store them in
         // incref_list and decref_list respectively.
         std::vector<CallInst*> incref_list, decref_list;
-        listRefOps(F, IsIncRef, incref_list);
-        listRefOps(F, IsDecRef, decref_list);
+        listRefOps(F, &RefPrunePass::IsIncRef, incref_list);
+        listRefOps(F, &RefPrunePass::IsDecRef, decref_list);
+
+        // Group the decrefs by pointer, in order, so that only the related
+        // decrefs are considered for each incref
+        RefOpsByArg decrefs_by_arg;
+        for (CallInst* decref : decref_list) {
+            decrefs_by_arg[decref->getArgOperand(0)].push_back(decref);
+        }
+
+        BlockFacts facts;
+        getBlockFacts(F, facts);
 
         // Walk the incref list
         for (CallInst*& incref: incref_list) {
             // NULL is the token for already erased, skip on it
             if (incref == NULL) continue;
 
-            // Walk the decref_list
-            for (CallInst*& decref: decref_list) {
+            auto related = decrefs_by_arg.find(incref->getArgOperand(0));
+            if (related == decrefs_by_arg.end()) continue;
+
+            // Walk the related decrefs
+            for (CallInst*& decref: related->second) {
                 // NULL is the token for already erased, skip on it
                 if (decref == NULL) continue;
 
                 // Diamond prune is for refops not in the same BB
                 if (incref->getParent() == decref->getParent() ) continue;
 
-                // If the refops are unrelated, skip
-                if (!isRelatedDecref(incref, decref)) continue;
-
                 // incref DOM decref && decref POSTDOM incref
                 if ( domtree.dominates(incref, decref)
                         && postdomtree.dominates(decref, incref) ){
 
+                    unsigned incref_node = facts.id(incref->getParent());
+                    unsigned decref_node = facts.id(decref->getParent());
+
                     // check that the decref cannot be executed multiple times
-                    SmallBBSet tail_nodes;
-                    tail_nodes.insert(decref->getParent());
-                    if ( !verifyFanoutBackward(incref, incref->getParent(), &tail_nodes) )
+                    BitVector tail_nodes(facts.size());
+                    tail_nodes.set(decref_node);
+                    if ( !verifyFanoutBackward(facts, incref_node, tail_nodes) )
                         continue;
 
                     // scan the CFG between the incref and decref BBs, if there's a decref
                     // present then skip, this is conservative.
-                    if (hasDecrefBetweenGraph(incref->getParent(), decref->getParent())) {
+                    if (hasDecrefBetweenGraph(facts, incref_node, decref_node)) {
                         continue;
                     } else {
 
@@ -417,11 +866,11 @@ struct RefPrunePass : public FunctionPass {
                         // erase instruction from block and set NULL marker for
                         // bookkeeping purposes
                         incref->eraseFromParent();
-                        decref->eraseFromParent();
+                        facts.eraseDecref(decref);
                         incref = NULL;
                         decref = NULL;
 
-                        stats_diamond += 2;
+                        function_stats.pruned[PRUNE_DIAMOND] += 2;
                     }
                     // mark mutated
                     mutated = true;
@@ -504,59 +953,54 @@ struct RefPrunePass : public FunctionPass {
 
         // Find all Increfs and store them in incref_list
         std::vector<CallInst*> incref_list;
-        listRefOps(F, IsIncRef, incref_list);
+        listRefOps(F, &RefPrunePass::IsIncRef, incref_list);
+        if (incref_list.empty())
+            return mutated;
+
+        BlockFacts facts;
+        getBlockFacts(F, facts);
 
         // walk the incref_list
         for (CallInst* incref : incref_list) {
             // Is there *any* decref in the parent node of the incref?
             // If so skip this incref (considering that aliases may exist).
-            if (hasAnyDecrefInNode(incref->getParent())){
+            if (facts.hasAnyDecref(facts.id(incref->getParent()))) {
                 // be careful of potential alias
                 continue;  // skip
             }
 
-            SmallBBSet decref_blocks;
+            BitVector decref_blocks(facts.size());
             // Check for the chosen "fan out" condition
-            if ( findFanout(incref, &decref_blocks, prune_raise_exit) ) {
+            if ( findFanout(facts, incref, decref_blocks, prune_raise_exit) ) {
                 if (DEBUG_PRINT) {
                     F.viewCFG();
                     errs() << "------------\n";
                     errs() << "incref " << incref->getParent()->getName() << "\n" ;
-                    errs() << "  decref_blocks.size()" << decref_blocks.size() << "\n" ;
+                    errs() << "  decref_blocks.count()" << decref_blocks.count() << "\n" ;
                     incref->dump();
 
                 }
                 // Remove first related decref in each block
-                // for each block
-                for (BasicBlock* each : decref_blocks) {
-                    // for each instruction
-                    for (Instruction &ii : *each) {
-                        CallInst *decref;
-                        // walrus:
-                        // is the current instruction the decref associated with
-                        // the incref under consideration, if so assign to
-                        // decref and continue.
-                        if ( (decref = isRelatedDecref(incref, &ii)) ) {
-                            if (DEBUG_PRINT) {
-                                errs() << decref->getParent()->getName() << "\n";
-                                decref->dump();
-                            }
-                            // Remove this decref from its block
-                            decref->eraseFromParent();
-
-                            // update counters based on decref removal
-                            if (prune_raise_exit)   stats_fanout_raise += 1;
-                            else                    stats_fanout += 1;
-                            break;
-                        }
+                for (unsigned each : decref_blocks.set_bits()) {
+                    CallInst *decref = facts.findDecref(
+                        each, incref->getArgOperand(0));
+                    if (DEBUG_PRINT) {
+                        errs() << decref->getParent()->getName() << "\n";
+                        decref->dump();
                     }
+                    // Remove this decref from its block
+                    facts.eraseDecref(decref);
+
+                    // update counters based on decref removal
+                    function_stats.pruned[prune_raise_exit ?
+                        PRUNE_FANOUT_RAISE : PRUNE_FANOUT] += 1;
                 }
                 // remove the incref from its block
                 incref->eraseFromParent();
 
                 // update counters based on incref removal
-                if (prune_raise_exit)   stats_fanout_raise += 1;
-                else                    stats_fanout += 1;
+                function_stats.pruned[prune_raise_exit ?
+                    PRUNE_FANOUT_RAISE : PRUNE_FANOUT] += 1;
                 mutated = true;
             }
         }
@@ -568,8 +1012,9 @@ struct RefPrunePass : public FunctionPass {
      * found.
      *
      * Parameters:
+     * - facts: the facts about the blocks of the function.
      * - incref: the incref from which fan-out should be checked.
-     * - decref_blocks: pointer to a set of basic blocks, this is mutated by
+     * - decref_blocks: a set of basic block numbers, this is mutated by
      *   this function, on return it contains the basic blocks containing
      *   decrefs related to the incref
      * - prune_raise_exit: this is a bool to signal whether to just look for
@@ -581,50 +1026,50 @@ struct RefPrunePass : public FunctionPass {
      *  - true if the fan-out condition specified by `prune_raise_exit` was
      *    found, false otherwise.
      */
-    bool findFanout(CallInst *incref, SmallBBSet *decref_blocks, bool prune_raise_exit) {
+    bool findFanout(const BlockFacts &facts, CallInst *incref,
+                    BitVector &decref_blocks, bool prune_raise_exit) {
 
         // get the basic block of the incref instruction
-        BasicBlock *head_node = incref->getParent();
+        unsigned head_node = facts.id(incref->getParent());
 
         // work space, a set of basic blocks to hold the block which contain
         // raises, only used in the case of prune_raise_exit
-        SmallBBSet raising_blocks, *p_raising_blocks = NULL;
+        BitVector raising_blocks(facts.size()), *p_raising_blocks = NULL;
         // Set up pointer to raising_blocks
         if( prune_raise_exit ) p_raising_blocks = &raising_blocks;
 
-        if ( findFanoutDecrefCandidates(incref, head_node, decref_blocks, p_raising_blocks) ) {
+        if ( findFanoutDecrefCandidates(facts, incref, head_node,
+                                        decref_blocks, p_raising_blocks) ) {
             if (DEBUG_PRINT) {
-                errs() << "forward pass candids.size() = " << decref_blocks->size() << "\n";
-                errs() << "    " << head_node->getName() << "\n";
+                errs() << "forward pass candids.count() = " << decref_blocks.count() << "\n";
+                errs() << "    " << incref->getParent()->getName() << "\n";
                 incref->dump();
             }
-            if (decref_blocks->size() == 0) {
+            if (decref_blocks.none()) {
                 // no decref blocks
                 if (DEBUG_PRINT) {
-                    errs() << "missing decref blocks = " << raising_blocks.size() << "\n";
+                    errs() << "missing decref blocks = " << raising_blocks.count() << "\n";
                 }
                 return false;
             }
             if ( prune_raise_exit ) {
-                if ( raising_blocks.size() == 0) {
+                if ( raising_blocks.none() ) {
                     // no raising blocks
                     if (DEBUG_PRINT) {
-                        errs() << "missing raising blocks = " << raising_blocks.size() << "\n";
-                        for (auto bb : *decref_blocks){
-                            errs() << "   " << bb->getName() << "\n";
+                        errs() << "missing raising blocks = " << raising_blocks.count() << "\n";
+                        for (unsigned bb : decref_blocks.set_bits()){
+                            errs() << "   " << facts.blocks[bb]->getName() << "\n";
                         }
                     }
                     return false;
                 }
 
                 // combine decref_blocks into raising blocks for checking the exit node condition
-                for ( BasicBlock* bb : *decref_blocks ) {
-                    raising_blocks.insert(bb);
-                }
-                if ( verifyFanoutBackward(incref, head_node, p_raising_blocks) )
+                raising_blocks |= decref_blocks;
+                if ( verifyFanoutBackward(facts, head_node, raising_blocks) )
                     return true;
 
-            } else if ( verifyFanoutBackward(incref, head_node, decref_blocks) ) {
+            } else if ( verifyFanoutBackward(facts, head_node, decref_blocks) ) {
                 return true;
             }
         }
@@ -634,26 +1079,34 @@ struct RefPrunePass : public FunctionPass {
     /**
      * Forward pass.
      *
-     * Walk the successors of the incref node recursively until a decref
-     * or an exit node is found.
+     * Walk the successors of the incref node until a decref or an exit node
+     * is found on each path.
      *
      * In the case of a decref node, the node is added to decref_blocks only if
-     * it contains a decref associated with the incref and there is no interior
-     * back-edge to a predecessor in the current sub-graph.
+     * it contains a decref associated with the incref. Any other decref, and
+     * any back-edge to the incref node, rejects the fan-out.
      *
      * In the case of an exit, it must be a raise for it to be added to
      * raising_blocks.
      *
+     * This is a worklist search visiting each block at most once: the facts
+     * deciding the outcome for a block do not depend on the path leading to
+     * it, so a block already queued needs no second visit, and the interior
+     * back-edges are skipped as such.
+     *
      * Parameters:
+     *  - facts: the facts about the blocks of the function.
      *  - incref: The incref under consideration.
-     *  - cur_node: The basic block in which incref is found.
-     *  - decref_blocks: pointer to a set of basic blocks, it is mutated by this
+     *  - head_node: The basic block in which incref is found.
+     *  - decref_blocks: a set of basic block numbers, it is mutated by this
      *    function and on successful return contains the basic blocks which have
      *    a decref related to the supplied incref in them.
-     *  - raising_blocks: point to a set of basic blocks OR NULL. If not-NULL
-     *    it is mutated by this function and on successful return contains the
-     *    basic blocks which have a raise in them that is reachable from the
-     *    incref.
+     *  - raising_blocks: point to a set of basic block numbers OR NULL. If
+     *    not-NULL it is mutated by this function and on successful return
+     *    contains the basic blocks which have a raise in them that is
+     *    reachable from the incref.
+     *
+     * The search gives up after visiting FANOUT_SEARCH_BUDGET blocks.
      *
      * Return condition:
      *   depends on the value of raising_blocks:
@@ -662,116 +1115,71 @@ struct RefPrunePass : public FunctionPass {
      *      != NULL -> return true iff all paths from the incref have led to
      *                 either a decref or a raising exit.
      */
-    bool findFanoutDecrefCandidates(CallInst *incref,
-                                    BasicBlock *cur_node,
-                                    SmallBBSet *decref_blocks,
-                                    SmallBBSet *raising_blocks) {
-        // stack of basic blocks for the walked path(s)
-        SmallVector<BasicBlock*, FANOUT_RECURSE_DEPTH> path_stack;
-        bool found = false;
-        // Get the terminator of the basic block containing the incref, the
-        // search starts from here.
-        auto term = cur_node->getTerminator();
-
-        // RAII push cur_node onto the work stack
-        raiiStack<SmallVectorImpl<BasicBlock*>> raii_path_stack(path_stack, cur_node);
-
-        // Walk the successors of the terminator.
-        for ( unsigned i=0; i < term->getNumSuccessors(); ++i) {
-            // Get the successor
-            BasicBlock *child = term->getSuccessor(i);
-            // Walk the successor looking for decrefs
-            found = walkChildForDecref(
-                incref, child, path_stack, decref_blocks, raising_blocks
-            );
-            // if not found, return false
-            if (!found) return found;  // found must be false
-        }
-        return found;
-    }
-
-    /**
-     * "Walk" a child node looking for blocks containing decrefs or raises that
-     *  meet the conditions described in findFanoutDecrefCandidates.
-     *
-     * Parameters:
-     * - incref: The incref under consideration
-     * - cur_node: The current basic block being assessed
-     * - path_stack: A stack of basic blocks representing unsearched paths
-     * - decref_blocks: a set that stores references to accepted blocks that
-     *   contain decrefs associated with the incref.
-     * - raising_blocks: a set that stores references to accepted blocks that
-     *   contain raises.
-     *
-     * Returns:
-     *  - true if the conditions above hold, false otherwise.
-     */
-    bool walkChildForDecref(
-        CallInst *incref,
-        BasicBlock *cur_node,
-        SmallVectorImpl<BasicBlock*> &path_stack,
-        SmallBBSet *decref_blocks,
-        SmallBBSet *raising_blocks
-    ) {
-        // If the current path stack exceeds the recursion depth, stop, return
-        // false.
-        if ( path_stack.size() >= FANOUT_RECURSE_DEPTH ) return false;
-
-        // Check for the back-edge condition...
-        // If the current block is in the path stack
-        if ( basicBlockInList(cur_node, path_stack) ) {
-            // If the current node is TOS
-            if ( cur_node == path_stack[0] ) {
-                // Reject interior node back-edge to start of sub-graph.
-                // This means that the incref can be executed multiple times
-                // before reaching the decref.
+    bool findFanoutDecrefCandidates(const BlockFacts &facts,
+                                    CallInst *incref,
+                                    unsigned head_node,
+                                    BitVector &decref_blocks,
+                                    BitVector *raising_blocks) {
+        Value *ptr = incref->getArgOperand(0);
+        size_t budget = FANOUT_SEARCH_BUDGET;
+        // the blocks queued so far, and those left to visit
+        BitVector queued(facts.size());
+        SmallVector<unsigned, 16> worklist;
+
+        // Queue the successors of a node.  Returns false if the node is a
+        // leaf, or has a back-edge to the head node, meaning that the incref
+        // can be executed multiple times before reaching the decref.
+        auto queueChildren = [&](unsigned cur_node) {
+            Instruction *term = facts.blocks[cur_node]->getTerminator();
+            if (term->getNumSuccessors() == 0)
                 return false;
+            for (unsigned i = 0; i < term->getNumSuccessors(); ++i) {
+                unsigned child = facts.id(term->getSuccessor(i));
+                if (child == head_node)
+                    return false;
+                if (!queued.test(child)) {
+                    queued.set(child);
+                    worklist.push_back(child);
+                }
             }
-            // it is a legal backedge; skip
             return true;
-        }
+        };
 
-        // Does the current block have a related decref?
-        if ( hasDecrefInNode(incref, cur_node) ) {
-            // Add to the list of decref_blocks
-            decref_blocks->insert(cur_node);
-            return true;  // done for this path
-        }
-
-        // Are there any decrefs in the current node?
-        if ( hasAnyDecrefInNode(cur_node) ) {
-            // Because we don't know about aliasing
+        if (!queueChildren(head_node))
             return false;
-        }
+        while (!worklist.empty()) {
+            unsigned cur_node = worklist.pop_back_val();
+            // give up once the budget of the search is spent
+            if (budget == 0)
+                return false;
+            --budget;
 
-        // If raising_blocks is non-NULL, see if the current node is a block
-        // which raises, if so add to the raising_blocks list, this path is now
-        // finished.
-        if (raising_blocks && isRaising(cur_node)) {
-            raising_blocks->insert(cur_node);
-            return true;  // done for this path
-        }
+            // Does the current block have a related decref?
+            if (facts.findDecref(cur_node, ptr)) {
+                // Add to the list of decref_blocks
+                decref_blocks.set(cur_node);
+                continue;  // done for this path
+            }
 
-        // Continue searching by recursing into predecessors of the current
-        // block.
-
-        // First RAII push cur_node as TOS
-        raiiStack<SmallVectorImpl<BasicBlock*> > raii_push_pop(path_stack, cur_node);
-        bool found = false;
-        // get cur_node terminator
-        auto term = cur_node->getTerminator();
-        // walk successors of the current node
-        for ( unsigned i=0; i<term->getNumSuccessors(); ++i) {
-            // get a successor
-            BasicBlock *child = term->getSuccessor(i);
-            // recurse
-            found = walkChildForDecref(
-                incref, child, path_stack, decref_blocks, raising_blocks
-            );
-            if (!found) return false;
+            // Are there any decrefs in the current node?
+            if (facts.hasAnyDecref(cur_node)) {
+                // Because we don't know about aliasing
+                return false;
+            }
+
+            // If raising_blocks is non-NULL, see if the current node is a
+            // block which raises, if so add to the raising_blocks list, this
+            // path is now finished.
+            if (raising_blocks && facts.raising.test(cur_node)) {
+                raising_blocks->set(cur_node);
+                continue;  // done for this path
+            }
+
+            // Continue searching from the successors of the current block.
+            if (!queueChildren(cur_node))
+                return false;
         }
-        // If this is a leaf node, returns false.
-        return found;
+        return true;
     }
 
     /**
@@ -781,10 +1189,10 @@ struct RefPrunePass : public FunctionPass {
      * and the tail-nodes cannot be executed multiple times.
      *
      * Parameters:
-     * - incref: the incref instruction
-     * - head_node: the basic block containing the arg incref
+     * - facts: the facts about the blocks of the function.
+     * - head_node: the basic block containing the incref
      * - tail_nodes: a set containing the basic block(s) in which decrefs
-     *   corresponding to the arg incref instruction exist.
+     *   corresponding to the incref instruction exist.
      *
      * Returns:
      * - true if it could be verified that there's no loop structure
@@ -792,62 +1200,59 @@ struct RefPrunePass : public FunctionPass {
      *
      */
     bool verifyFanoutBackward(
-        CallInst *incref,
-        BasicBlock *head_node,
-        const SmallBBSet *tail_nodes
+        const BlockFacts &facts,
+        unsigned head_node,
+        const BitVector &tail_nodes
     ) {
         // push the tail nodes into a work list
-        SmallVector<BasicBlock*, 10> todo;
-        for (BasicBlock *bb: *tail_nodes) {
-            todo.push_back(bb);
+        SmallVector<unsigned, 16> workstack;
+        for (unsigned bb : tail_nodes.set_bits()) {
+            workstack.push_back(bb);
         }
 
+        // the entry block is numbered first
+        const unsigned entry_node = 0;
+
         // visited is for bookkeeping to hold reference to those nodes which
         // have already been visited.
-        SmallBBSet visited;
+        BitVector visited(facts.size());
         // while there is work...
-        while (todo.size() > 0) {
-            SmallVector<BasicBlock*, FANOUT_RECURSE_DEPTH> workstack;
-            // pop an element from the work list into the work stack
-            workstack.push_back(todo.pop_back_val());
-
-            // while there's work on the local workstack
-            while (workstack.size() > 0) {
-                // Get a basic block
-                BasicBlock *cur_node = workstack.pop_back_val();
-                // if the block has been seen before then skip
-                if ( visited.count(cur_node) ) {
-                    // Already visited
-                    continue;  // skip
-                }
+        while (workstack.size() > 0) {
+            // Get a basic block
+            unsigned cur_node = workstack.pop_back_val();
+            // if the block has been seen before then skip
+            if ( visited.test(cur_node) ) {
+                // Already visited
+                continue;  // skip
+            }
 
-                if ( cur_node == &head_node->getParent()->getEntryBlock() ) {
-                    // Arrived at the entry node of the function.
-                    // This means the reverse walk from a tail-node can
-                    // bypass the head-node (incref node) of this fanout
-                    // subgraph.
+            if ( cur_node == entry_node ) {
+                // Arrived at the entry node of the function.
+                // This means the reverse walk from a tail-node can
+                // bypass the head-node (incref node) of this fanout
+                // subgraph.
+                return false;
+            }
+
+            // remember that we have visited this node already
+            visited.set(cur_node);
+
+            // Walk into all predecessors
+            // pred_begin and pred_end are defined under Functions in:
+            // http://llvm.org/doxygen/IR_2CFG_8h.html
+            BasicBlock *cur_bb = facts.blocks[cur_node];
+            auto it = pred_begin(cur_bb), end = pred_end(cur_bb);
+            for (; it != end; ++it ) {
+                unsigned pred = facts.id(*it);
+                if ( tail_nodes.test(pred) ) {
+                    // reject because a predecessor is a block containing
+                    // a decref matching the incref
                     return false;
                 }
-
-                // remember that we have visited this node already
-                visited.insert(cur_node);
-
-                // Walk into all predecessors
-                // pred_begin and pred_end are defined under Functions in:
-                // http://llvm.org/doxygen/IR_2CFG_8h.html
-                auto it = pred_begin(cur_node), end = pred_end(cur_node);
-                for (; it != end; ++it ) {
-                    auto pred = *it;
-                    if ( tail_nodes->count(pred) ) {
-                        // reject because a predecessor is a block containing
-                        // a decref matching the incref
-                        return false;
-                    }
-                    if ( pred != head_node ) {
-                        // If the predecessor is the head-node,
-                        // this path is ok; otherwise, continue to walk up.
-                        workstack.push_back(pred);
-                    }
+                if ( pred != head_node ) {
+                    // If the predecessor is the head-node,
+                    // this path is ok; otherwise, continue to walk up.
+                    workstack.push_back(pred);
                 }
             }
         }
@@ -896,69 +1301,152 @@ struct RefPrunePass : public FunctionPass {
     }
 
     /**
-     * Does "Is a basic block in a given list"
+     * Loop hoisting pass.
      *
-     * Template parameter <T>:
-     *  - the type of list
+     * Looks for incref/decref pairs executed once by each iteration of a loop
+     * on a pointer defined outside of the loop, and moves them out of it: the
+     * incref to the preheader and a decref to each exit. For example:
      *
-     * Parameters:
-     *  - bb  a basic block
-     *  - list a list-like container in which to search
+     *        ┌────────────┐               ┌────────────┐
+     *        │ preheader  │               │ incref (A) │
+     *        └────────────┘               └────────────┘
+     *              │                            │
+     *        ┌────────────┐               ┌────────────┐
+     *   ┌──> │ incref (A) │          ┌──> │            │
+     *   │    │ ...        │   ==>    │    │ ...        │
+     *   │    │ decref (A) │          │    │            │
+     *   │    └────────────┘          │    └────────────┘
+     *   └──────────┤                 └──────────┤
+     *        ┌────────────┐               ┌────────────┐
+     *        │ exit       │               │ decref (A) │
+     *        └────────────┘               └────────────┘
      *
-     * Returns:
-     *  - true if bb is in list, false else.
-     */
-    template<class T>
-    bool basicBlockInList(const BasicBlock* bb, const T &list){
-        for (BasicBlock *each : list) {
-            if (bb == each) return true;
-        }
-        return false;
-    }
-
-    /**
-     * Check to see if a basic block contains a decref related to a given incref
+     * The count of A is then at least as high as before anywhere in the loop
+     * and the same outside of it, so unlike for the other subpasses, decrefs
+     * of other pointers in the loop do not matter. The refops hoisted can be
+     * pruned by the other subpasses in turn.
      *
      * Parameters:
-     *  - incref an incref
-     *  - bb  a basic block
+     *  - F a Function
      *
      * Returns:
-     *  - true if basic block bb contains a decref related to incref, false
-     *    otherwise.
+     *  - true if pruning took place, false otherwise
+     *
      */
-    bool hasDecrefInNode(CallInst* incref, BasicBlock* bb){
-        for (Instruction &ii : *bb) {
-            if (isRelatedDecref(incref, &ii) != NULL) {
-                return true;
+    bool runLoopPrune(Function &F) {
+        bool mutated = false;
+
+        LoopInfo &loopinfo = getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
+        if (loopinfo.empty())
+            return mutated;
+        auto &domtree = getAnalysis<DominatorTreeWrapperPass>().getDomTree();
+
+        std::vector<CallInst*> incref_list, decref_list;
+        listRefOps(F, &RefPrunePass::IsIncRef, incref_list);
+        listRefOps(F, &RefPrunePass::IsDecRef, decref_list);
+
+        RefOpsByArg decrefs_by_arg;
+        for (CallInst* decref : decref_list) {
+            decrefs_by_arg[decref->getArgOperand(0)].push_back(decref);
+        }
+
+        for (CallInst* incref : incref_list) {
+            // the innermost loop of the incref, on a pointer defined outside
+            Loop *loop = loopinfo.getLoopFor(incref->getParent());
+            if (loop == NULL) continue;
+            if (!loop->isLoopInvariant(incref->getArgOperand(0))) continue;
+
+            auto related = decrefs_by_arg.find(incref->getArgOperand(0));
+            if (related == decrefs_by_arg.end()) continue;
+
+            for (CallInst*& decref : related->second) {
+                // NULL is the token for already erased, skip on it
+                if (decref == NULL) continue;
+
+                SmallVector<BasicBlock*, 4> exits;
+                if (!isHoistablePair(loopinfo, domtree, loop, incref, decref,
+                                     exits))
+                    continue;
+
+                if (DEBUG_PRINT) {
+                    errs() << "Prune: hoisting pair out of loop:\n";
+                    incref->dump();
+                    decref->dump();
+                    loop->dump();
+                }
+
+                // the incref goes at the end of the preheader, and a decref
+                // at the start of each exit
+                incref->moveBefore(loop->getLoopPreheader()->getTerminator());
+                for (BasicBlock *exit : exits) {
+                    decref->clone()->insertBefore(&*exit->getFirstInsertionPt());
+                }
+                decref->eraseFromParent();
+                decref = NULL;
+
+                // the pair is moved, not pruned, count it apart
+                function_stats.pruned[PRUNE_LOOP_HOIST] += 1;
+                mutated = true;
+                break;
             }
         }
-        return false;
+        return mutated;
     }
 
     /**
-     * Checks if an instruction is a decref that is related to the given incref.
+     * Checks if an incref and a decref of a loop can be hoisted out of it.
+     * Both must be executed at most once per iteration, the incref first,
+     * and each iteration must execute either both of them or none of them:
+     * the iterations going round execute both, and the iterations leaving
+     * the loop leave it before or after both.
      *
      * Parameters:
+     *  - loopinfo the loop info of the function
+     *  - domtree the dominator tree of the function
+     *  - loop the innermost loop of the incref
      *  - incref an incref
-     *  - bb  a basic block
+     *  - decref a decref on the same pointer
+     *  - exits receives the exit blocks of the loop
      *
      * Returns:
-     *  - returns input ii as a CallInst* if it is a decref related to incref,
-     *    NULL otherwise.
+     *  - true if the refops can be hoisted, false otherwise
      */
-    CallInst* isRelatedDecref(CallInst *incref, Instruction *ii) {
-        CallInst *suspect;
-        if ( (suspect = GetRefOpCall(ii))  ){
-            if ( !IsDecRef(suspect) ) {
-                return NULL;
-            }
-            if (incref->getArgOperand(0) != suspect->getArgOperand(0)) {
-                return NULL;
-            }
-            return suspect;
+    bool isHoistablePair(LoopInfo &loopinfo, DominatorTree &domtree,
+                         Loop *loop, CallInst *incref, CallInst *decref,
+                         SmallVectorImpl<BasicBlock*> &exits) {
+        BasicBlock *incref_bb = incref->getParent();
+        BasicBlock *decref_bb = decref->getParent();
+
+        // blocks outside of inner loops run at most once per iteration
+        if (loopinfo.getLoopFor(decref_bb) != loop) return false;
+        if (!domtree.dominates(incref, decref)) return false;
+
+        // the refops need somewhere to go, which is not reached from
+        // outside of the loop
+        if (loop->getLoopPreheader() == NULL || !loop->hasDedicatedExits())
+            return false;
+        loop->getUniqueExitBlocks(exits);
+        if (exits.empty()) return false;
+        for (BasicBlock *exit : exits) {
+            if (exit->isEHPad()) return false;
         }
-        return NULL;
+
+        SmallVector<BasicBlock*, 4> latches;
+        loop->getLoopLatches(latches);
+        for (BasicBlock *latch : latches) {
+            if (!domtree.dominates(decref_bb, latch)) return false;
+        }
+
+        SmallVector<BasicBlock*, 4> exiting_blocks;
+        loop->getExitingBlocks(exiting_blocks);
+        for (BasicBlock *exiting : exiting_blocks) {
+            if (loopinfo.getLoopFor(exiting) != loop) return false;
+            bool after = domtree.dominates(decref_bb, exiting);
+            bool before = exiting != incref_bb
+                          && domtree.dominates(exiting, incref_bb);
+            if (!after && !before) return false;
+        }
+        return true;
     }
 
     /**
@@ -967,6 +1455,8 @@ struct RefPrunePass : public FunctionPass {
     void getAnalysisUsage(AnalysisUsage &Info) const override {
         Info.addRequired<DominatorTreeWrapperPass>();
         Info.addRequired<PostDominatorTreeWrapperPass>();
+        if (isSubpassEnabledFor(Subpasses::LoopHoist))
+            Info.addRequired<LoopInfoWrapperPass>();
     }
 
     /**
@@ -986,21 +1476,47 @@ struct RefPrunePass : public FunctionPass {
     }
 
     /**
-     * Scans a basic block for decrefs and returns true if one is found,
-     *  false otherwise
+     * Checks if a call, which is not a refop, may release a reference to a
+     * pointer according to the summary of its callee.
      *
      * Parameters:
-     *  - bb, a basic block
+     *  - call_inst, a call instruction to check.
+     *  - ptr, the pointer, or NULL for any of the operands of call_inst
      *
      * Returns:
-     *  - true if there is a decref in the basic block, false otherwise.
+     *  - true if call_inst may release a reference to ptr, false otherwise
      */
-    bool hasAnyDecrefInNode(BasicBlock *bb) {
-        for (Instruction &ii: *bb) {
-            CallInst* refop = GetRefOpCall(&ii);
-            if (refop != NULL && IsDecRef(refop)) {
+    bool mayRelease(CallInst *call_inst, const Value *ptr) {
+        return callees.getCallEffect(call_inst, ptr) & REFOP_CONSUMES;
+    }
+
+    /**
+     * Checks if a call releasing a reference to the pointer of an incref and
+     * a decref in the same block is between them.
+     *
+     * Parameters:
+     *  - releases_by_arg, the releasing calls of the block by pointer
+     *  - positions, the positions of the calls and refops in the block
+     *  - incref, the incref
+     *  - decref, the decref of the same pointer
+     *
+     * Returns:
+     *  - true if there is a releasing call between them, false otherwise
+     */
+    bool isReleasedBetween(const RefOpsByArg &releases_by_arg,
+                           const DenseMap<const CallInst*, unsigned> &positions,
+                           CallInst *incref, CallInst *decref) {
+        auto releases = releases_by_arg.find(incref->getArgOperand(0));
+        if (releases == releases_by_arg.end())
+            return false;
+        unsigned first = positions.lookup(incref);
+        unsigned last = positions.lookup(decref);
+        if (first > last)
+            std::swap(first, last);
+        for (CallInst *release : releases->second) {
+            unsigned position = positions.lookup(release);
+            if (first < position && position < last)
                 return true;
-            }
         }
         return false;
     }
@@ -1011,6 +1527,7 @@ struct RefPrunePass : public FunctionPass {
      * NOTE: Required condition: head_node dominates tail_node
      *
      * Parameters:
+     *  - facts, the facts about the blocks of the function
      *  - head_node, a basic block which is the head of the graph
      *  - tail_node, a basic block which is the tail of the graph
      *
@@ -1018,36 +1535,37 @@ struct RefPrunePass : public FunctionPass {
      *  - true if there is a decref, false else
      *
      */
-    bool hasDecrefBetweenGraph(BasicBlock *head_node, BasicBlock *tail_node) {
+    bool hasDecrefBetweenGraph(const BlockFacts &facts, unsigned head_node,
+                               unsigned tail_node) {
         // This function implements a depth-first search.
 
         // visited keeps track of the visited blocks
-        SmallBBSet visited;
+        BitVector visited(facts.size());
         // stack keeps track of blocks to be checked.
-        SmallVector<BasicBlock*, 20> stack;
+        SmallVector<unsigned, 20> stack;
         // start with the head_node;
         stack.push_back(head_node);
         do {
-            BasicBlock *cur_node = stack.pop_back_val();
+            unsigned cur_node = stack.pop_back_val();
             // First, is the current BB already visited, if so return false,
             // its already been checked.
-            if (visited.count(cur_node)) {
+            if (visited.test(cur_node)) {
                 continue; // skip
             }
             // remember that it is visited
-            visited.insert(cur_node);
+            visited.set(cur_node);
             if (DEBUG_PRINT) {
-                errs() << "Check..." << cur_node->getName() << "\n";
+                errs() << "Check..." << facts.blocks[cur_node]->getName() << "\n";
             }
 
             // scan the current BB for decrefs, if any are present return true
-            if (hasAnyDecrefInNode(cur_node)) return true;
+            if (facts.hasAnyDecref(cur_node)) return true;
 
             // get the terminator of the current node
-            Instruction *term = cur_node->getTerminator();
+            Instruction *term = facts.blocks[cur_node]->getTerminator();
             // walk the successor blocks
             for (unsigned i=0; i < term->getNumSuccessors(); ++i) {
-                BasicBlock *child = term->getSuccessor(i);
+                unsigned child = facts.id(term->getSuccessor(i));
                 // if the successor is the tail node, skip
                 if (child == tail_node)
                     continue;
@@ -1059,7 +1577,37 @@ struct RefPrunePass : public FunctionPass {
         return false;
     }
 
-    typedef bool(*test_refops_function)(CallInst*);
+    /**
+     * Computes the facts about the blocks of F.
+     *
+     * Parameters:
+     *  - F a Function
+     *  - facts the facts to fill
+     */
+    void getBlockFacts(Function &F, BlockFacts &facts) {
+        facts.raising.resize(F.size());
+        facts.releasing.resize(F.size());
+        facts.decrefs.resize(F.size());
+        for (BasicBlock &bb : F) {
+            unsigned id = facts.blocks.size();
+            facts.ids[&bb] = id;
+            facts.blocks.push_back(&bb);
+            for (Instruction &ii : bb) {
+                CallInst *refop = GetRefOpCall(&ii);
+                if (refop != NULL) {
+                    if (IsDecRef(refop))
+                        facts.decrefs[id].push_back(refop);
+                } else if (CallInst *call_inst = dyn_cast<CallInst>(&ii)) {
+                    if (mayRelease(call_inst, NULL))
+                        facts.releasing.set(id);
+                }
+            }
+            if (isRaising(&bb))
+                facts.raising.set(id);
+        }
+    }
+
+    typedef bool(RefOpPass::*test_refops_function)(CallInst*) const;
 
     /**
      * Walks the basic blocks of a function F, scans each instruction, if the
@@ -1087,7 +1635,7 @@ struct RefPrunePass : public FunctionPass {
                 if ( (ci = GetRefOpCall(&ii)) ) {
                     // and the test_refops_function returns true when called
                     // on the instruction
-                    if ( fn(ci) ) {
+                    if ( (this->*fn)(ci) ) {
                         // add to the list
                         list.push_back(ci);
                     }
@@ -1101,10 +1649,7 @@ struct RefPrunePass : public FunctionPass {
 char RefNormalizePass::ID = 0;
 char RefPrunePass::ID = 0;
 
-size_t RefPrunePass::stats_per_bb = 0;
-size_t RefPrunePass::stats_diamond = 0;
-size_t RefPrunePass::stats_fanout = 0;
-size_t RefPrunePass::stats_fanout_raise = 0;
+std::atomic<size_t> RefPrunePass::total_pruned[NUM_PRUNE_SUBPASSES] = {};
 
 INITIALIZE_PASS(RefNormalizePass, "nrtrefnormalizepass",
                 "Normalize NRT refops", false, false)
@@ -1113,53 +1658,106 @@ INITIALIZE_PASS_BEGIN(RefPrunePass, "nrtrefprunepass",
                       "Prune NRT refops", false, false)
 INITIALIZE_PASS_DEPENDENCY(DominatorTreeWrapperPass)
 INITIALIZE_PASS_DEPENDENCY(PostDominatorTreeWrapperPass)
+INITIALIZE_PASS_DEPENDENCY(LoopInfoWrapperPass)
 
 INITIALIZE_PASS_END(RefPrunePass, "refprunepass",
                     "Prune NRT refops", false, false)
 extern "C" {
 
+/**
+ * Add the refprune passes to the pass manager.  If *Stats* is not NULL, the
+ * passes add their statistics to it.  The calls to the functions named by
+ * *IncrefNames* and *DecrefNames* are the refops, the functions of Numba's
+ * runtime if the names are NULL.
+ */
 API_EXPORT(void)
-LLVMPY_AddRefPrunePass(LLVMPassManagerRef PM, int subpasses)
+LLVMPY_AddRefPrunePass(LLVMPassManagerRef PM, int subpasses,
+                       LLVMPYRefPruneStatsRef Stats,
+                       const char **IncrefNames, size_t NumIncrefs,
+                       const char **DecrefNames, size_t NumDecrefs)
 {
-    unwrap(PM)->add(new RefNormalizePass());
-    unwrap(PM)->add(new RefPrunePass((RefPrunePass::Subpasses)subpasses));
+    RefOpNames names;
+    if (IncrefNames)
+        names.increfs.assign(IncrefNames, IncrefNames + NumIncrefs);
+    if (DecrefNames)
+        names.decrefs.assign(DecrefNames, DecrefNames + NumDecrefs);
+    unwrap(PM)->add(new RefNormalizePass(names));
+    unwrap(PM)->add(new RefPrunePass((RefPrunePass::Subpasses)subpasses,
+                                     Stats, names));
 }
 
 
-/**
- * Struct for holding statistics about the amount of pruning performed by
- * each type of pruning algorithm.
- */
-typedef struct PruneStats {
-    size_t basicblock;
-    size_t diamond;
-    size_t fanout;
-    size_t fanout_raise;
-} PRUNESTATS;
-
-
 API_EXPORT(void)
 LLVMPY_DumpRefPruneStats(PRUNESTATS *buf, bool do_print)
 {
-    /* PRUNESTATS is updated with the statistics about what has been pruned from
-     * the RefPrunePass static state vars. This isn't threadsafe but neither is
-     * the LLVM pass infrastructure so it's all done under a python thread lock.
+    /* PRUNESTATS is updated with the statistics about what has been pruned
+     * by all the RefPrunePass instances of the process.
      *
      * do_print if set will print the stats to stderr.
      */
+    setPruneStats(buf, RefPrunePass::total_pruned);
+
     if (do_print) {
         errs() << "refprune stats "
-            << "per-BB " << RefPrunePass::stats_per_bb << " "
-            << "diamond " << RefPrunePass::stats_diamond << " "
-            << "fanout " << RefPrunePass::stats_fanout << " "
-            << "fanout+raise " << RefPrunePass::stats_fanout_raise << " "
+            << "per-BB " << buf->basicblock << " "
+            << "diamond " << buf->diamond << " "
+            << "fanout " << buf->fanout << " "
+            << "fanout+raise " << buf->fanout_raise << " "
+            << "loop-hoisted pairs " << buf->hoisted << " "
             << "\n";
     };
+}
+
+API_EXPORT(LLVMPYRefPruneStatsRef)
+LLVMPY_CreateRefPruneStats()
+{
+    LLVMPYRefPruneStats *stats = new LLVMPYRefPruneStats();
+    stats->Retain();
+    return stats;
+}
 
-    buf->basicblock = RefPrunePass::stats_per_bb;
-    buf->diamond = RefPrunePass::stats_diamond;
-    buf->fanout = RefPrunePass::stats_fanout;
-    buf->fanout_raise = RefPrunePass::stats_fanout_raise;
+/*
+ * Release the caller's reference, the passes using the statistics keep
+ * them alive until they are destroyed.
+ */
+API_EXPORT(void)
+LLVMPY_DisposeRefPruneStats(LLVMPYRefPruneStatsRef Stats)
+{
+    Stats->Release();
+}
+
+API_EXPORT(void)
+LLVMPY_GetRefPruneStats(LLVMPYRefPruneStatsRef Stats, PRUNESTATS *buf)
+{
+    setPruneStats(buf, Stats->pruned);
+}
+
+/*
+ * Fill the arrays with the statistics of up to *Count* functions, in no
+ * particular order, and return the number of functions pruned, which may
+ * be more.  *Names* receives strings to free with LLVMPY_DisposeString,
+ * and *Times* the times of the subpasses of each function, in the order of
+ * the fields of PRUNESTATS.
+ */
+API_EXPORT(size_t)
+LLVMPY_GetRefPruneFunctionStats(LLVMPYRefPruneStatsRef Stats, size_t Count,
+                                const char **Names, size_t *Runs,
+                                PRUNESTATS *Pruned, double *Times)
+{
+    std::lock_guard<std::mutex> guard(Stats->lock);
+    size_t i = 0;
+    for (auto &entry : Stats->functions) {
+        if (i >= Count)
+            break;
+        const FunctionPruneStats &stats = entry.getValue();
+        Names[i] = LLVMPY_CreateString(entry.getKey().str().c_str());
+        Runs[i] = stats.runs;
+        setPruneStats(&Pruned[i], stats.pruned);
+        for (int j = 0; j < NUM_PRUNE_SUBPASSES; ++j)
+            Times[i * NUM_PRUNE_SUBPASSES + j] = stats.times[j];
+        ++i;
+    }
+    return Stats->functions.size();
 }
 
 
@@ -11,7 +11,10 @@
 #include "llvm/ExecutionEngine/JITEventListener.h"
 #include "llvm/ExecutionEngine/ObjectCache.h"
 #include "llvm/Support/Memory.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/TimeProfiler.h"
 
+#include <cstdint>
 #include <cstdio>
 #include <memory>
 
@@ -69,6 +72,7 @@ LLVMPY_RemoveModule(LLVMExecutionEngineRef EE,
 API_EXPORT(void)
 LLVMPY_FinalizeObject(LLVMExecutionEngineRef EE)
 {
+    llvm::TimeTraceScope timeScope("FinalizeObject", "");
     llvm::unwrap(EE)->finalizeObject();
 }
 
@@ -205,6 +209,7 @@ typedef struct {
     LLVMModuleRef modref;
     const char *buf_ptr;
     size_t buf_len;
+    const char *path;
 } ObjectCacheData;
 
 typedef void (*ObjectCacheNotifyFunc)(void *, const ObjectCacheData *);
@@ -227,28 +232,46 @@ public:
         if (notify_func) {
             ObjectCacheData data = { llvm::wrap(M),
                                      MBR.getBufferStart(),
-                                     MBR.getBufferSize() };
+                                     MBR.getBufferSize(),
+                                     nullptr };
             notify_func(user_data, &data);
         }
     }
 
     // MCJIT will call this function before compiling any module
-    // MCJIT takes ownership of both the MemoryBuffer object and the memory
-    // to which it refers.
+    // MCJIT takes ownership of the MemoryBuffer object, which it keeps
+    // as long as the engine.  The callback either sets:
+    // - path, allocated with LLVMPY_CreateString, to load the object
+    //   from a file, which is mapped rather than read if large enough;
+    // - or buf_ptr and buf_len, referring to memory which the caller
+    //   keeps alive and unchanged for the lifetime of the engine, and
+    //   which is used in place.
     virtual std::unique_ptr<llvm::MemoryBuffer> getObject(const llvm::Module* M)
     {
         std::unique_ptr<llvm::MemoryBuffer> res = nullptr;
 
         if (getobject_func) {
-            ObjectCacheData data = { llvm::wrap(M), nullptr, 0 };
+            ObjectCacheData data = { llvm::wrap(M), nullptr, 0, nullptr };
 
             getobject_func(user_data, &data);
-            if (data.buf_ptr && data.buf_len > 0) {
-                // Assume the returned string was allocated
-                // with LLVMPY_CreateByteString
-                res = llvm::MemoryBuffer::getMemBufferCopy(
-                    llvm::StringRef(data.buf_ptr, data.buf_len));
-                LLVMPY_DisposeString(data.buf_ptr);
+            if (data.path) {
+                auto buf = llvm::MemoryBuffer::getFile(
+                    data.path, /*FileSize=*/-1,
+                    /*RequiresNullTerminator=*/false);
+                LLVMPY_DisposeString(data.path);
+                // A missing file means the module is compiled normally
+                if (buf)
+                    res = std::move(*buf);
+            } else if (data.buf_ptr && data.buf_len > 0) {
+                llvm::StringRef obj(data.buf_ptr, data.buf_len);
+                // The object file readers expect aligned headers
+                if (reinterpret_cast<uintptr_t>(data.buf_ptr)
+                        % alignof(uint64_t) == 0) {
+                    res = llvm::MemoryBuffer::getMemBuffer(
+                        obj, "", /*RequiresNullTerminator=*/false);
+                } else {
+                    res = llvm::MemoryBuffer::getMemBufferCopy(obj);
+                }
             }
         }
         return res;
@@ -0,0 +1,1213 @@
+/*
+ * Build a module from the binary encoding of an llvmlite.ir module written
+ * by llvmlite/binding/irstream.py, with IRBuilder rather than by formatting
+ * and parsing textual IR.
+ *
+ * The stream is an array of 64-bit words holding records, each starting
+ * with its opcode, and a blob holding all the strings, which are referred
+ * to by offset and size.  Types and values are referred to by their index
+ * in tables appended to by the records defining them: every type record
+ * defines a type, every constant, global and instruction record defines a
+ * value.  The values local to a function body are dropped at its end.
+ * Values used before their definition, such as phi incomings, are defined
+ * as placeholders by a forward record and replaced once defined.
+ *
+ * Malformed streams are reported as errors rather than building invalid
+ * IR; the caller then falls back on parsing textual IR, which gives a
+ * precise diagnostic.
+ */
+
+#include "core.h"
+
+#include "llvm/ADT/APFloat.h"
+#include "llvm/ADT/APInt.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/Attributes.h"
+#include "llvm/IR/CallingConv.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/NoFolder.h"
+#include "llvm/IR/Operator.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/TimeProfiler.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace {
+
+using namespace llvm;
+
+/*
+ * Record opcodes, kept in sync with llvmlite/binding/irstream.py.
+ */
+enum Record {
+    REC_MODULE = 1,
+
+    REC_TYPE_VOID = 10,
+    REC_TYPE_INT = 11,
+    REC_TYPE_HALF = 12,
+    REC_TYPE_FLOAT = 13,
+    REC_TYPE_DOUBLE = 14,
+    REC_TYPE_POINTER = 15,
+    REC_TYPE_FUNCTION = 16,
+    REC_TYPE_ARRAY = 17,
+    REC_TYPE_VECTOR = 18,
+    REC_TYPE_STRUCT = 19,
+    REC_TYPE_NAMED = 20,
+    REC_TYPE_BODY = 21,
+
+    REC_GLOBAL_VARIABLE = 30,
+    REC_FUNCTION = 31,
+    REC_INITIALIZER = 32,
+
+    REC_CONST_INT = 40,
+    REC_CONST_WIDE_INT = 41,
+    REC_CONST_FP = 42,
+    REC_CONST_NULL = 43,
+    REC_CONST_UNDEF = 44,
+    REC_CONST_AGGREGATE = 45,
+    REC_CONST_STRING = 46,
+
+    REC_BODY = 50,
+    REC_BLOCK = 51,
+    REC_END = 52,
+    REC_FORWARD = 53,
+    REC_RESOLVE = 54,
+
+    REC_BINOP = 60,
+    REC_ICMP = 61,
+    REC_FCMP = 62,
+    REC_CAST = 63,
+    REC_SELECT = 64,
+    REC_LOAD = 65,
+    REC_STORE = 66,
+    REC_ALLOCA = 67,
+    REC_GEP = 68,
+    REC_PHI = 69,
+    REC_CALL = 70,
+    REC_RET = 71,
+    REC_BR = 72,
+    REC_CONDBR = 73,
+    REC_SWITCH = 74,
+    REC_UNREACHABLE = 75,
+    REC_EXTRACTVALUE = 76,
+    REC_INSERTVALUE = 77,
+    REC_EXTRACTELEMENT = 78,
+    REC_INSERTELEMENT = 79,
+    REC_SHUFFLEVECTOR = 80,
+};
+
+/*
+ * Instruction flags, as a bit set.
+ */
+enum Flag {
+    FLAG_NUW = 1 << 0,
+    FLAG_NSW = 1 << 1,
+    FLAG_EXACT = 1 << 2,
+    FLAG_NNAN = 1 << 3,
+    FLAG_NINF = 1 << 4,
+    FLAG_NSZ = 1 << 5,
+    FLAG_ARCP = 1 << 6,
+    FLAG_CONTRACT = 1 << 7,
+    FLAG_AFN = 1 << 8,
+    FLAG_REASSOC = 1 << 9,
+    FLAG_TAIL = 1 << 10,
+};
+
+const int64_t FastMathFlagsMask = FLAG_NNAN | FLAG_NINF | FLAG_NSZ |
+                                  FLAG_ARCP | FLAG_CONTRACT | FLAG_AFN |
+                                  FLAG_REASSOC;
+
+/*
+ * The operations, predicates, linkages and attributes below are referred
+ * to by their index, in the order of the lists in irstream.py.
+ */
+const Instruction::BinaryOps BinaryOps[] = {
+    Instruction::Add,  Instruction::FAdd, Instruction::Sub,  Instruction::FSub,
+    Instruction::Mul,  Instruction::FMul, Instruction::UDiv, Instruction::SDiv,
+    Instruction::FDiv, Instruction::URem, Instruction::SRem, Instruction::FRem,
+    Instruction::Shl,  Instruction::LShr, Instruction::AShr, Instruction::And,
+    Instruction::Or,   Instruction::Xor,
+};
+
+const Instruction::CastOps CastOps[] = {
+    Instruction::Trunc,    Instruction::ZExt,          Instruction::SExt,
+    Instruction::FPTrunc,  Instruction::FPExt,         Instruction::BitCast,
+    Instruction::AddrSpaceCast, Instruction::FPToUI,   Instruction::UIToFP,
+    Instruction::FPToSI,   Instruction::SIToFP,        Instruction::PtrToInt,
+    Instruction::IntToPtr,
+};
+
+const CmpInst::Predicate ICmpPredicates[] = {
+    CmpInst::ICMP_EQ,  CmpInst::ICMP_NE,  CmpInst::ICMP_UGT, CmpInst::ICMP_UGE,
+    CmpInst::ICMP_ULT, CmpInst::ICMP_ULE, CmpInst::ICMP_SGT, CmpInst::ICMP_SGE,
+    CmpInst::ICMP_SLT, CmpInst::ICMP_SLE,
+};
+
+const CmpInst::Predicate FCmpPredicates[] = {
+    CmpInst::FCMP_FALSE, CmpInst::FCMP_OEQ, CmpInst::FCMP_OGT,
+    CmpInst::FCMP_OGE,   CmpInst::FCMP_OLT, CmpInst::FCMP_OLE,
+    CmpInst::FCMP_ONE,   CmpInst::FCMP_ORD, CmpInst::FCMP_UEQ,
+    CmpInst::FCMP_UGT,   CmpInst::FCMP_UGE, CmpInst::FCMP_ULT,
+    CmpInst::FCMP_ULE,   CmpInst::FCMP_UNE, CmpInst::FCMP_UNO,
+    CmpInst::FCMP_TRUE,
+};
+
+const GlobalValue::LinkageTypes Linkages[] = {
+    GlobalValue::ExternalLinkage,     GlobalValue::AvailableExternallyLinkage,
+    GlobalValue::LinkOnceAnyLinkage,  GlobalValue::LinkOnceODRLinkage,
+    GlobalValue::WeakAnyLinkage,      GlobalValue::WeakODRLinkage,
+    GlobalValue::AppendingLinkage,    GlobalValue::InternalLinkage,
+    GlobalValue::PrivateLinkage,      GlobalValue::ExternalWeakLinkage,
+    GlobalValue::CommonLinkage,
+};
+
+const GlobalValue::DLLStorageClassTypes DLLStorageClasses[] = {
+    GlobalValue::DefaultStorageClass,
+    GlobalValue::DLLImportStorageClass,
+    GlobalValue::DLLExportStorageClass,
+};
+
+const Attribute::AttrKind AttrKinds[] = {
+    // Function attributes
+    Attribute::ArgMemOnly, Attribute::AlwaysInline, Attribute::Builtin,
+    Attribute::Cold, Attribute::InaccessibleMemOnly,
+    Attribute::InaccessibleMemOrArgMemOnly, Attribute::InlineHint,
+    Attribute::JumpTable, Attribute::MinSize, Attribute::Naked,
+    Attribute::NoBuiltin, Attribute::NoDuplicate, Attribute::NoImplicitFloat,
+    Attribute::NoInline, Attribute::NonLazyBind, Attribute::NoRecurse,
+    Attribute::NoRedZone, Attribute::NoReturn, Attribute::NoUnwind,
+    Attribute::OptimizeNone, Attribute::OptimizeForSize, Attribute::ReadNone,
+    Attribute::ReadOnly, Attribute::ReturnsTwice, Attribute::SanitizeAddress,
+    Attribute::SanitizeMemory, Attribute::SanitizeThread,
+    Attribute::StackProtect, Attribute::StackProtectStrong,
+    Attribute::UWTable,
+    // Parameter and return value attributes
+    Attribute::InReg, Attribute::Nest, Attribute::NoAlias,
+    Attribute::NoCapture, Attribute::NonNull, Attribute::Returned,
+    Attribute::SExt, Attribute::ZExt,
+    // Integer attributes
+    Attribute::Alignment, Attribute::StackAlignment,
+    Attribute::Dereferenceable, Attribute::DereferenceableOrNull,
+};
+
+template <typename T, size_t N>
+constexpr size_t
+tableSize(const T (&)[N])
+{
+    return N;
+}
+
+template <typename T>
+void
+setAlignment(T *Object, uint64_t Align)
+{
+#if LLVM_VERSION_MAJOR >= 11
+    Object->setAlignment(llvm::Align(Align));
+#elif LLVM_VERSION_MAJOR >= 10
+    Object->setAlignment(llvm::MaybeAlign(Align));
+#else
+    Object->setAlignment(Align);
+#endif
+}
+
+class StreamDecoder {
+public:
+    StreamDecoder(LLVMContext &Ctx, const int64_t *Words, size_t Count,
+                  const char *Strings, size_t StringsSize)
+        : Ctx(Ctx), Builder(Ctx), Words(Words), Count(Count), Pos(0),
+          Strings(Strings), StringsSize(StringsSize), F(nullptr),
+          FunctionBase(0)
+    {}
+
+    ~StreamDecoder() {
+        // The module's instructions must release the placeholders first
+        M.reset();
+        for (Argument *A : Placeholders)
+            delete A;
+    }
+
+    /*
+     * Decode the whole stream, returning the module or nullptr on error.
+     */
+    std::unique_ptr<Module> decode();
+
+    const std::string &error() const { return Error; }
+
+private:
+    bool fail(const Twine &Message) {
+        if (Error.empty())
+            Error = Message.str();
+        return false;
+    }
+
+    int64_t next() {
+        if (Pos >= Count) {
+            fail("truncated stream");
+            return 0;
+        }
+        return Words[Pos++];
+    }
+
+    size_t index(size_t Size, const char *What) {
+        int64_t I = next();
+        if (I < 0 || (size_t)I >= Size) {
+            fail(Twine("invalid ") + What + " reference");
+            return Size;
+        }
+        return I;
+    }
+
+    StringRef string() {
+        int64_t Offset = next();
+        int64_t Size = next();
+        if (Offset < 0 || Size < 0 || (size_t)(Offset + Size) > StringsSize) {
+            fail("invalid string reference");
+            return StringRef();
+        }
+        return StringRef(Strings + Offset, Size);
+    }
+
+    Type *type() {
+        size_t I = index(Types.size(), "type");
+        return I < Types.size() ? Types[I] : nullptr;
+    }
+
+    Value *value() {
+        size_t I = index(Values.size(), "value");
+        return I < Values.size() ? Values[I] : nullptr;
+    }
+
+    Constant *constant() {
+        Value *V = value();
+        if (V && !isa<Constant>(V)) {
+            fail("expected a constant");
+            return nullptr;
+        }
+        return cast_or_null<Constant>(V);
+    }
+
+    BasicBlock *block() {
+        size_t I = index(Blocks.size(), "block");
+        return I < Blocks.size() ? Blocks[I] : nullptr;
+    }
+
+    template <typename T>
+    const T *tableEntry(const T *Table, size_t Size, const char *What) {
+        size_t I = index(Size, What);
+        return I < Size ? &Table[I] : nullptr;
+    }
+
+    bool indices(SmallVectorImpl<unsigned> &Out) {
+        int64_t N = next();
+        for (int64_t i = 0; i < N && Error.empty(); ++i) {
+            int64_t I = next();
+            if (I < 0 || I > UINT_MAX)
+                return fail("invalid aggregate index");
+            Out.push_back(I);
+        }
+        return Error.empty();
+    }
+
+    bool attributes(AttributeSet &Out);
+    bool fastMathFlags(Instruction *I, int64_t Flags);
+
+    bool push(Value *V) {
+        Values.push_back(V);
+        return true;
+    }
+
+    bool inFunction(bool Expected) {
+        if ((F != nullptr) != Expected)
+            return fail(Expected ? "instruction outside of a function body"
+                                 : "unterminated function body");
+        if (Expected && !Builder.GetInsertBlock())
+            return fail("instruction outside of a block");
+        return true;
+    }
+
+    bool decodeRecord(int64_t Op);
+    bool decodeType(int64_t Op);
+    bool decodeGlobalVariable();
+    bool decodeFunction();
+    bool decodeInitializer();
+    bool decodeConstant(int64_t Op);
+    bool decodeBody();
+    bool decodeEnd();
+    bool decodeForward();
+    bool decodeResolve();
+    bool decodeInstruction(int64_t Op, StringRef Name);
+    bool decodeCall(StringRef Name);
+
+    LLVMContext &Ctx;
+    IRBuilder<NoFolder> Builder;
+    const int64_t *Words;
+    size_t Count;
+    size_t Pos;
+    const char *Strings;
+    size_t StringsSize;
+    std::string Error;
+
+    std::unique_ptr<Module> M;
+    std::vector<Type *> Types;
+    std::vector<Value *> Values;
+    SmallPtrSet<Argument *, 8> Placeholders;
+    Function *F;
+    size_t FunctionBase;
+    std::vector<BasicBlock *> Blocks;
+};
+
+std::unique_ptr<Module>
+StreamDecoder::decode()
+{
+    if (next() != REC_MODULE) {
+        fail("missing module record");
+        return nullptr;
+    }
+    StringRef Name = string();
+    StringRef Triple = string();
+    StringRef Layout = string();
+    if (!Error.empty())
+        return nullptr;
+    M.reset(new Module(Name, Ctx));
+    M->setTargetTriple(Triple);
+#if LLVM_VERSION_MAJOR >= 11
+    Expected<DataLayout> DL = DataLayout::parse(Layout);
+    if (!DL) {
+        fail(toString(DL.takeError()));
+        return nullptr;
+    }
+    M->setDataLayout(*DL);
+#else
+    M->setDataLayout(Layout);
+#endif
+
+    while (Pos < Count) {
+        int64_t Op = Words[Pos++];
+        if (!decodeRecord(Op))
+            return nullptr;
+    }
+    if (!inFunction(false))
+        return nullptr;
+    return std::move(M);
+}
+
+bool
+StreamDecoder::decodeRecord(int64_t Op)
+{
+    switch (Op) {
+    case REC_TYPE_VOID:
+    case REC_TYPE_INT:
+    case REC_TYPE_HALF:
+    case REC_TYPE_FLOAT:
+    case REC_TYPE_DOUBLE:
+    case REC_TYPE_POINTER:
+    case REC_TYPE_FUNCTION:
+    case REC_TYPE_ARRAY:
+    case REC_TYPE_VECTOR:
+    case REC_TYPE_STRUCT:
+    case REC_TYPE_NAMED:
+    case REC_TYPE_BODY:
+        return decodeType(Op);
+    case REC_GLOBAL_VARIABLE:
+        return inFunction(false) && decodeGlobalVariable();
+    case REC_FUNCTION:
+        return inFunction(false) && decodeFunction();
+    case REC_INITIALIZER:
+        return decodeInitializer();
+    case REC_CONST_INT:
+    case REC_CONST_WIDE_INT:
+    case REC_CONST_FP:
+    case REC_CONST_NULL:
+    case REC_CONST_UNDEF:
+    case REC_CONST_AGGREGATE:
+    case REC_CONST_STRING:
+        return decodeConstant(Op);
+    case REC_BODY:
+        return inFunction(false) && decodeBody();
+    case REC_BLOCK:
+        if (!F)
+            return fail("block outside of a function body");
+        if (BasicBlock *BB = block()) {
+            Builder.SetInsertPoint(BB);
+            return true;
+        }
+        return false;
+    case REC_END:
+        return F ? decodeEnd() : fail("unexpected end of function body");
+    case REC_FORWARD:
+        return inFunction(true) && decodeForward();
+    case REC_RESOLVE:
+        return inFunction(true) && decodeResolve();
+    default:
+        if (Op >= REC_BINOP && Op <= REC_SHUFFLEVECTOR) {
+            StringRef Name = string();
+            return inFunction(true) && Error.empty() &&
+                   decodeInstruction(Op, Name);
+        }
+        return fail("unknown record " + Twine(Op));
+    }
+}
+
+bool
+StreamDecoder::decodeType(int64_t Op)
+{
+    Type *T = nullptr;
+    switch (Op) {
+    case REC_TYPE_VOID:
+        T = Type::getVoidTy(Ctx);
+        break;
+    case REC_TYPE_INT: {
+        int64_t Width = next();
+        if (Width < IntegerType::MIN_INT_BITS ||
+            Width > IntegerType::MAX_INT_BITS)
+            return fail("invalid integer width");
+        T = IntegerType::get(Ctx, Width);
+        break;
+    }
+    case REC_TYPE_HALF:
+        T = Type::getHalfTy(Ctx);
+        break;
+    case REC_TYPE_FLOAT:
+        T = Type::getFloatTy(Ctx);
+        break;
+    case REC_TYPE_DOUBLE:
+        T = Type::getDoubleTy(Ctx);
+        break;
+    case REC_TYPE_POINTER: {
+        Type *Pointee = type();
+        int64_t AddrSpace = next();
+        if (!Pointee)
+            return false;
+        if (!PointerType::isValidElementType(Pointee) || AddrSpace < 0 ||
+            AddrSpace > UINT_MAX)
+            return fail("invalid pointer type");
+        T = PointerType::get(Pointee, AddrSpace);
+        break;
+    }
+    case REC_TYPE_FUNCTION: {
+        Type *Return = type();
+        bool VarArg = next();
+        int64_t N = next();
+        SmallVector<Type *, 8> Params;
+        for (int64_t i = 0; i < N && Error.empty(); ++i)
+            Params.push_back(type());
+        if (!Error.empty())
+            return false;
+        if (!FunctionType::isValidReturnType(Return))
+            return fail("invalid function return type");
+        for (Type *P : Params)
+            if (!FunctionType::isValidArgumentType(P))
+                return fail("invalid function argument type");
+        T = FunctionType::get(Return, Params, VarArg);
+        break;
+    }
+    case REC_TYPE_ARRAY:
+    case REC_TYPE_VECTOR: {
+        Type *Element = type();
+        int64_t N = next();
+        if (!Element)
+            return false;
+        if (Op == REC_TYPE_ARRAY) {
+            if (!ArrayType::isValidElementType(Element) || N < 0)
+                return fail("invalid array type");
+            T = ArrayType::get(Element, N);
+        } else {
+            if (!VectorType::isValidElementType(Element) || N <= 0 ||
+                N > UINT_MAX)
+                return fail("invalid vector type");
+#if LLVM_VERSION_MAJOR >= 11
+            T = FixedVectorType::get(Element, N);
+#else
+            T = VectorType::get(Element, N);
+#endif
+        }
+        break;
+    }
+    case REC_TYPE_STRUCT:
+    case REC_TYPE_BODY: {
+        StructType *Named = nullptr;
+        if (Op == REC_TYPE_BODY) {
+            Named = dyn_cast_or_null<StructType>(type());
+            if (Error.empty() && (!Named || !Named->isOpaque()))
+                return fail("invalid struct body");
+        }
+        bool Packed = next();
+        int64_t N = next();
+        SmallVector<Type *, 8> Elements;
+        for (int64_t i = 0; i < N && Error.empty(); ++i)
+            Elements.push_back(type());
+        if (!Error.empty())
+            return false;
+        for (Type *E : Elements)
+            if (!StructType::isValidElementType(E))
+                return fail("invalid struct element type");
+        if (Named) {
+            Named->setBody(Elements, Packed);
+            return true;
+        }
+        T = StructType::get(Ctx, Elements, Packed);
+        break;
+    }
+    case REC_TYPE_NAMED: {
+        StringRef Name = string();
+        if (!Error.empty())
+            return false;
+        // Renamed if the context already has a type of that name, as
+        // done by the assembly parser
+        T = StructType::create(Ctx, Name);
+        break;
+    }
+    }
+    if (!Error.empty())
+        return false;
+    Types.push_back(T);
+    return true;
+}
+
+bool
+StreamDecoder::attributes(AttributeSet &Out)
+{
+    int64_t N = next();
+    SmallVector<Attribute, 8> Attrs;
+    for (int64_t i = 0; i < N && Error.empty(); ++i) {
+        const Attribute::AttrKind *Kind =
+            tableEntry(AttrKinds, tableSize(AttrKinds), "attribute");
+        int64_t Value = next();
+        if (!Kind)
+            return false;
+        if (!Value) {
+            Attrs.push_back(Attribute::get(Ctx, *Kind));
+            continue;
+        }
+        if ((*Kind == Attribute::Alignment ||
+             *Kind == Attribute::StackAlignment) && !isPowerOf2_64(Value))
+            return fail("alignment is not a power of two");
+        Attrs.push_back(Attribute::get(Ctx, *Kind, Value));
+    }
+    Out = AttributeSet::get(Ctx, Attrs);
+    return Error.empty();
+}
+
+bool
+StreamDecoder::decodeGlobalVariable()
+{
+    Type *T = type();
+    StringRef Name = string();
+    const GlobalValue::LinkageTypes *Linkage =
+        tableEntry(Linkages, tableSize(Linkages), "linkage");
+    const GlobalValue::DLLStorageClassTypes *Storage = tableEntry(
+        DLLStorageClasses, tableSize(DLLStorageClasses), "storage class");
+    bool IsConstant = next();
+    bool UnnamedAddr = next();
+    int64_t AddrSpace = next();
+    int64_t Align = next();
+    if (!Error.empty())
+        return false;
+    if (!PointerType::isValidElementType(T) || T->isFunctionTy() ||
+        AddrSpace < 0 || AddrSpace > UINT_MAX)
+        return fail("invalid global variable type");
+    if (Align < 0 || (Align && !isPowerOf2_64(Align)))
+        return fail("alignment is not a power of two");
+    GlobalVariable *GV = new GlobalVariable(
+        *M, T, IsConstant, *Linkage, /*Initializer=*/nullptr, Name,
+        /*InsertBefore=*/nullptr, GlobalValue::NotThreadLocal, AddrSpace);
+    GV->setDLLStorageClass(*Storage);
+    if (UnnamedAddr)
+        GV->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+    if (Align)
+        setAlignment(GV, Align);
+    return push(GV);
+}
+
+bool
+StreamDecoder::decodeFunction()
+{
+    FunctionType *FT = dyn_cast_or_null<FunctionType>(type());
+    StringRef Name = string();
+    const GlobalValue::LinkageTypes *Linkage =
+        tableEntry(Linkages, tableSize(Linkages), "linkage");
+    const GlobalValue::DLLStorageClassTypes *Storage = tableEntry(
+        DLLStorageClasses, tableSize(DLLStorageClasses), "storage class");
+    int64_t CallConv = next();
+    AttributeSet FnAttrs, RetAttrs;
+    attributes(FnAttrs);
+    attributes(RetAttrs);
+    if (!Error.empty())
+        return false;
+    if (!FT)
+        return fail("invalid function type");
+    if (CallConv < 0 || CallConv > CallingConv::MaxID)
+        return fail("invalid calling convention");
+
+    Function *Fn = Function::Create(FT, *Linkage, Name, M.get());
+    SmallVector<AttributeSet, 8> ArgAttrs;
+    for (Argument &A : Fn->args()) {
+        StringRef ArgName = string();
+        ArgAttrs.emplace_back();
+        if (!attributes(ArgAttrs.back()))
+            return false;
+        A.setName(ArgName);
+    }
+    Fn->setDLLStorageClass(*Storage);
+    Fn->setCallingConv(CallConv);
+    Fn->setAttributes(AttributeList::get(Ctx, FnAttrs, RetAttrs, ArgAttrs));
+    return push(Fn);
+}
+
+bool
+StreamDecoder::decodeInitializer()
+{
+    GlobalVariable *GV = dyn_cast_or_null<GlobalVariable>(value());
+    Constant *Init = constant();
+    if (!Error.empty())
+        return false;
+    if (!GV)
+        return fail("initializer for a non-variable");
+    if (Init->getType() != GV->getValueType())
+        return fail("initializer type mismatch");
+    GV->setInitializer(Init);
+    return true;
+}
+
+bool
+StreamDecoder::decodeConstant(int64_t Op)
+{
+    Type *T = type();
+    if (!T)
+        return false;
+    if (!T->isFirstClassType() || T->isLabelTy() || T->isMetadataTy())
+        return fail("invalid constant type");
+
+    Constant *C = nullptr;
+    switch (Op) {
+    case REC_CONST_INT:
+    case REC_CONST_WIDE_INT: {
+        if (!T->isIntegerTy())
+            return fail("integer constant of a non-integer type");
+        unsigned Width = T->getIntegerBitWidth();
+        if (Op == REC_CONST_INT) {
+            C = ConstantInt::get(T, (uint64_t)next());
+            break;
+        }
+        int64_t N = next();
+        if (N != (Width + 63) / 64)
+            return fail("wide integer size mismatch");
+        SmallVector<uint64_t, 4> Parts;
+        for (int64_t i = 0; i < N; ++i)
+            Parts.push_back(next());
+        C = ConstantInt::get(Ctx, APInt(Width, Parts));
+        break;
+    }
+    case REC_CONST_FP: {
+        if (!T->isFloatingPointTy())
+            return fail("floating-point constant of a non-floating-point type");
+        // Converted from double as done by the assembly parser
+        APFloat V(APFloat::IEEEdouble(), APInt(64, (uint64_t)next()));
+        bool Ignored;
+        V.convert(T->getFltSemantics(), APFloat::rmNearestTiesToEven,
+                  &Ignored);
+        C = ConstantFP::get(Ctx, V);
+        break;
+    }
+    case REC_CONST_NULL:
+        if (auto *ST = dyn_cast<StructType>(T))
+            if (ST->isOpaque())
+                return fail("null constant of an opaque type");
+        C = Constant::getNullValue(T);
+        break;
+    case REC_CONST_UNDEF:
+        C = UndefValue::get(T);
+        break;
+    case REC_CONST_AGGREGATE: {
+        int64_t N = next();
+        SmallVector<Constant *, 16> Elements;
+        for (int64_t i = 0; i < N && Error.empty(); ++i)
+            Elements.push_back(constant());
+        if (!Error.empty())
+            return false;
+        if (auto *AT = dyn_cast<ArrayType>(T)) {
+            if ((uint64_t)N != AT->getNumElements())
+                return fail("array constant size mismatch");
+            for (Constant *E : Elements)
+                if (E->getType() != AT->getElementType())
+                    return fail("array constant element type mismatch");
+            C = ConstantArray::get(AT, Elements);
+        } else if (auto *ST = dyn_cast<StructType>(T)) {
+            if (ST->isOpaque() || (uint64_t)N != ST->getNumElements())
+                return fail("struct constant size mismatch");
+            for (int64_t i = 0; i < N; ++i)
+                if (Elements[i]->getType() != ST->getElementType(i))
+                    return fail("struct constant element type mismatch");
+            C = ConstantStruct::get(ST, Elements);
+        } else if (T->isVectorTy() && N > 0) {
+            for (Constant *E : Elements)
+                if (E->getType() != Elements[0]->getType())
+                    return fail("vector constant element type mismatch");
+            C = ConstantVector::get(Elements);
+            if (C->getType() != T)
+                return fail("vector constant type mismatch");
+        } else {
+            return fail("aggregate constant of a non-aggregate type");
+        }
+        break;
+    }
+    case REC_CONST_STRING: {
+        StringRef Data = string();
+        if (!Error.empty())
+            return false;
+        C = ConstantDataArray::getString(Ctx, Data, /*AddNull=*/false);
+        if (C->getType() != T)
+            return fail("string constant type mismatch");
+        break;
+    }
+    }
+    if (!Error.empty())
+        return false;
+    return push(C);
+}
+
+bool
+StreamDecoder::decodeBody()
+{
+    F = dyn_cast_or_null<Function>(value());
+    int64_t N = next();
+    if (!Error.empty())
+        return false;
+    if (!F || !F->empty() || N <= 0) {
+        F = nullptr;
+        return fail("invalid function body");
+    }
+    FunctionBase = Values.size();
+    for (int64_t i = 0; i < N && Error.empty(); ++i)
+        Blocks.push_back(BasicBlock::Create(Ctx, string(), F));
+    for (Argument &A : F->args())
+        Values.push_back(&A);
+    return Error.empty();
+}
+
+bool
+StreamDecoder::decodeEnd()
+{
+    if (!Placeholders.empty())
+        return fail("use of undefined value in function '" + F->getName() +
+                    "'");
+    Values.resize(FunctionBase);
+    Blocks.clear();
+    Builder.ClearInsertionPoint();
+    F = nullptr;
+    return true;
+}
+
+bool
+StreamDecoder::decodeForward()
+{
+    Type *T = type();
+    if (!T)
+        return false;
+    if (!T->isFirstClassType() || T->isLabelTy() || T->isMetadataTy())
+        return fail("invalid forward reference type");
+    // A placeholder, as used by the assembly parser
+    Argument *A = new Argument(T);
+    Placeholders.insert(A);
+    return push(A);
+}
+
+bool
+StreamDecoder::decodeResolve()
+{
+    size_t I = index(Values.size(), "value");
+    if (!Error.empty())
+        return false;
+    Argument *A = dyn_cast<Argument>(Values[I]);
+    Value *V = Values.back();
+    if (!A || !Placeholders.count(A))
+        return fail("resolving a value which is not a forward reference");
+    if (A->getType() != V->getType())
+        return fail("forward reference type mismatch");
+    A->replaceAllUsesWith(V);
+    Placeholders.erase(A);
+    delete A;
+    Values[I] = V;
+    return true;
+}
+
+bool
+StreamDecoder::fastMathFlags(Instruction *I, int64_t Flags)
+{
+    if (!(Flags & FastMathFlagsMask))
+        return true;
+    if (!isa<FPMathOperator>(I))
+        return fail("fast-math flags on a non floating-point operation");
+    FastMathFlags FMF;
+    if (Flags & FLAG_NNAN)
+        FMF.setNoNaNs();
+    if (Flags & FLAG_NINF)
+        FMF.setNoInfs();
+    if (Flags & FLAG_NSZ)
+        FMF.setNoSignedZeros();
+    if (Flags & FLAG_ARCP)
+        FMF.setAllowReciprocal();
+    if (Flags & FLAG_CONTRACT)
+        FMF.setAllowContract();
+    if (Flags & FLAG_AFN)
+        FMF.setApproxFunc();
+    if (Flags & FLAG_REASSOC)
+        FMF.setAllowReassoc();
+    I->setFastMathFlags(FMF);
+    return true;
+}
+
+bool
+StreamDecoder::decodeInstruction(int64_t Op, StringRef Name)
+{
+    Value *I = nullptr;
+    switch (Op) {
+    case REC_BINOP: {
+        const Instruction::BinaryOps *BinOp =
+            tableEntry(BinaryOps, tableSize(BinaryOps), "operation");
+        int64_t Flags = next();
+        Value *L = value(), *R = value();
+        if (!Error.empty())
+            return false;
+        Type *T = L->getType();
+        bool IsFP = *BinOp == Instruction::FAdd ||
+                    *BinOp == Instruction::FSub ||
+                    *BinOp == Instruction::FMul ||
+                    *BinOp == Instruction::FDiv || *BinOp == Instruction::FRem;
+        if (R->getType() != T ||
+            !(IsFP ? T->isFPOrFPVectorTy() : T->isIntOrIntVectorTy()))
+            return fail("invalid operand types for a binary operator");
+        auto *BO = cast<BinaryOperator>(Builder.CreateBinOp(*BinOp, L, R,
+                                                            Name));
+        I = BO;
+        if (Flags & (FLAG_NUW | FLAG_NSW)) {
+            if (!isa<OverflowingBinaryOperator>(BO))
+                return fail("wrap flags on a non-overflowing operator");
+            BO->setHasNoUnsignedWrap(Flags & FLAG_NUW);
+            BO->setHasNoSignedWrap(Flags & FLAG_NSW);
+        }
+        if (Flags & FLAG_EXACT) {
+            if (!isa<PossiblyExactOperator>(BO))
+                return fail("exact flag on an inexact operator");
+            BO->setIsExact(true);
+        }
+        if (!fastMathFlags(BO, Flags))
+            return false;
+        break;
+    }
+    case REC_ICMP:
+    case REC_FCMP: {
+        const CmpInst::Predicate *Pred =
+            Op == REC_ICMP
+                ? tableEntry(ICmpPredicates, tableSize(ICmpPredicates),
+                             "predicate")
+                : tableEntry(FCmpPredicates, tableSize(FCmpPredicates),
+                             "predicate");
+        int64_t Flags = Op == REC_FCMP ? next() : 0;
+        Value *L = value(), *R = value();
+        if (!Error.empty())
+            return false;
+        Type *T = L->getType();
+        if (R->getType() != T)
+            return fail("comparison operand type mismatch");
+        if (Op == REC_ICMP) {
+            if (!T->isIntOrIntVectorTy() && !T->isPtrOrPtrVectorTy())
+                return fail("invalid icmp operand type");
+            I = Builder.CreateICmp(*Pred, L, R, Name);
+        } else {
+            if (!T->isFPOrFPVectorTy())
+                return fail("invalid fcmp operand type");
+            I = Builder.CreateFCmp(*Pred, L, R, Name);
+            if (!fastMathFlags(cast<Instruction>(I), Flags))
+                return false;
+        }
+        break;
+    }
+    case REC_CAST: {
+        const Instruction::CastOps *CastOp =
+            tableEntry(CastOps, tableSize(CastOps), "operation");
+        Type *T = type();
+        Value *V = value();
+        if (!Error.empty())
+            return false;
+        if (!CastInst::castIsValid(*CastOp, V, T))
+            return fail("invalid cast");
+        // Not CreateCast(), which drops casts to the same type
+        I = Builder.Insert(CastInst::Create(*CastOp, V, T), Name);
+        break;
+    }
+    case REC_SELECT: {
+        Value *C = value(), *L = value(), *R = value();
+        if (!Error.empty())
+            return false;
+        if (SelectInst::areInvalidOperands(C, L, R))
+            return fail("invalid select operands");
+        I = Builder.CreateSelect(C, L, R, Name);
+        break;
+    }
+    case REC_LOAD: {
+        Value *Ptr = value();
+        int64_t Align = next();
+        if (!Error.empty())
+            return false;
+        if (!Ptr->getType()->isPointerTy())
+            return fail("load from a non-pointer");
+        if (Align < 0 || (Align && !isPowerOf2_64(Align)))
+            return fail("alignment is not a power of two");
+        LoadInst *LI = Builder.CreateLoad(
+            Ptr->getType()->getPointerElementType(), Ptr, Name);
+        if (Align)
+            setAlignment(LI, Align);
+        I = LI;
+        break;
+    }
+    case REC_STORE: {
+        Value *V = value(), *Ptr = value();
+        int64_t Align = next();
+        if (!Error.empty())
+            return false;
+        if (!Ptr->getType()->isPointerTy() ||
+            Ptr->getType()->getPointerElementType() != V->getType())
+            return fail("store type mismatch");
+        if (Align < 0 || (Align && !isPowerOf2_64(Align)))
+            return fail("alignment is not a power of two");
+        StoreInst *SI = Builder.CreateStore(V, Ptr);
+        if (Align)
+            setAlignment(SI, Align);
+        I = SI;
+        break;
+    }
+    case REC_ALLOCA: {
+        Type *T = type();
+        bool HasSize = next();
+        Value *Size = HasSize ? value() : nullptr;
+        int64_t Align = next();
+        if (!Error.empty())
+            return false;
+        if (!T->isSized() || (Size && !Size->getType()->isIntegerTy()))
+            return fail("invalid alloca");
+        if (Align < 0 || (Align && !isPowerOf2_64(Align)))
+            return fail("alignment is not a power of two");
+        AllocaInst *AI = Builder.CreateAlloca(T, Size, Name);
+        if (Align)
+            setAlignment(AI, Align);
+        I = AI;
+        break;
+    }
+    case REC_GEP: {
+        bool InBounds = next();
+        Value *Ptr = value();
+        int64_t N = next();
+        SmallVector<Value *, 8> Indices;
+        for (int64_t i = 0; i < N && Error.empty(); ++i)
+            Indices.push_back(value());
+        if (!Error.empty())
+            return false;
+        if (!Ptr->getType()->isPointerTy())
+            return fail("getelementptr on a non-pointer");
+        Type *T = Ptr->getType()->getPointerElementType();
+        for (Value *Idx : Indices)
+            if (!Idx->getType()->isIntOrIntVectorTy())
+                return fail("non-integer getelementptr index");
+        if (N == 0 || !GetElementPtrInst::getIndexedType(
+                          T, makeArrayRef(Indices).slice(1)))
+            return fail("invalid getelementptr indices");
+        I = InBounds ? Builder.CreateInBoundsGEP(T, Ptr, Indices, Name)
+                     : Builder.CreateGEP(T, Ptr, Indices, Name);
+        break;
+    }
+    case REC_PHI: {
+        Type *T = type();
+        int64_t N = next();
+        if (!Error.empty())
+            return false;
+        if (!T->isFirstClassType() || T->isLabelTy() || T->isMetadataTy() ||
+            N < 0)
+            return fail("invalid phi");
+        PHINode *Phi = Builder.CreatePHI(T, N, Name);
+        I = Phi;
+        for (int64_t i = 0; i < N; ++i) {
+            Value *V = value();
+            BasicBlock *BB = block();
+            if (!Error.empty())
+                return false;
+            if (V->getType() != T)
+                return fail("phi incoming type mismatch");
+            Phi->addIncoming(V, BB);
+        }
+        break;
+    }
+    case REC_CALL:
+        return decodeCall(Name);
+    case REC_RET: {
+        bool HasValue = next();
+        Value *V = HasValue ? value() : nullptr;
+        if (!Error.empty())
+            return false;
+        Type *Expected = F->getReturnType();
+        if (V ? V->getType() != Expected : !Expected->isVoidTy())
+            return fail("return type mismatch");
+        I = V ? Builder.CreateRet(V) : Builder.CreateRetVoid();
+        break;
+    }
+    case REC_BR: {
+        BasicBlock *BB = block();
+        if (!BB)
+            return false;
+        I = Builder.CreateBr(BB);
+        break;
+    }
+    case REC_CONDBR: {
+        Value *C = value();
+        BasicBlock *T = block(), *E = block();
+        if (!Error.empty())
+            return false;
+        if (!C->getType()->isIntegerTy(1))
+            return fail("branch condition is not a boolean");
+        I = Builder.CreateCondBr(C, T, E);
+        break;
+    }
+    case REC_SWITCH: {
+        Value *V = value();
+        BasicBlock *Default = block();
+        int64_t N = next();
+        if (!Error.empty())
+            return false;
+        if (!V->getType()->isIntegerTy() || N < 0)
+            return fail("invalid switch");
+        SwitchInst *SI = Builder.CreateSwitch(V, Default, N);
+        I = SI;
+        for (int64_t i = 0; i < N; ++i) {
+            auto *C = dyn_cast_or_null<ConstantInt>(value());
+            BasicBlock *BB = block();
+            if (!Error.empty())
+                return false;
+            if (!C || C->getType() != V->getType())
+                return fail("invalid switch case value");
+            SI->addCase(C, BB);
+        }
+        break;
+    }
+    case REC_UNREACHABLE:
+        I = Builder.CreateUnreachable();
+        break;
+    case REC_EXTRACTVALUE:
+    case REC_INSERTVALUE: {
+        Value *Agg = value();
+        Value *V = Op == REC_INSERTVALUE ? value() : nullptr;
+        SmallVector<unsigned, 4> Idxs;
+        if (!indices(Idxs))
+            return false;
+        Type *T = ExtractValueInst::getIndexedType(Agg->getType(), Idxs);
+        if (Idxs.empty() || !T || (V && V->getType() != T))
+            return fail("invalid aggregate indices");
+        I = V ? Builder.CreateInsertValue(Agg, V, Idxs, Name)
+              : Builder.CreateExtractValue(Agg, Idxs, Name);
+        break;
+    }
+    case REC_EXTRACTELEMENT: {
+        Value *Vec = value(), *Idx = value();
+        if (!Error.empty())
+            return false;
+        if (!ExtractElementInst::isValidOperands(Vec, Idx))
+            return fail("invalid extractelement operands");
+        I = Builder.CreateExtractElement(Vec, Idx, Name);
+        break;
+    }
+    case REC_INSERTELEMENT: {
+        Value *Vec = value(), *V = value(), *Idx = value();
+        if (!Error.empty())
+            return false;
+        if (!InsertElementInst::isValidOperands(Vec, V, Idx))
+            return fail("invalid insertelement operands");
+        I = Builder.CreateInsertElement(Vec, V, Idx, Name);
+        break;
+    }
+    case REC_SHUFFLEVECTOR: {
+        Value *V1 = value(), *V2 = value(), *Mask = value();
+        if (!Error.empty())
+            return false;
+        if (!ShuffleVectorInst::isValidOperands(V1, V2, Mask))
+            return fail("invalid shufflevector operands");
+        I = Builder.CreateShuffleVector(V1, V2, Mask, Name);
+        break;
+    }
+    }
+    if (!Error.empty())
+        return false;
+    return push(I);
+}
+
+bool
+StreamDecoder::decodeCall(StringRef Name)
+{
+    FunctionType *FT = dyn_cast_or_null<FunctionType>(type());
+    Value *Callee = value();
+    int64_t Flags = next();
+    int64_t CallConv = next();
+    AttributeSet FnAttrs;
+    attributes(FnAttrs);
+    int64_t N = next();
+    SmallVector<Value *, 8> Args;
+    for (int64_t i = 0; i < N && Error.empty(); ++i)
+        Args.push_back(value());
+    if (!Error.empty())
+        return false;
+    if (!FT || !Callee->getType()->isPointerTy() ||
+        Callee->getType()->getPointerElementType() != FT)
+        return fail("invalid callee type");
+    if (CallConv < 0 || CallConv > CallingConv::MaxID)
+        return fail("invalid calling convention");
+    if (Args.size() < FT->getNumParams() ||
+        (Args.size() > FT->getNumParams() && !FT->isVarArg()))
+        return fail("wrong number of call arguments");
+    for (unsigned i = 0; i < FT->getNumParams(); ++i)
+        if (Args[i]->getType() != FT->getParamType(i))
+            return fail("call argument type mismatch");
+    if (FT->getReturnType()->isVoidTy() && !Name.empty())
+        return fail("named void call");
+
+    CallInst *CI = Builder.CreateCall(FT, Callee, Args, Name);
+    CI->setTailCall(Flags & FLAG_TAIL);
+    CI->setCallingConv(CallConv);
+    CI->setAttributes(AttributeList::get(Ctx, FnAttrs, AttributeSet(), {}));
+    if (!fastMathFlags(CI, Flags))
+        return false;
+    return push(CI);
+}
+
+} // end anonymous namespace
+
+extern "C" {
+
+/*
+ * Build a module from the Count words of an encoded llvmlite.ir module and
+ * its strings.  On error, nullptr is returned and *OutError is set.
+ */
+API_EXPORT(LLVMModuleRef)
+LLVMPY_BuildModuleFromStream(LLVMContextRef Context,
+                             const int64_t *Words,
+                             size_t Count,
+                             const char *Strings,
+                             size_t StringsSize,
+                             const char **OutError)
+{
+    llvm::TimeTraceScope timeScope("BuildModule", "");
+    StreamDecoder decoder(*llvm::unwrap(Context), Words, Count, Strings,
+                          StringsSize);
+    std::unique_ptr<llvm::Module> M = decoder.decode();
+    if (!M) {
+        *OutError = LLVMPY_CreateString(decoder.error().c_str());
+        return nullptr;
+    }
+    return llvm::wrap(M.release());
+}
+
+} // end extern "C"
@@ -1,16 +1,32 @@
 #include "core.h"
 
+#include "llvm/ADT/StringSet.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/DiagnosticInfo.h"
 #include "llvm/IR/DiagnosticPrinter.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/Support/TimeProfiler.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/IPO/Internalize.h"
 
-#include "llvm-c/Linker.h"
+#include <functional>
+#include <memory>
 
-extern "C" {
+namespace {
 
-API_EXPORT(int)
-LLVMPY_LinkModules(LLVMModuleRef Dest, LLVMModuleRef Src, const char **Err)
+// Flags of LLVMPY_LinkModulesBatch()
+enum {
+    LINK_ONLY_NEEDED = 1,
+    LINK_INTERNALIZE = 2,
+};
+
+/*
+ * Link the Count modules at Srcs into Dest, in order, which destroys them
+ * all, even when linking fails.
+ */
+int
+linkModules(LLVMModuleRef Dest, LLVMModuleRef *Srcs, size_t Count,
+            unsigned Flags, const char **Err)
 {
     using namespace llvm;
     std::string errorstring;
@@ -27,7 +43,7 @@ LLVMPY_LinkModules(LLVMModuleRef Dest, LLVMModuleRef Src, const char **Err)
         ReportNotAbortDiagnosticHandler(llvm::raw_string_ostream &s):
         raw_stream(s) {}
 
-        bool handleDiagnostics(const DiagnosticInfo &DI) override 
+        bool handleDiagnostics(const DiagnosticInfo &DI) override
         {
             llvm::DiagnosticPrinterRawOStream DP(raw_stream);
             DI.print(DP);
@@ -49,7 +65,32 @@ LLVMPY_LinkModules(LLVMModuleRef Dest, LLVMModuleRef Src, const char **Err)
 #endif
 
     // link
-    bool failed = LLVMLinkModules2(Dest, Src);
+    unsigned linkerFlags = Linker::Flags::None;
+    if (Flags & LINK_ONLY_NEEDED)
+        linkerFlags |= Linker::Flags::LinkOnlyNeeded;
+    // The definitions linked in are only internalized once all the modules
+    // are linked, so that the later modules can still refer to them
+    StringSet<> linked;
+    std::function<void(Module &, const StringSet<> &)> collect;
+    if (Flags & LINK_INTERNALIZE) {
+        collect = [&linked](Module &, const StringSet<> &Names) {
+            for (const auto &entry : Names)
+                linked.insert(entry.getKey());
+        };
+    }
+    Linker linker(*D);
+    bool failed = false;
+    for (size_t i = 0; i < Count; ++i) {
+        std::unique_ptr<Module> src(unwrap(Srcs[i]));
+        if (!failed)
+            failed = linker.linkInModule(std::move(src), linkerFlags,
+                                         collect);
+    }
+    if (!failed && !linked.empty()) {
+        internalizeModule(*D, [&linked](const GlobalValue &GV) {
+            return !GV.hasName() || !linked.count(GV.getName());
+        });
+    }
 
     // put old handler back
     Ctx.setDiagnosticHandler(std::move(OldDiagnosticHandler));
@@ -63,4 +104,32 @@ LLVMPY_LinkModules(LLVMModuleRef Dest, LLVMModuleRef Src, const char **Err)
     return failed;
 }
 
+} // end anonymous namespace
+
+extern "C" {
+
+API_EXPORT(int)
+LLVMPY_LinkModules(LLVMModuleRef Dest, LLVMModuleRef Src, const char **Err)
+{
+    llvm::TimeTraceScope timeScope("LinkModules",
+                                   llvm::unwrap(Src)->getModuleIdentifier());
+    return linkModules(Dest, &Src, 1, 0, Err);
+}
+
+/*
+ * Link the Count modules at Srcs into Dest, in order.  With
+ * LINK_ONLY_NEEDED, only the definitions Dest refers to once the previous
+ * modules are linked are taken from each module; with LINK_INTERNALIZE,
+ * the definitions taken are made internal to Dest.  The linked modules are
+ * destroyed, even when linking fails.
+ */
+API_EXPORT(int)
+LLVMPY_LinkModulesBatch(LLVMModuleRef Dest, LLVMModuleRef *Srcs,
+                        size_t Count, unsigned Flags, const char **Err)
+{
+    llvm::TimeTraceScope timeScope("LinkModules",
+                                   llvm::unwrap(Dest)->getModuleIdentifier());
+    return linkModules(Dest, Srcs, Count, Flags, Err);
+}
+
 } // end extern "C"
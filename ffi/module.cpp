@@ -1,9 +1,18 @@
+#include <algorithm>
 #include <string>
 #include <clocale>
 #include "llvm-c/Core.h"
 #include "llvm-c/Analysis.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/Instructions.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/TypeFinder.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Transforms/Utils/Cloning.h"
 #include "core.h"
 
 
@@ -57,6 +66,17 @@ public:
 
 typedef TypesIterator* LLVMTypesIteratorRef;
 
+/* The statistics of a function, mirrored in llvmlite/binding/analysis.py */
+struct LLVMPYFunctionStats {
+    const char *Name;
+    uint64_t Instructions;
+    uint64_t Blocks;
+    uint64_t Calls;
+    uint64_t Loops;
+    // Calls to the refop functions, NRT_incref and NRT_decref by default
+    uint64_t RefOps;
+};
+
 //
 // Local helper functions
 //
@@ -283,4 +303,134 @@ LLVMPY_CloneModule(LLVMModuleRef M)
     return LLVMCloneModule(M);
 }
 
+/*
+ * Clone the module, keeping the definitions of the Count globals named in
+ * Names only: the other globals are turned into declarations.  The kept
+ * globals of a lazily loaded module are materialized first, and only
+ * them.
+ */
+API_EXPORT(LLVMModuleRef)
+LLVMPY_CloneModuleSubset(LLVMModuleRef M,
+                         const char **Names,
+                         size_t Count,
+                         const char **OutError)
+{
+    using namespace llvm;
+    Module *mod = unwrap(M);
+    StringSet<> keep;
+    for (size_t i = 0; i < Count; ++i) {
+        keep.insert(Names[i]);
+        GlobalValue *GV = mod->getNamedValue(Names[i]);
+        if (!GV || !GV->isMaterializable())
+            continue;
+        if (Error err = GV->materialize()) {
+            *OutError = LLVMPY_CreateString(toString(std::move(err)).c_str());
+            return NULL;
+        }
+    }
+    ValueToValueMapTy VMap;
+    return wrap(CloneModule(*mod, VMap, [&keep](const GlobalValue *GV) {
+        return keep.count(GV->getName()) != 0;
+    }).release());
+}
+
+API_EXPORT(unsigned)
+LLVMPY_GetOpcodeCount()
+{
+    return llvm::Instruction::OtherOpsEnd;
+}
+
+API_EXPORT(const char *)
+LLVMPY_GetOpcodeNameOf(unsigned Opcode)
+{
+    return llvm::Instruction::getOpcodeName(Opcode);
+}
+
+/*
+ * Compute the statistics of the functions defined in the module, which
+ * must be materialized, into Out, and their numbers of instructions by
+ * opcode into Opcodes, LLVMPY_GetOpcodeCount() entries per function.
+ * The number of functions defined is returned; nothing is computed if it
+ * is larger than Count.
+ *
+ * Refops are the calls to the RefOpNames functions, NRT_incref and
+ * NRT_decref if NULL, as with LLVMPY_AddRefPrunePass().
+ */
+API_EXPORT(size_t)
+LLVMPY_GetFunctionStats(LLVMModuleRef M,
+                        const char **RefOpNames,
+                        size_t NumRefOps,
+                        LLVMPYFunctionStats *Out,
+                        uint64_t *Opcodes,
+                        size_t Count)
+{
+    using namespace llvm;
+    Module *mod = unwrap(M);
+    size_t defined = 0;
+    for (const Function &F : *mod) {
+        if (!F.isDeclaration())
+            ++defined;
+    }
+    if (defined > Count)
+        return defined;
+
+    TimeTraceScope timeScope("FunctionStats", mod->getModuleIdentifier());
+    static const char *defaultRefOps[] = {"NRT_incref", "NRT_decref"};
+    if (!RefOpNames) {
+        RefOpNames = defaultRefOps;
+        NumRefOps = 2;
+    }
+    // Refops are matched by callee, as in RefPrunePass
+    SmallPtrSet<const Value *, 4> refops;
+    for (size_t i = 0; i < NumRefOps; ++i) {
+        if (const GlobalValue *callee = mod->getNamedValue(RefOpNames[i]))
+            refops.insert(callee);
+    }
+    for (const Function &F : *mod) {
+        if (F.isDeclaration())
+            continue;
+        LLVMPYFunctionStats &stats = *Out++;
+        uint64_t *opcodes = Opcodes;
+        Opcodes += Instruction::OtherOpsEnd;
+        std::fill(opcodes, Opcodes, 0);
+        // Value names are NUL-terminated
+        stats.Name = F.hasName() ? F.getName().data() : "";
+        stats.Instructions = 0;
+        stats.Blocks = F.size();
+        stats.Calls = 0;
+        stats.RefOps = 0;
+        for (const BasicBlock &BB : F) {
+            for (const Instruction &I : BB) {
+                ++stats.Instructions;
+                ++opcodes[I.getOpcode()];
+                const CallBase *call = dyn_cast<CallBase>(&I);
+                if (!call)
+                    continue;
+                ++stats.Calls;
+                if (refops.count(call->getCalledOperand()))
+                    ++stats.RefOps;
+            }
+        }
+        DominatorTree DT(const_cast<Function &>(F));
+        LoopInfo LI(DT);
+        stats.Loops = LI.getLoopsInPreorder().size();
+    }
+    return defined;
+}
+
+/*
+ * Materialize all the globals of a lazily loaded module.  This releases
+ * the bitcode the module was loaded from.
+ */
+API_EXPORT(int)
+LLVMPY_MaterializeAll(LLVMModuleRef M, const char **OutError)
+{
+    if (llvm::Error err = llvm::unwrap(M)->materializeAll()) {
+        *OutError = LLVMPY_CreateString(
+            llvm::toString(std::move(err)).c_str());
+        return 1;
+    }
+    return 0;
+}
+
 } // end extern "C"
@@ -0,0 +1,457 @@
+#include "core.h"
+
+#include "llvm-c/ExecutionEngine.h"
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/ExecutionEngine/ExecutionEngine.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CachePruning.h"
+#include "llvm/Support/Chrono.h"
+#include "llvm/Support/Compression.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/SHA1.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+using namespace llvm;
+
+namespace {
+
+/*
+ * Compressed objects start with this magic and their uncompressed size,
+ * which no object file format starts with.  Compressed and uncompressed
+ * objects can therefore be mixed in a cache directory.
+ */
+static const char CompressedMagic[8] = {'L', 'L', 'V', 'M', 'P', 'Y', 'Z',
+                                        '\x01'};
+static const size_t CompressedHeaderSize = sizeof(CompressedMagic) + 8;
+
+class DiskObjectCacheView;
+
+/*
+ * An object cache storing compiled objects in a directory, shared by any
+ * number of execution engines and processes.
+ *
+ * Objects are keyed by the SHA-1 hash of the module's bitcode and of the
+ * configuration of the engine's target machine.  They are written to a
+ * temporary file which is then renamed, so that readers never see partial
+ * objects, and loaded with MemoryBuffer::getOpenFile(), which maps large
+ * files rather than reading them.  Hits refresh the access time of the
+ * file, and with a size cap, the least recently used objects are pruned
+ * after each write using LLVM's cache pruning (as for the ThinLTO cache).
+ *
+ * Objects can be compressed with zlib, and written by a background thread
+ * so that compression and I/O don't delay compilation.  The objects
+ * waiting to be written are copied to a bounded queue: compiling threads
+ * wait for room when it is full.  Objects still queued are found by
+ * lookups as well.
+ *
+ * Each engine uses the cache through a view of its own, owned by the
+ * engine's wrapper.  The cache counts its views, so that it is not
+ * disposed of while an engine may still use it.
+ */
+class LLVMPYDiskObjectCache {
+public:
+    LLVMPYDiskObjectCache(StringRef Dir, uint64_t MaxSize, bool Compress,
+                          size_t MaxQueued)
+        : dir(Dir.str()), maxSize(MaxSize), compress(Compress),
+          maxQueued(MaxQueued)
+    {
+        if (maxQueued)
+            writer = std::thread(&LLVMPYDiskObjectCache::writeQueued, this);
+    }
+
+    ~LLVMPYDiskObjectCache() {
+        if (writer.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(queueMutex);
+                stopping = true;
+            }
+            queueCond.notify_all();
+            writer.join();
+        }
+    }
+
+    /* Return a new view of the cache for the engine, owned by the caller */
+    DiskObjectCacheView *attach(ExecutionEngine *EE);
+
+    size_t getNumViews() const { return numViews; }
+
+    std::unique_ptr<MemoryBuffer> load(StringRef Key) {
+        if (maxQueued) {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            for (const QueuedObject &queued : queue) {
+                if (queued.key == Key) {
+                    ++hits;
+                    return MemoryBuffer::getMemBufferCopy(
+                        queued.obj->getBuffer());
+                }
+            }
+        }
+        SmallString<128> path = pathForKey(Key);
+        int FD;
+        if (sys::fs::openFileForRead(path, FD)) {
+            ++misses;
+            return nullptr;
+        }
+        auto buf = MemoryBuffer::getOpenFile(
+            sys::fs::convertFDToNativeFile(FD), path, /*FileSize=*/-1,
+            /*RequiresNullTerminator=*/false);
+        if (buf) {
+            // Keep track of the last use for pruning, errors are harmless
+            sys::fs::setLastAccessAndModificationTime(
+                FD, std::chrono::system_clock::now());
+        }
+        sys::Process::SafelyCloseFileDescriptor(FD);
+        std::unique_ptr<MemoryBuffer> obj;
+        if (buf)
+            obj = decompress(std::move(*buf));
+        if (!obj) {
+            ++misses;
+            return nullptr;
+        }
+        ++hits;
+        return obj;
+    }
+
+    void store(StringRef Key, MemoryBufferRef Obj) {
+        if (!maxQueued) {
+            write(Key, Obj.getBuffer());
+            return;
+        }
+        // The buffer is only valid during the call, copy it
+        QueuedObject queued = {Key.str(),
+                               MemoryBuffer::getMemBufferCopy(
+                                   Obj.getBuffer())};
+        {
+            std::unique_lock<std::mutex> lock(queueMutex);
+            queueCond.wait(lock, [this] { return queue.size() < maxQueued; });
+            queue.push_back(std::move(queued));
+        }
+        queueCond.notify_all();
+    }
+
+    /* Wait until all the queued objects are written */
+    void flush() {
+        std::unique_lock<std::mutex> lock(queueMutex);
+        queueCond.wait(lock, [this] { return queue.empty(); });
+    }
+
+    void getStats(uint64_t *Hits, uint64_t *Misses, uint64_t *Writes) const {
+        *Hits = hits;
+        *Misses = misses;
+        *Writes = writes;
+    }
+
+private:
+    friend class DiskObjectCacheView;
+
+    struct QueuedObject {
+        std::string key;
+        std::unique_ptr<MemoryBuffer> obj;
+    };
+
+    SmallString<128> pathForKey(StringRef Key) const {
+        SmallString<128> path(dir);
+        sys::path::append(path, "llvmcache-" + Key);
+        return path;
+    }
+
+    void writeQueued() {
+        std::unique_lock<std::mutex> lock(queueMutex);
+        while (true) {
+            queueCond.wait(lock, [this] { return stopping || !queue.empty(); });
+            if (queue.empty())
+                return;
+            // The object stays queued while it is written, so that lookups
+            // still find it.  Other threads only append to the queue,
+            // which doesn't move its elements.
+            const QueuedObject &queued = queue.front();
+            lock.unlock();
+            write(queued.key, queued.obj->getBuffer());
+            lock.lock();
+            queue.pop_front();
+            queueCond.notify_all();
+        }
+    }
+
+    void write(StringRef Key, StringRef Obj) {
+        SmallString<0> compressed;
+        if (compress) {
+            compressed.append(std::begin(CompressedMagic),
+                              std::end(CompressedMagic));
+            char size[8];
+            support::endian::write64le(size, Obj.size());
+            compressed.append(std::begin(size), std::end(size));
+            SmallString<0> data;
+            if (Error err = zlib::compress(Obj, data)) {
+                consumeError(std::move(err));
+                return;
+            }
+            compressed.append(data.begin(), data.end());
+            Obj = compressed.str();
+        }
+        SmallString<128> model(dir);
+        sys::path::append(model, "tmp-%%%%%%%%%%%%.o");
+        Expected<sys::fs::TempFile> temp = sys::fs::TempFile::create(model);
+        if (!temp) {
+            // The cache is best-effort: failing to write an object only
+            // means it will be compiled again.
+            consumeError(temp.takeError());
+            return;
+        }
+        {
+            raw_fd_ostream os(temp->FD, /*shouldClose=*/false);
+            os << Obj;
+            os.flush();
+            if (os.has_error()) {
+                os.clear_error();
+                consumeError(temp->discard());
+                return;
+            }
+        }
+        if (Error err = temp->keep(pathForKey(Key))) {
+            consumeError(std::move(err));
+            consumeError(temp->discard());
+            return;
+        }
+        ++writes;
+        prune();
+    }
+
+    static std::unique_ptr<MemoryBuffer>
+    decompress(std::unique_ptr<MemoryBuffer> Buf) {
+        StringRef data = Buf->getBuffer();
+        if (!data.startswith(StringRef(CompressedMagic,
+                                       sizeof(CompressedMagic))))
+            return Buf;
+        if (data.size() < CompressedHeaderSize || !zlib::isAvailable())
+            return nullptr;
+        size_t size = support::endian::read64le(
+            data.data() + sizeof(CompressedMagic));
+        auto obj = WritableMemoryBuffer::getNewUninitMemBuffer(size);
+        if (!obj)
+            return nullptr;
+        size_t actualSize = size;
+        if (Error err = zlib::uncompress(data.drop_front(CompressedHeaderSize),
+                                         obj->getBufferStart(), actualSize)) {
+            consumeError(std::move(err));
+            return nullptr;
+        }
+        if (actualSize != size)
+            return nullptr;
+        return obj;
+    }
+
+    void prune() {
+        if (!maxSize)
+            return;
+        CachePruningPolicy policy;
+        policy.Interval = std::chrono::seconds(0);
+        policy.Expiration = std::chrono::seconds(0);
+        policy.MaxSizePercentageOfAvailableSpace = 0;
+        policy.MaxSizeBytes = maxSize;
+        std::lock_guard<std::mutex> lock(pruneMutex);
+        pruneCache(dir, policy);
+    }
+
+    const std::string dir;
+    const uint64_t maxSize;
+    const bool compress;
+    const size_t maxQueued;
+    std::atomic<uint64_t> hits{0}, misses{0}, writes{0};
+    std::mutex pruneMutex;
+    std::atomic<size_t> numViews{0};
+    // The write queue, if writing in the background
+    std::mutex queueMutex;
+    std::condition_variable queueCond;
+    std::deque<QueuedObject> queue;
+    bool stopping = false;
+    std::thread writer;
+};
+
+/*
+ * The view of the cache from an execution engine.  MCJIT calls getObject()
+ * before code generation and notifyObjectCompiled() after it, by which time
+ * the code generation passes may have modified the module, so the key is
+ * computed once and remembered in between.
+ */
+class DiskObjectCacheView : public ObjectCache {
+public:
+    DiskObjectCacheView(LLVMPYDiskObjectCache &Cache, std::string TMConfig)
+        : cache(Cache), tmConfig(std::move(TMConfig))
+    {
+        ++cache.numViews;
+    }
+
+    ~DiskObjectCacheView() {
+        --cache.numViews;
+    }
+
+    std::unique_ptr<MemoryBuffer> getObject(const Module *M) override {
+        std::string key = computeKey(*M);
+        std::unique_ptr<MemoryBuffer> obj = cache.load(key);
+        if (!obj)
+            pending[M] = key;
+        return obj;
+    }
+
+    void notifyObjectCompiled(const Module *M, MemoryBufferRef Obj) override {
+        auto it = pending.find(M);
+        if (it == pending.end())
+            return;
+        cache.store(it->second, Obj);
+        pending.erase(it);
+    }
+
+private:
+    std::string computeKey(const Module &M) const {
+        SmallString<0> buf(tmConfig);
+        buf.push_back('\0');
+        raw_svector_ostream os(buf);
+        WriteBitcodeToFile(M, os);
+        auto hash = SHA1::hash(arrayRefFromStringRef(buf.str()));
+        return toHex(StringRef(reinterpret_cast<const char*>(hash.data()),
+                               hash.size()), /*LowerCase=*/true);
+    }
+
+    LLVMPYDiskObjectCache &cache;
+    const std::string tmConfig;
+    std::map<const Module*, std::string> pending;
+};
+
+/*
+ * Everything about the target machine that affects the generated code,
+ * and the LLVM version, since the objects are not meant to outlive the
+ * library which produced them.
+ */
+std::string
+getTargetMachineConfig(const TargetMachine &TM)
+{
+    const TargetOptions &opts = TM.Options;
+    std::string config;
+    raw_string_ostream os(config);
+    os << LLVM_VERSION_STRING << '\n'
+       << TM.getTargetTriple().str() << '\n'
+       << TM.getTargetCPU() << '\n'
+       << TM.getTargetFeatureString() << '\n'
+       << TM.createDataLayout().getStringRepresentation() << '\n'
+       << TM.getRelocationModel() << ' '
+       << TM.getCodeModel() << ' '
+       << TM.getOptLevel() << ' '
+       << opts.UnsafeFPMath << opts.NoInfsFPMath << opts.NoNaNsFPMath
+       << opts.NoSignedZerosFPMath << opts.NoTrappingFPMath << ' '
+       << opts.AllowFPOpFusion << ' ' << opts.FloatABIType << ' '
+       << opts.EmulatedTLS << opts.FunctionSections << opts.DataSections;
+    return os.str();
+}
+
+DiskObjectCacheView *
+LLVMPYDiskObjectCache::attach(ExecutionEngine *EE)
+{
+    return new DiskObjectCacheView(
+        *this, getTargetMachineConfig(*EE->getTargetMachine()));
+}
+
+} // end anonymous namespace
+
+typedef LLVMPYDiskObjectCache *LLVMPYDiskObjectCacheRef;
+typedef DiskObjectCacheView *LLVMPYDiskObjectCacheViewRef;
+
+extern "C" {
+
+API_EXPORT(bool)
+LLVMPY_IsCompressionAvailable()
+{
+    return zlib::isAvailable();
+}
+
+/*
+ * Create a cache in Dir.  If Compress, objects are compressed with zlib,
+ * which must be available.  If MaxQueued is non-zero, objects are written
+ * by a background thread, up to MaxQueued objects waiting to be written.
+ */
+API_EXPORT(LLVMPYDiskObjectCacheRef)
+LLVMPY_CreateDiskObjectCache(const char *Dir,
+                             uint64_t MaxSize,
+                             bool Compress,
+                             size_t MaxQueued,
+                             const char **OutError)
+{
+    if (std::error_code ec = sys::fs::create_directories(Dir)) {
+        *OutError = LLVMPY_CreateString(ec.message().c_str());
+        return nullptr;
+    }
+    return new LLVMPYDiskObjectCache(Dir, MaxSize, Compress, MaxQueued);
+}
+
+/*
+ * The cache must not have any views left, see
+ * LLVMPY_DiskObjectCacheNumViews().
+ */
+API_EXPORT(void)
+LLVMPY_DisposeDiskObjectCache(LLVMPYDiskObjectCacheRef C)
+{
+    delete C;
+}
+
+/*
+ * Set a new view of the cache as the object cache of the engine, and
+ * return it.  The view must outlive the engine's use of it, and be
+ * disposed of with LLVMPY_DisposeDiskObjectCacheView().
+ */
+API_EXPORT(LLVMPYDiskObjectCacheViewRef)
+LLVMPY_SetDiskObjectCache(LLVMExecutionEngineRef EE,
+                          LLVMPYDiskObjectCacheRef C)
+{
+    ExecutionEngine *engine = unwrap(EE);
+    DiskObjectCacheView *view = C->attach(engine);
+    engine->setObjectCache(view);
+    return view;
+}
+
+API_EXPORT(void)
+LLVMPY_DisposeDiskObjectCacheView(LLVMPYDiskObjectCacheViewRef V)
+{
+    delete V;
+}
+
+API_EXPORT(size_t)
+LLVMPY_DiskObjectCacheNumViews(LLVMPYDiskObjectCacheRef C)
+{
+    return C->getNumViews();
+}
+
+API_EXPORT(void)
+LLVMPY_DiskObjectCacheGetStats(LLVMPYDiskObjectCacheRef C,
+                               uint64_t *Hits,
+                               uint64_t *Misses,
+                               uint64_t *Writes)
+{
+    C->getStats(Hits, Misses, Writes);
+}
+
+API_EXPORT(void)
+LLVMPY_FlushDiskObjectCache(LLVMPYDiskObjectCacheRef C)
+{
+    C->flush();
+}
+
+} // end extern "C"
@@ -0,0 +1,443 @@
+#include "core.h"
+
+#include "llvm-c/ExecutionEngine.h"
+#include "llvm-c/Object.h"
+#include "llvm-c/TargetMachine.h"
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/ExecutionEngine/Orc/CompileOnDemandLayer.h"
+#include "llvm/ExecutionEngine/Orc/Core.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/MC/SubtargetFeature.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace llvm {
+
+    inline TargetMachine *unwrap(LLVMTargetMachineRef P) {
+        return reinterpret_cast<TargetMachine*>(P);
+    }
+
+    namespace object {
+
+        inline OwningBinary<ObjectFile> *unwrap(LLVMObjectFileRef OF) {
+            return reinterpret_cast<OwningBinary<ObjectFile> *>(OF);
+        }
+    } // object
+} // llvm
+
+using namespace llvm;
+using namespace llvm::orc;
+
+#if LLVM_VERSION_MAJOR >= 12
+typedef DefinitionGenerator LLVMPYDefinitionGeneratorBase;
+#else
+typedef JITDylib::DefinitionGenerator LLVMPYDefinitionGeneratorBase;
+#endif
+
+// The set of symbols looked up at once, the lookup flags came in LLVM 10
+#if LLVM_VERSION_MAJOR >= 10
+typedef SymbolLookupSet LLVMPYSymbolSet;
+#else
+typedef SymbolNameSet LLVMPYSymbolSet;
+#endif
+
+/*
+ * Resolve symbols the same way MCJIT does: through
+ * sys::DynamicLibrary::SearchForAddressOfSymbol(), so that the symbols
+ * registered with LLVMPY_AddSymbol() and the libraries loaded with
+ * LLVMPY_LoadLibraryPermanently() are visible to the JITted code.
+ */
+class ProcessSymbolGenerator : public LLVMPYDefinitionGeneratorBase {
+public:
+    ProcessSymbolGenerator(char GlobalPrefix) : GlobalPrefix(GlobalPrefix) {}
+
+#if LLVM_VERSION_MAJOR >= 10
+#if LLVM_VERSION_MAJOR >= 12
+    Error tryToGenerate(LookupState &LS, LookupKind K, JITDylib &JD,
+                        JITDylibLookupFlags JDLookupFlags,
+                        const SymbolLookupSet &Symbols) override
+#else
+    Error tryToGenerate(LookupKind K, JITDylib &JD,
+                        JITDylibLookupFlags JDLookupFlags,
+                        const SymbolLookupSet &Symbols) override
+#endif
+    {
+        SymbolMap NewSymbols;
+        for (auto &KV : Symbols)
+            addSymbol(KV.first, NewSymbols);
+        if (NewSymbols.empty())
+            return Error::success();
+        return JD.define(absoluteSymbols(std::move(NewSymbols)));
+    }
+#else
+    Expected<SymbolNameSet> tryToGenerate(JITDylib &JD,
+                                          const SymbolNameSet &Names) override
+    {
+        SymbolMap NewSymbols;
+        SymbolNameSet Added;
+        for (auto &Name : Names) {
+            if (addSymbol(Name, NewSymbols))
+                Added.insert(Name);
+        }
+        if (!NewSymbols.empty()) {
+            if (Error e = JD.define(absoluteSymbols(std::move(NewSymbols))))
+                return std::move(e);
+        }
+        return Added;
+    }
+#endif
+
+private:
+    /*
+     * Add the process symbol *Symbol* refers to, if any, to *NewSymbols*.
+     * Returns whether it was found.
+     */
+    bool addSymbol(const SymbolStringPtr &Symbol, SymbolMap &NewSymbols) {
+        StringRef Name = *Symbol;
+        if (GlobalPrefix != '\0') {
+            if (Name.empty() || Name.front() != GlobalPrefix)
+                return false;
+            Name = Name.drop_front();
+        }
+        std::string NameStr = Name.str();
+        void *Addr =
+            sys::DynamicLibrary::SearchForAddressOfSymbol(NameStr.c_str());
+        if (!Addr)
+            return false;
+        NewSymbols[Symbol] = JITEvaluatedSymbol(
+            static_cast<JITTargetAddress>(reinterpret_cast<uintptr_t>(Addr)),
+            JITSymbolFlags::Exported);
+        return true;
+    }
+
+    char GlobalPrefix;
+};
+
+/*
+ * An ORC LLJIT instance together with the bookkeeping needed to offer the
+ * same interface as the MCJIT ExecutionEngine.
+ */
+class LLVMPYLLJIT {
+public:
+    LLVMPYLLJIT(std::unique_ptr<LLJIT> J, bool lazy, bool threaded)
+    : jit(std::move(J)),
+      ctors(jit->getMainJITDylib()),
+      dtors(jit->getMainJITDylib()),
+      lazy(lazy),
+      threaded(threaded)
+    { }
+
+    /*
+     * Hand a copy of *M* to the JIT.  ORC compiles each module in its own
+     * ThreadSafeContext so that concurrent compile threads never share an
+     * LLVMContext; the copy is made through an in-memory bitcode round trip
+     * because modules cannot be cloned across contexts.  The original module
+     * is kept alive by the engine, as with MCJIT.
+     *
+     * In lazy mode the module goes through the CompileOnDemandLayer instead:
+     * lookups return stubs and each function is only compiled when first
+     * called.
+     */
+    bool addModule(Module *M, std::string &err) {
+        SmallVector<char, 0> buffer;
+        raw_svector_ostream os(buffer);
+        WriteBitcodeToFile(*M, os);
+
+        auto ctx = std::make_unique<LLVMContext>();
+        auto copy = parseBitcodeFile(
+            MemoryBufferRef(StringRef(buffer.data(), buffer.size()),
+                            M->getModuleIdentifier()),
+            *ctx);
+        if (!copy) {
+            err = toString(copy.takeError());
+            return true;
+        }
+        Module &mod = **copy;
+        if (mod.getDataLayout().isDefault())
+            mod.setDataLayout(jit->getDataLayout());
+
+        if (!lazy) {
+            MangleAndInterner mangle(jit->getExecutionSession(),
+                                     mod.getDataLayout());
+            for (auto &GV : mod.global_values()) {
+                if (GV.isDeclaration() || GV.hasLocalLinkage() ||
+                    GV.hasAppendingLinkage() ||
+                    GV.hasAvailableExternallyLinkage() ||
+                    GV.getName().startswith("llvm."))
+                    continue;
+#if LLVM_VERSION_MAJOR >= 10
+                pending.add(mangle(GV.getName()));
+#else
+                pending.insert(mangle(GV.getName()));
+#endif
+            }
+        }
+        ctors.add(getConstructors(mod));
+        dtors.add(getDestructors(mod));
+
+        ThreadSafeModule tsm(std::move(*copy), ThreadSafeContext(std::move(ctx)));
+        Error e = lazy
+            ? static_cast<LLLazyJIT&>(*jit).addLazyIRModule(std::move(tsm))
+            : jit->addIRModule(std::move(tsm));
+        if (e) {
+            err = toString(std::move(e));
+            return true;
+        }
+        modules.push_back(std::unique_ptr<Module>(M));
+        return false;
+    }
+
+    /*
+     * Whether code may be compiled outside of the calls into the JIT, on
+     * its compile threads or, in lazy mode, when a function is first called,
+     * while a time trace is recorded by a profiler shared by all threads as
+     * before LLVM 11.  Such compilations would record into it concurrently.
+     */
+    bool compilesUntraceably(std::string &err) {
+#if LLVM_VERSION_MAJOR < 11
+        if ((lazy || threaded) && timeTraceProfilerEnabled()) {
+            err = "compile threads and lazy compilation can't be traced "
+                  "before LLVM 11";
+            return true;
+        }
+#endif
+        return false;
+    }
+
+    /*
+     * Materialize every symbol added since the last call with a single
+     * lookup, so that the modules are dispatched to the compile threads
+     * together rather than one after another.  Nothing is pending in lazy
+     * mode, where compilation is deferred until a function is called.
+     */
+    bool finalize(std::string &err) {
+        if (compilesUntraceably(err))
+            return true;
+        if (pending.empty())
+            return false;
+        LLVMPYSymbolSet symbols(std::move(pending));
+        pending = LLVMPYSymbolSet();
+#if LLVM_VERSION_MAJOR >= 10
+        auto res = jit->getExecutionSession().lookup(
+            makeJITDylibSearchOrder(&jit->getMainJITDylib()),
+            std::move(symbols));
+#else
+        auto res = jit->getExecutionSession().lookup(
+            JITDylibSearchList({{&jit->getMainJITDylib(), true}}),
+            symbols);
+#endif
+        if (!res) {
+            err = toString(res.takeError());
+            return true;
+        }
+        return false;
+    }
+
+    std::unique_ptr<LLJIT> jit;
+    CtorDtorRunner ctors;
+    CtorDtorRunner dtors;
+
+private:
+    bool lazy;
+    bool threaded;
+    std::vector<std::unique_ptr<Module>> modules;
+    LLVMPYSymbolSet pending;
+};
+
+typedef LLVMPYLLJIT *LLVMPYLLJITRef;
+
+static JITTargetMachineBuilder
+make_target_machine_builder(TargetMachine *TM)
+{
+    JITTargetMachineBuilder jtmb(TM->getTargetTriple());
+    jtmb.setCPU(TM->getTargetCPU().str());
+    jtmb.addFeatures(SubtargetFeatures(TM->getTargetFeatureString())
+                         .getFeatures());
+    jtmb.setRelocationModel(TM->getRelocationModel());
+    jtmb.setCodeModel(TM->getCodeModel());
+    jtmb.setCodeGenOptLevel(TM->getOptLevel());
+    jtmb.setOptions(TM->Options);
+    return jtmb;
+}
+
+static Expected<std::unique_ptr<LLJIT>>
+create_lljit(TargetMachine *TM, unsigned NumCompileThreads, bool Lazy)
+{
+    if (!Lazy) {
+        return LLJITBuilder()
+            .setJITTargetMachineBuilder(make_target_machine_builder(TM))
+            .setNumCompileThreads(NumCompileThreads)
+            .create();
+    }
+    auto jit = LLLazyJITBuilder()
+                   .setJITTargetMachineBuilder(
+                       make_target_machine_builder(TM))
+                   .setNumCompileThreads(NumCompileThreads)
+                   .create();
+    if (!jit)
+        return jit.takeError();
+    // Compile only the function being called, not the whole module
+    (*jit)->setPartitionFunction(CompileOnDemandLayer::compileRequested);
+    return std::unique_ptr<LLJIT>(std::move(*jit));
+}
+
+extern "C" {
+
+API_EXPORT(LLVMPYLLJITRef)
+LLVMPY_CreateLLJITCompiler(LLVMTargetMachineRef TM,
+                           unsigned NumCompileThreads,
+                           int Lazy,
+                           const char **OutError)
+{
+    /* Make the process symbols visible, as EngineBuilder::create does */
+    sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
+
+    auto jit = create_lljit(unwrap(TM), NumCompileThreads, Lazy);
+    if (!jit) {
+        *OutError = LLVMPY_CreateString(toString(jit.takeError()).c_str());
+        return nullptr;
+    }
+    char prefix = (*jit)->getDataLayout().getGlobalPrefix();
+    (*jit)->getMainJITDylib().addGenerator(
+        std::make_unique<ProcessSymbolGenerator>(prefix));
+    return new LLVMPYLLJIT(std::move(*jit), Lazy, NumCompileThreads > 0);
+}
+
+API_EXPORT(void)
+LLVMPY_DisposeLLJIT(LLVMPYLLJITRef J)
+{
+    delete J;
+}
+
+API_EXPORT(int)
+LLVMPY_LLJITAddModule(LLVMPYLLJITRef J,
+                      LLVMModuleRef M,
+                      const char **OutError)
+{
+    std::string err;
+    if (J->addModule(unwrap(M), err)) {
+        *OutError = LLVMPY_CreateString(err.c_str());
+        return 1;
+    }
+    return 0;
+}
+
+API_EXPORT(int)
+LLVMPY_LLJITAddObjectFile(LLVMPYLLJITRef J,
+                          LLVMObjectFileRef ObjF,
+                          const char **OutError)
+{
+    auto binary = object::unwrap(ObjF)->takeBinary();
+    if (Error e = J->jit->addObjectFile(std::move(binary.second))) {
+        *OutError = LLVMPY_CreateString(toString(std::move(e)).c_str());
+        return 1;
+    }
+    return 0;
+}
+
+API_EXPORT(int)
+LLVMPY_LLJITFinalize(LLVMPYLLJITRef J,
+                     const char **OutError)
+{
+    TimeTraceScope timeScope("LLJITFinalize", "");
+    std::string err;
+    if (J->finalize(err)) {
+        *OutError = LLVMPY_CreateString(err.c_str());
+        return 1;
+    }
+    return 0;
+}
+
+API_EXPORT(uint64_t)
+LLVMPY_LLJITLookup(LLVMPYLLJITRef J,
+                   const char *Name,
+                   const char **OutError)
+{
+    std::string err;
+    if (J->compilesUntraceably(err)) {
+        *OutError = LLVMPY_CreateString(err.c_str());
+        return 0;
+    }
+    auto sym = J->jit->lookup(Name);
+    if (!sym) {
+        *OutError = LLVMPY_CreateString(toString(sym.takeError()).c_str());
+        return 0;
+    }
+    return sym->getAddress();
+}
+
+API_EXPORT(int)
+LLVMPY_LLJITDefineSymbol(LLVMPYLLJITRef J,
+                         const char *Name,
+                         void *Addr,
+                         const char **OutError)
+{
+    JITDylib &JD = J->jit->getMainJITDylib();
+    MangleAndInterner mangle(J->jit->getExecutionSession(),
+                             J->jit->getDataLayout());
+    SymbolMap symbols;
+    symbols[mangle(Name)] = JITEvaluatedSymbol(
+        static_cast<JITTargetAddress>(reinterpret_cast<uintptr_t>(Addr)),
+        JITSymbolFlags::Exported);
+    if (Error e = JD.define(absoluteSymbols(std::move(symbols)))) {
+        *OutError = LLVMPY_CreateString(toString(std::move(e)).c_str());
+        return 1;
+    }
+    return 0;
+}
+
+API_EXPORT(int)
+LLVMPY_LLJITRunStaticConstructors(LLVMPYLLJITRef J,
+                                  const char **OutError)
+{
+    std::string err;
+    if (J->compilesUntraceably(err)) {
+        *OutError = LLVMPY_CreateString(err.c_str());
+        return 1;
+    }
+    if (Error e = J->ctors.run()) {
+        *OutError = LLVMPY_CreateString(toString(std::move(e)).c_str());
+        return 1;
+    }
+    return 0;
+}
+
+API_EXPORT(int)
+LLVMPY_LLJITRunStaticDestructors(LLVMPYLLJITRef J,
+                                 const char **OutError)
+{
+    std::string err;
+    if (J->compilesUntraceably(err)) {
+        *OutError = LLVMPY_CreateString(err.c_str());
+        return 1;
+    }
+    if (Error e = J->dtors.run()) {
+        *OutError = LLVMPY_CreateString(toString(std::move(e)).c_str());
+        return 1;
+    }
+    return 0;
+}
+
+API_EXPORT(LLVMTargetDataRef)
+LLVMPY_LLJITGetTargetData(LLVMPYLLJITRef J)
+{
+    return wrap(new DataLayout(J->jit->getDataLayout()));
+}
+
+} // end extern "C"
@@ -1,4 +1,9 @@
+#include <chrono>
+#include <map>
+#include <memory>
+#include <string>
 #include <tuple>
+#include <vector>
 
 #include "core.h"
 
@@ -9,12 +14,304 @@
 
 #include "llvm-c/Transforms/Scalar.h"
 #include "llvm-c/Transforms/IPO.h"
+#include "llvm-c/TargetMachine.h"
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/CallGraphSCCPass.h"
+#include "llvm/Analysis/LoopPass.h"
 #include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Target/TargetMachine.h"
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/Transforms/IPO.h"
 
 using namespace llvm;
 
+namespace llvm {
+
+    inline TargetMachine *unwrap(LLVMTargetMachineRef P) {
+        return reinterpret_cast<TargetMachine*>(P);
+    }
+} // llvm
+
+/*
+ * A new pass manager pipeline, parsed from its textual description, with
+ * the analysis managers it runs with.
+ */
+class LLVMPYPipeline {
+public:
+    LLVMPYPipeline(TargetMachine *TM) : PB(TM) {
+        // The AA pipeline must be registered before the default analyses
+        FAM.registerPass([&] { return PB.buildDefaultAAPipeline(); });
+        PB.registerModuleAnalyses(MAM);
+        PB.registerCGSCCAnalyses(CGAM);
+        PB.registerFunctionAnalyses(FAM);
+        PB.registerLoopAnalyses(LAM);
+        PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+    }
+
+    bool parse(const char *Pipeline, std::string &err) {
+        if (Error e = PB.parsePassPipeline(MPM, Pipeline)) {
+            err = toString(std::move(e));
+            return true;
+        }
+        return false;
+    }
+
+    /*
+     * Analysis results are cached across the functions of the module
+     * for the duration of the run, then dropped since they are keyed on
+     * IR units that may not outlive it.
+     */
+    bool run(Module &M) {
+        PreservedAnalyses PA = MPM.run(M, MAM);
+        LAM.clear();
+        FAM.clear();
+        CGAM.clear();
+        MAM.clear();
+        return !PA.areAllPreserved();
+    }
+
+private:
+    PassBuilder PB;
+    LoopAnalysisManager LAM;
+    FunctionAnalysisManager FAM;
+    CGSCCAnalysisManager CGAM;
+    ModuleAnalysisManager MAM;
+    ModulePassManager MPM;
+};
+
+typedef LLVMPYPipeline *LLVMPYPipelineRef;
+
+namespace {
+
+/*
+ * Pass timing.
+ *
+ * A timed pass manager brackets every pass added to it with a pair of
+ * marker passes of the same kind, so that they run right before and after
+ * the pass on each IR unit, in the same nested pass manager.  The stop
+ * marker accumulates the time elapsed since the start marker (or since its
+ * own previous run, should the scheduling of required analyses separate the
+ * start marker from the pass), which includes the analyses computed for the
+ * pass.  Unlike LLVM's -time-passes timers, the records are owned by the
+ * pass manager and do not depend on process-wide state.
+ *
+ * The markers only sample the process clocks, with a single getrusage()
+ * call on POSIX; unlike TimeRecord::getCurrentTime(), they do not query
+ * the memory usage, which goes through mallinfo() and is comparatively
+ * slow.
+ */
+struct PassClocks {
+    double wall = 0.0;
+    double user = 0.0;
+    double system = 0.0;
+
+    static PassClocks now() {
+        using Seconds = std::chrono::duration<double>;
+        sys::TimePoint<> elapsed;
+        std::chrono::nanoseconds userTime, systemTime;
+        sys::Process::GetTimeUsage(elapsed, userTime, systemTime);
+        PassClocks clocks;
+        clocks.wall = Seconds(elapsed.time_since_epoch()).count();
+        clocks.user = Seconds(userTime).count();
+        clocks.system = Seconds(systemTime).count();
+        return clocks;
+    }
+};
+
+struct PassTimeRecord {
+    std::string name;
+    size_t count = 0;
+    PassClocks total;
+    PassClocks start;
+
+    void startTimer() { start = PassClocks::now(); }
+
+    void stopTimer() {
+        PassClocks now = PassClocks::now();
+        total.wall += now.wall - start.wall;
+        total.user += now.user - start.user;
+        total.system += now.system - start.system;
+        ++count;
+        start = now;
+    }
+};
+
+template <typename PassKind>
+struct PassTimingMarker : public PassKind {
+    PassTimeRecord &record;
+    bool isStart;
+
+    PassTimingMarker(char &ID, PassTimeRecord &record, bool isStart)
+        : PassKind(ID), record(record), isStart(isStart) {}
+
+    StringRef getPassName() const override {
+        return isStart ? "Pass timing start" : "Pass timing stop";
+    }
+
+    void getAnalysisUsage(AnalysisUsage &AU) const override {
+        PassKind::getAnalysisUsage(AU);
+        AU.setPreservesAll();
+    }
+
+    bool mark() {
+        if (isStart)
+            record.startTimer();
+        else
+            record.stopTimer();
+        return false;
+    }
+};
+
+struct ModuleTimingMarker : public PassTimingMarker<ModulePass> {
+    static char ID;
+    ModuleTimingMarker(PassTimeRecord &record, bool isStart)
+        : PassTimingMarker(ID, record, isStart) {}
+    bool runOnModule(Module &) override { return mark(); }
+};
+
+struct FunctionTimingMarker : public PassTimingMarker<FunctionPass> {
+    static char ID;
+    FunctionTimingMarker(PassTimeRecord &record, bool isStart)
+        : PassTimingMarker(ID, record, isStart) {}
+    bool runOnFunction(Function &) override { return mark(); }
+};
+
+struct LoopTimingMarker : public PassTimingMarker<LoopPass> {
+    static char ID;
+    LoopTimingMarker(PassTimeRecord &record, bool isStart)
+        : PassTimingMarker(ID, record, isStart) {}
+    bool runOnLoop(Loop *, LPPassManager &) override { return mark(); }
+};
+
+struct SCCTimingMarker : public PassTimingMarker<CallGraphSCCPass> {
+    static char ID;
+    SCCTimingMarker(PassTimeRecord &record, bool isStart)
+        : PassTimingMarker(ID, record, isStart) {}
+    bool runOnSCC(CallGraphSCC &) override { return mark(); }
+};
+
+char ModuleTimingMarker::ID = 0;
+char FunctionTimingMarker::ID = 0;
+char LoopTimingMarker::ID = 0;
+char SCCTimingMarker::ID = 0;
+
+struct PassTimings {
+    std::vector<std::unique_ptr<PassTimeRecord>> records;
+
+    /*
+     * Create the markers bracketing *P*, or return false if the pass is
+     * not timed.
+     */
+    bool makeMarkers(Pass *P, Pass *&start, Pass *&stop) {
+        start = stop = nullptr;
+        PassTimeRecord *rec = new PassTimeRecord();
+        switch (P->getPassKind()) {
+        case PT_Module:
+            // Immutable passes never run
+            if (!P->getAsImmutablePass()) {
+                start = new ModuleTimingMarker(*rec, true);
+                stop = new ModuleTimingMarker(*rec, false);
+            }
+            break;
+        case PT_Function:
+            start = new FunctionTimingMarker(*rec, true);
+            stop = new FunctionTimingMarker(*rec, false);
+            break;
+        case PT_Loop:
+            start = new LoopTimingMarker(*rec, true);
+            stop = new LoopTimingMarker(*rec, false);
+            break;
+        case PT_CallGraphSCC:
+            start = new SCCTimingMarker(*rec, true);
+            stop = new SCCTimingMarker(*rec, false);
+            break;
+        default:
+            break;
+        }
+        if (!start) {
+            delete rec;
+            return false;
+        }
+        // Use the command line name of the pass when it has one
+        const PassInfo *PI = Pass::lookupPassInfo(P->getPassID());
+        if (PI && !PI->getPassArgument().empty())
+            rec->name = PI->getPassArgument().str();
+        else
+            rec->name = P->getPassName().str();
+        records.emplace_back(rec);
+        return true;
+    }
+
+    /* Totals per pass name */
+    std::vector<PassTimeRecord> summarize() const {
+        std::map<std::string, PassTimeRecord> byName;
+        for (const auto &rec : records) {
+            if (!rec->count)
+                continue;
+            PassTimeRecord &sum = byName[rec->name];
+            sum.name = rec->name;
+            sum.count += rec->count;
+            sum.total.wall += rec->total.wall;
+            sum.total.user += rec->total.user;
+            sum.total.system += rec->total.system;
+        }
+        std::vector<PassTimeRecord> out;
+        for (auto &kv : byName)
+            out.push_back(kv.second);
+        return out;
+    }
+
+    void reset() {
+        for (auto &rec : records) {
+            rec->count = 0;
+            rec->total = PassClocks();
+        }
+    }
+};
+
+template <typename Base>
+class TimedPassManager : public Base {
+public:
+    template <typename... Args>
+    TimedPassManager(Args &&... args) : Base(std::forward<Args>(args)...) {}
+
+    void add(Pass *P) override {
+        Pass *start, *stop;
+        if (!timings.makeMarkers(P, start, stop)) {
+            Base::add(P);
+            return;
+        }
+        Base::add(start);
+        Base::add(P);
+        Base::add(stop);
+    }
+
+    PassTimings timings;
+};
+
+typedef TimedPassManager<legacy::PassManager> TimedModulePassManager;
+typedef TimedPassManager<legacy::FunctionPassManager>
+    TimedFunctionPassManager;
+
+/*
+ * The timings of a pass manager created by LLVMPY_CreateTimedPassManager()
+ * or LLVMPY_CreateTimedFunctionPassManager(), which tell apart the two
+ * kinds since RTTI is unavailable.
+ */
+PassTimings &getPassTimings(LLVMPassManagerRef PM, bool isFunctionPM) {
+    if (isFunctionPM)
+        return static_cast<TimedFunctionPassManager*>(
+            unwrap<legacy::FunctionPassManager>(PM))->timings;
+    return static_cast<TimedModulePassManager*>(
+        unwrap<legacy::PassManager>(PM))->timings;
+}
+
+} // end anonymous namespace
+
 /*
  * Exposed API
  */
@@ -39,10 +336,61 @@ LLVMPY_CreateFunctionPassManager(LLVMModuleRef M)
     return LLVMCreateFunctionPassManagerForModule(M);
 }
 
+API_EXPORT(LLVMPassManagerRef)
+LLVMPY_CreateTimedPassManager()
+{
+    legacy::PassManagerBase *PM = new TimedModulePassManager();
+    return wrap(PM);
+}
+
+API_EXPORT(LLVMPassManagerRef)
+LLVMPY_CreateTimedFunctionPassManager(LLVMModuleRef M)
+{
+    legacy::PassManagerBase *PM = new TimedFunctionPassManager(unwrap(M));
+    return wrap(PM);
+}
+
+/*
+ * Return the number of passes with timings, filling the arrays (if not
+ * NULL) with the name, execution count and total wall, user and system
+ * times of at most *Size* of them.  The names must be freed with
+ * LLVMPY_DisposeString().
+ */
+API_EXPORT(size_t)
+LLVMPY_GetPassTimings(LLVMPassManagerRef PM,
+                      bool IsFunctionPM,
+                      size_t Size,
+                      const char **Names,
+                      size_t *Counts,
+                      double *WallTimes,
+                      double *UserTimes,
+                      double *SystemTimes)
+{
+    std::vector<PassTimeRecord> recs =
+        getPassTimings(PM, IsFunctionPM).summarize();
+    for (size_t i = 0; i < recs.size() && i < Size; ++i) {
+        Names[i] = LLVMPY_CreateString(recs[i].name.c_str());
+        Counts[i] = recs[i].count;
+        WallTimes[i] = recs[i].total.wall;
+        UserTimes[i] = recs[i].total.user;
+        SystemTimes[i] = recs[i].total.system;
+    }
+    return recs.size();
+}
+
+API_EXPORT(void)
+LLVMPY_ResetPassTimings(LLVMPassManagerRef PM,
+                        bool IsFunctionPM)
+{
+    getPassTimings(PM, IsFunctionPM).reset();
+}
+
 API_EXPORT(int)
 LLVMPY_RunPassManager(LLVMPassManagerRef PM,
                       LLVMModuleRef M)
 {
+    TimeTraceScope timeScope("RunPassManager",
+                             unwrap(M)->getModuleIdentifier());
     return LLVMRunPassManager(PM, M);
 }
 
@@ -50,6 +398,7 @@ API_EXPORT(int)
 LLVMPY_RunFunctionPassManager(LLVMPassManagerRef PM,
                               LLVMValueRef F)
 {
+    TimeTraceScope timeScope("RunFunctionPassManager", unwrap(F)->getName());
     return LLVMRunFunctionPassManager(PM, F);
 }
 
@@ -161,4 +510,33 @@ LLVMPY_AddBasicAliasAnalysisPass(LLVMPassManagerRef PM)
     LLVMAddBasicAliasAnalysisPass(PM);
 }
 
+API_EXPORT(LLVMPYPipelineRef)
+LLVMPY_CreatePipeline(const char *Pipeline,
+                      LLVMTargetMachineRef TM,
+                      const char **OutError)
+{
+    LLVMPYPipeline *pipeline = new LLVMPYPipeline(TM ? unwrap(TM) : nullptr);
+    std::string err;
+    if (pipeline->parse(Pipeline, err)) {
+        *OutError = LLVMPY_CreateString(err.c_str());
+        delete pipeline;
+        return nullptr;
+    }
+    return pipeline;
+}
+
+API_EXPORT(void)
+LLVMPY_DisposePipeline(LLVMPYPipelineRef P)
+{
+    delete P;
+}
+
+API_EXPORT(int)
+LLVMPY_RunPipeline(LLVMPYPipelineRef P,
+                   LLVMModuleRef M)
+{
+    TimeTraceScope timeScope("RunPipeline", unwrap(M)->getModuleIdentifier());
+    return P->run(*unwrap(M));
+}
+
 } // end extern "C"
@@ -0,0 +1,256 @@
+/*
+ * Snapshots of the IR of functions as flat integer arrays, so that tools
+ * walking many instructions can read them all in a single call rather
+ * than one FFI round trip per value.
+ *
+ * Functions, arguments, blocks, instructions and operands are numbered
+ * in order across the whole snapshot.  The children of each function,
+ * block and instruction are given by an array of offsets, with one more
+ * entry than there are parents.  Names, opcodes and the text of types,
+ * constants and other operands are interned in a string table, which is
+ * a blob of NUL-terminated strings indexed by an array of offsets.
+ */
+
+#include "core.h"
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/ModuleSlotTracker.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <string>
+#include <vector>
+
+namespace {
+
+using namespace llvm;
+
+// The arrays of a snapshot, mirrored in llvmlite/binding/snapshot.py
+enum SnapshotArray {
+    FUNCTION_NAMES,
+    FUNCTION_TYPES,
+    FUNCTION_ARGUMENTS,
+    FUNCTION_BLOCKS,
+    ARGUMENT_NAMES,
+    ARGUMENT_TYPES,
+    BLOCK_NAMES,
+    BLOCK_INSTRUCTIONS,
+    INSTRUCTION_BLOCKS,
+    INSTRUCTION_OPCODES,
+    INSTRUCTION_NAMES,
+    INSTRUCTION_TYPES,
+    INSTRUCTION_OPERANDS,
+    OPERAND_KINDS,
+    OPERAND_VALUES,
+    OPERAND_TYPES,
+    TYPE_NAMES,
+    STRING_OFFSETS,
+    NUM_SNAPSHOT_ARRAYS,
+};
+
+// What OPERAND_VALUES refer to, depending on OPERAND_KINDS
+enum OperandKind {
+    OPERAND_INSTRUCTION,    // an instruction number
+    OPERAND_ARGUMENT,       // an argument number
+    OPERAND_BLOCK,          // a block number
+    OPERAND_GLOBAL,         // the string of the name of a global
+    OPERAND_CONSTANT,       // the string of the constant with its type
+    OPERAND_OTHER,          // the string of the value, such as metadata
+};
+
+class LLVMPYIRSnapshot {
+public:
+    explicit LLVMPYIRSnapshot(const Module *M) : slots(M) {
+        for (SnapshotArray offsets : {FUNCTION_ARGUMENTS, FUNCTION_BLOCKS,
+                                      BLOCK_INSTRUCTIONS,
+                                      INSTRUCTION_OPERANDS, STRING_OFFSETS})
+            arrays[offsets].push_back(0);
+    }
+
+    void addFunction(const Function &F);
+
+    const std::vector<int32_t> &array(unsigned Which) const {
+        return arrays[Which];
+    }
+
+    const std::string &strings() const { return blob; }
+
+private:
+    int32_t string(StringRef S);
+    int32_t type(Type *T);
+    void addOperand(const Value *V);
+
+    std::vector<int32_t> arrays[NUM_SNAPSHOT_ARRAYS];
+    std::string blob;
+    StringMap<int32_t> stringIds;
+    DenseMap<Type *, int32_t> typeIds;
+    // The other operands, with their kind and value
+    DenseMap<const Value *, std::pair<int32_t, int32_t>> valueIds;
+    ModuleSlotTracker slots;
+};
+
+int32_t
+LLVMPYIRSnapshot::string(StringRef S)
+{
+    auto inserted = stringIds.insert(
+        std::make_pair(S, int32_t(stringIds.size())));
+    if (inserted.second) {
+        blob.append(S.begin(), S.end());
+        blob.push_back('\0');
+        arrays[STRING_OFFSETS].push_back(blob.size());
+    }
+    return inserted.first->second;
+}
+
+int32_t
+LLVMPYIRSnapshot::type(Type *T)
+{
+    auto inserted = typeIds.insert(
+        std::make_pair(T, int32_t(typeIds.size())));
+    if (inserted.second) {
+        std::string text;
+        raw_string_ostream os(text);
+        T->print(os);
+        arrays[TYPE_NAMES].push_back(string(os.str()));
+    }
+    return inserted.first->second;
+}
+
+void
+LLVMPYIRSnapshot::addOperand(const Value *V)
+{
+    auto found = valueIds.find(V);
+    if (found == valueIds.end()) {
+        int32_t kind, value;
+        if (isa<GlobalValue>(V)) {
+            kind = OPERAND_GLOBAL;
+            value = string(V->getName());
+        } else {
+            kind = isa<Constant>(V) ? OPERAND_CONSTANT : OPERAND_OTHER;
+            std::string text;
+            raw_string_ostream os(text);
+            V->printAsOperand(os, /*PrintType=*/true, slots);
+            value = string(os.str());
+        }
+        found = valueIds.insert(
+            std::make_pair(V, std::make_pair(kind, value))).first;
+    }
+    arrays[OPERAND_KINDS].push_back(found->second.first);
+    arrays[OPERAND_VALUES].push_back(found->second.second);
+    arrays[OPERAND_TYPES].push_back(type(V->getType()));
+}
+
+void
+LLVMPYIRSnapshot::addFunction(const Function &F)
+{
+    arrays[FUNCTION_NAMES].push_back(string(F.getName()));
+    arrays[FUNCTION_TYPES].push_back(type(F.getFunctionType()));
+    slots.incorporateFunction(F);
+
+    // Number the values local to the function first, as operands may
+    // refer to later instructions
+    int32_t argId = arrays[ARGUMENT_NAMES].size();
+    int32_t blockId = arrays[BLOCK_NAMES].size();
+    int32_t instId = arrays[INSTRUCTION_NAMES].size();
+    for (const Argument &A : F.args())
+        valueIds[&A] = std::make_pair(OPERAND_ARGUMENT, argId++);
+    for (const BasicBlock &BB : F) {
+        valueIds[&BB] = std::make_pair(OPERAND_BLOCK, blockId++);
+        for (const Instruction &I : BB)
+            valueIds[&I] = std::make_pair(OPERAND_INSTRUCTION, instId++);
+    }
+
+    for (const Argument &A : F.args()) {
+        arrays[ARGUMENT_NAMES].push_back(string(A.getName()));
+        arrays[ARGUMENT_TYPES].push_back(type(A.getType()));
+    }
+    for (const BasicBlock &BB : F) {
+        int32_t block = arrays[BLOCK_NAMES].size();
+        arrays[BLOCK_NAMES].push_back(string(BB.getName()));
+        for (const Instruction &I : BB) {
+            arrays[INSTRUCTION_BLOCKS].push_back(block);
+            arrays[INSTRUCTION_OPCODES].push_back(
+                string(I.getOpcodeName()));
+            arrays[INSTRUCTION_NAMES].push_back(string(I.getName()));
+            arrays[INSTRUCTION_TYPES].push_back(type(I.getType()));
+            for (const Use &U : I.operands())
+                addOperand(U.get());
+            arrays[INSTRUCTION_OPERANDS].push_back(
+                arrays[OPERAND_KINDS].size());
+        }
+        arrays[BLOCK_INSTRUCTIONS].push_back(
+            arrays[INSTRUCTION_NAMES].size());
+    }
+    arrays[FUNCTION_ARGUMENTS].push_back(arrays[ARGUMENT_NAMES].size());
+    arrays[FUNCTION_BLOCKS].push_back(arrays[BLOCK_NAMES].size());
+
+    // The local values are only valid within the function
+    for (const Argument &A : F.args())
+        valueIds.erase(&A);
+    for (const BasicBlock &BB : F) {
+        valueIds.erase(&BB);
+        for (const Instruction &I : BB)
+            valueIds.erase(&I);
+    }
+}
+
+} // end anonymous namespace
+
+typedef LLVMPYIRSnapshot *LLVMPYIRSnapshotRef;
+
+extern "C" {
+
+/*
+ * Snapshot all the functions of the module, which must be materialized.
+ */
+API_EXPORT(LLVMPYIRSnapshotRef)
+LLVMPY_SnapshotModule(LLVMModuleRef M)
+{
+    const Module *mod = unwrap(M);
+    TimeTraceScope timeScope("SnapshotIR", mod->getModuleIdentifier());
+    LLVMPYIRSnapshot *snapshot = new LLVMPYIRSnapshot(mod);
+    for (const Function &F : *mod)
+        snapshot->addFunction(F);
+    return snapshot;
+}
+
+/*
+ * Snapshot a single function, which must be materialized.
+ */
+API_EXPORT(LLVMPYIRSnapshotRef)
+LLVMPY_SnapshotFunction(LLVMValueRef F)
+{
+    const Function *func = unwrap<Function>(F);
+    TimeTraceScope timeScope("SnapshotIR", func->getName());
+    LLVMPYIRSnapshot *snapshot = new LLVMPYIRSnapshot(func->getParent());
+    snapshot->addFunction(*func);
+    return snapshot;
+}
+
+API_EXPORT(const int32_t *)
+LLVMPY_GetSnapshotArray(LLVMPYIRSnapshotRef S, unsigned Which, size_t *Size)
+{
+    const std::vector<int32_t> &array = S->array(Which);
+    *Size = array.size();
+    return array.data();
+}
+
+API_EXPORT(const char *)
+LLVMPY_GetSnapshotStrings(LLVMPYIRSnapshotRef S, size_t *Size)
+{
+    *Size = S->strings().size();
+    return S->strings().data();
+}
+
+API_EXPORT(void)
+LLVMPY_DisposeSnapshot(LLVMPYIRSnapshotRef S)
+{
+    delete S;
+}
+
+} // end extern "C"
@@ -8,10 +8,21 @@
 #include "llvm/ADT/Triple.h"
 #include "llvm/Support/TargetRegistry.h"
 #include "llvm/IR/Type.h"
+#include "llvm/IR/Module.h"
+#include "llvm/CodeGen/ParallelCG.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Support/SmallVectorMemoryBuffer.h"
+#include "llvm/Support/TimeProfiler.h"
 
 #include <cstdio>
 #include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <set>
 #include <sstream>
+#include <utility>
+#include <vector>
 
 
 namespace llvm {
@@ -39,6 +50,44 @@ inline LLVMTargetMachineRef wrap(TargetMachine *TM) {
 
 }
 
+#if LLVM_VERSION_MAJOR >= 10
+typedef llvm::CodeGenFileType LLVMPYCodeGenFileType;
+#else
+typedef llvm::TargetMachine::CodeGenFileType LLVMPYCodeGenFileType;
+#endif
+
+typedef std::function<std::unique_ptr<llvm::TargetMachine>()>
+    LLVMPYTargetMachineFactory;
+
+/*
+ * Whether the TargetMachines made by factory, all of the same target, can
+ * emit files of type filetype, which splitCodeGen() aborts on otherwise.
+ * Finding out takes setting up a code generation pipeline, so the targets
+ * found able to are remembered.
+ */
+static bool
+canEmitFile(const llvm::Target &target, LLVMPYCodeGenFileType filetype,
+            const LLVMPYTargetMachineFactory &factory)
+{
+    using namespace llvm;
+    static std::mutex mutex;
+    static std::set<std::pair<const Target*, int>> able;
+    auto key = std::make_pair(&target, static_cast<int>(filetype));
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (able.count(key))
+            return true;
+    }
+    SmallVector<char, 0> probe;
+    raw_svector_ostream probe_os(probe);
+    legacy::PassManager pm;
+    if (factory()->addPassesToEmitFile(pm, probe_os, nullptr, filetype))
+        return false;
+    std::lock_guard<std::mutex> lock(mutex);
+    able.insert(key);
+    return true;
+}
+
 extern "C" {
 
 API_EXPORT(void)
@@ -268,6 +317,8 @@ LLVMPY_TargetMachineEmitToMemory (
     const char ** ErrOut
     )
 {
+    llvm::TimeTraceScope timeScope("EmitToMemory",
+                                   llvm::unwrap(M)->getModuleIdentifier());
     LLVMCodeGenFileType filetype = LLVMAssemblyFile;
     if (use_object) filetype = LLVMObjectFile;
 
@@ -285,6 +336,86 @@ LLVMPY_TargetMachineEmitToMemory (
     return BufOut;
 }
 
+/*
+ * Split the module into NumParts partitions and generate code for each of
+ * them on its own thread, with its own TargetMachine configured like TM.
+ * If consume is true, the module is split and destroyed, otherwise it is
+ * left untouched: the partitions are taken from a clone.  On success,
+ * BufsOut is filled with NumParts memory buffers.  The module is only
+ * consumed on success.
+ */
+API_EXPORT(int)
+LLVMPY_TargetMachineEmitSplitToMemory (
+    LLVMTargetMachineRef TM,
+    LLVMModuleRef M,
+    int use_object,
+    unsigned NumParts,
+    int consume,
+    LLVMMemoryBufferRef *BufsOut,
+    const char ** ErrOut
+    )
+{
+    using namespace llvm;
+    TimeTraceScope timeScope("EmitSplitToMemory",
+                             unwrap(M)->getModuleIdentifier());
+#if LLVM_VERSION_MAJOR < 11
+    // The time trace profiler is shared by all threads before LLVM 11
+    if (timeTraceProfilerEnabled()) {
+        *ErrOut = LLVMPY_CreateString(
+            "parallel code generation can't be traced before LLVM 11");
+        return 1;
+    }
+#endif
+    TargetMachine *tm = unwrap(TM);
+#if LLVM_VERSION_MAJOR >= 10
+    LLVMPYCodeGenFileType filetype =
+        use_object ? CGFT_ObjectFile : CGFT_AssemblyFile;
+#else
+    LLVMPYCodeGenFileType filetype =
+        use_object ? TargetMachine::CGFT_ObjectFile
+                   : TargetMachine::CGFT_AssemblyFile;
+#endif
+
+    LLVMPYTargetMachineFactory factory = [tm]() {
+        return std::unique_ptr<TargetMachine>(
+            tm->getTarget().createTargetMachine(
+                tm->getTargetTriple().str(), tm->getTargetCPU(),
+                tm->getTargetFeatureString(), tm->Options,
+                tm->getRelocationModel(), tm->getCodeModel(),
+                tm->getOptLevel()));
+    };
+
+    // splitCodeGen() aborts on unsupported file types, check beforehand
+    if (!canEmitFile(tm->getTarget(), filetype, factory)) {
+        *ErrOut = LLVMPY_CreateString(
+            "TargetMachine can't emit a file of this type");
+        return 1;
+    }
+
+    std::vector<SmallVector<char, 0>> buffers(NumParts);
+    std::vector<std::unique_ptr<raw_svector_ostream>> streams;
+    std::vector<raw_pwrite_stream *> outs;
+    for (auto &buf : buffers) {
+        streams.emplace_back(new raw_svector_ostream(buf));
+        outs.push_back(streams.back().get());
+    }
+
+    // splitCodeGen() changes the module, e.g. the linkage of its locals
+    std::unique_ptr<Module> mod(consume ? unwrap(M)
+                                        : CloneModule(*unwrap(M)).release());
+#if LLVM_VERSION_MAJOR >= 12
+    splitCodeGen(*mod, outs, {}, factory, filetype);
+#else
+    splitCodeGen(std::move(mod), outs, {}, factory, filetype);
+#endif
+
+    streams.clear();
+    for (unsigned i = 0; i < NumParts; ++i) {
+        BufsOut[i] = wrap(new SmallVectorMemoryBuffer(std::move(buffers[i])));
+    }
+    return 0;
+}
+
 API_EXPORT(LLVMTargetDataRef)
 LLVMPY_CreateTargetMachineData(LLVMTargetMachineRef TM)
 {
@@ -0,0 +1,113 @@
+#include "core.h"
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <thread>
+
+/*
+ * LLVM's time trace profiler records nested, timestamped sections in the
+ * Chrome trace event format.  Besides the sections recorded by LLVM itself
+ * (e.g. passes and code generation), the llvmlite entry points covering the
+ * stages of a compilation (parsing, optimization, code generation, linking
+ * and finalization) record a section named after them.
+ *
+ * From LLVM 11 the profiler is thread-local: only the thread which
+ * initialized it records sections, and the entry points running on other
+ * threads, including the code generation threads of splitCodeGen(), the
+ * parsing threads of LLVMPY_ParseAssemblyBatch() and the compile threads
+ * of LLJIT, record nothing.
+ *
+ * Before that, it is a single unsynchronized instance shared by all
+ * threads.  While it records, the Python wrapper serializes the calls into
+ * the library, LLVMPY_ParseAssemblyBatch() parses on the calling thread
+ * only, and the entry points which would record from threads of their own
+ * (splitCodeGen() and the compile threads of LLJIT) fail instead.  The
+ * sections begun by LLVMPY_TimeTraceProfilerBegin() span several calls, so
+ * only those of the thread which initialized the profiler are recorded.
+ */
+
+#if LLVM_VERSION_MAJOR < 11
+static std::thread::id tracingThread;
+#endif
+
+extern "C" {
+
+API_EXPORT(int)
+LLVMPY_TimeTraceProfilerInitialize(unsigned Granularity,
+                                   const char *ProcessName,
+                                   const char **OutError)
+{
+    using namespace llvm;
+    if (timeTraceProfilerEnabled()) {
+        *OutError = LLVMPY_CreateString("time trace is already enabled");
+        return 1;
+    }
+#if LLVM_VERSION_MAJOR >= 10
+    timeTraceProfilerInitialize(Granularity, ProcessName);
+#else
+    timeTraceProfilerInitialize();
+#endif
+#if LLVM_VERSION_MAJOR < 11
+    tracingThread = std::this_thread::get_id();
+#endif
+    return 0;
+}
+
+API_EXPORT(int)
+LLVMPY_TimeTraceProfilerEnabled()
+{
+    return llvm::timeTraceProfilerEnabled();
+}
+
+/*
+ * Stop the profiler and return the trace as a JSON string.  All sections
+ * must have been ended.
+ */
+API_EXPORT(int)
+LLVMPY_TimeTraceProfilerFinish(const char **OutTrace,
+                               const char **OutError)
+{
+    using namespace llvm;
+    if (!timeTraceProfilerEnabled()) {
+        *OutError = LLVMPY_CreateString("time trace is not enabled");
+        return 1;
+    }
+    SmallString<0> buf;
+    raw_svector_ostream os(buf);
+    timeTraceProfilerWrite(os);
+    timeTraceProfilerCleanup();
+    *OutTrace = LLVMPY_CreateString(buf.c_str());
+    return 0;
+}
+
+/*
+ * Begin a section, returning whether it is recorded, in which case it
+ * must be ended with LLVMPY_TimeTraceProfilerEnd().
+ */
+API_EXPORT(int)
+LLVMPY_TimeTraceProfilerBegin(const char *Name,
+                              const char *Detail)
+{
+    using namespace llvm;
+    if (!timeTraceProfilerEnabled())
+        return 0;
+#if LLVM_VERSION_MAJOR < 11
+    if (std::this_thread::get_id() != tracingThread)
+        return 0;
+#endif
+    timeTraceProfilerBegin(Name, Detail);
+    return 1;
+}
+
+API_EXPORT(void)
+LLVMPY_TimeTraceProfilerEnd()
+{
+    using namespace llvm;
+    if (timeTraceProfilerEnabled())
+        timeTraceProfilerEnd();
+}
+
+} // end extern "C"
@@ -4,6 +4,9 @@
 
 #include <iostream>
 
+#include "llvm/IR/GlobalValue.h"
+#include "llvm/Support/Error.h"
+
 // the following is needed for WriteGraph()
 #include "llvm/Analysis/CFGPrinter.h"
 
@@ -482,6 +485,30 @@ LLVMPY_IsDeclaration(LLVMValueRef GV)
     return LLVMIsDeclaration(GV);
 }
 
+API_EXPORT(int)
+LLVMPY_IsMaterializable(LLVMValueRef GV)
+{
+    return llvm::unwrap<llvm::GlobalValue>(GV)->isMaterializable();
+}
+
+/*
+ * Materialize the body of a global of a lazily loaded module, if not done
+ * yet.
+ */
+API_EXPORT(int)
+LLVMPY_Materialize(LLVMValueRef GV, const char **OutError)
+{
+    llvm::GlobalValue *G = llvm::unwrap<llvm::GlobalValue>(GV);
+    if (!G->isMaterializable())
+        return 0;
+    if (llvm::Error err = G->materialize()) {
+        *OutError = LLVMPY_CreateString(
+            llvm::toString(std::move(err)).c_str());
+        return 1;
+    }
+    return 0;
+}
+
 
 API_EXPORT(void)
 LLVMPY_WriteCFG(LLVMValueRef Fval, const char **OutStr, int ShowInst) {
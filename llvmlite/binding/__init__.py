@@ -13,4 +13,7 @@ from .transforms import *
 from .value import *
 from .analysis import *
 from .object_file import *
-from .context import *
\ No newline at end of file
+from .context import *
+from .timetrace import *
+from .irstream import *
+from .snapshot import *
\ No newline at end of file
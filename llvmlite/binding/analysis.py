@@ -2,10 +2,13 @@
 A collection of analysis utilities
 """
 
-from ctypes import POINTER, c_char_p, c_int
+from collections import namedtuple
+from ctypes import (POINTER, Structure, c_char_p, c_int, c_size_t, c_uint,
+                    c_uint64)
 
 from llvmlite import ir
 from llvmlite.binding import ffi
+from llvmlite.binding.common import _encode_string, _name_list
 from llvmlite.binding.module import parse_assembly
 
 
@@ -27,6 +30,73 @@ def get_function_cfg(func, show_inst=True):
         return str(dotstr)
 
 
+FunctionStats = namedtuple('FunctionStats', ['name', 'instructions', 'blocks',
+                                             'calls', 'loops', 'refops',
+                                             'opcodes'])
+
+
+def get_function_stats(module, incref_names=None, decref_names=None):
+    """
+    Return a list of FunctionStats for the functions defined in *module*,
+    all computed in a single native call.  Besides the numbers of
+    instructions, blocks, calls, loops and refops, each gives a dict of the
+    numbers of instructions by opcode.
+
+    Refops are the calls to the functions named in *incref_names* and
+    *decref_names*, as for ModulePassManager.add_refprune_pass().  Both
+    default to the functions of Numba's runtime, NRT_incref and NRT_decref.
+    """
+    module.materialize_all()
+    if incref_names is None and decref_names is None:
+        names = None
+        numnames = 0
+    else:
+        if incref_names is None:
+            incref_names = ["NRT_incref"]
+        if decref_names is None:
+            decref_names = ["NRT_decref"]
+        allnames = _name_list(incref_names) + _name_list(decref_names)
+        names = (c_char_p * len(allnames))(*map(_encode_string, allnames))
+        numnames = len(allnames)
+    count = ffi.lib.LLVMPY_GetFunctionStats(module, names, numnames, None,
+                                            None, 0)
+    stats = (_FunctionStats * count)()
+    numops = ffi.lib.LLVMPY_GetOpcodeCount()
+    opcodes = (c_uint64 * (count * numops))()
+    ffi.lib.LLVMPY_GetFunctionStats(module, names, numnames, stats, opcodes,
+                                    count)
+    names = _opcode_names(numops)
+    result = []
+    for i, st in enumerate(stats):
+        counts = opcodes[i * numops:(i + 1) * numops]
+        result.append(FunctionStats(
+            st.name.decode('utf8'), st.instructions, st.blocks, st.calls,
+            st.loops, st.refops,
+            {names[op]: n for op, n in enumerate(counts) if n}))
+    return result
+
+
+_opcode_name_cache = []
+
+
+def _opcode_names(numops):
+    if not _opcode_name_cache:
+        _opcode_name_cache.extend(
+            ffi.lib.LLVMPY_GetOpcodeNameOf(op).decode('utf8')
+            for op in range(numops))
+    return _opcode_name_cache
+
+
+class _FunctionStats(Structure):
+    # The LLVMPYFunctionStats struct from ffi/module.cpp
+    _fields_ = [('name', c_char_p),
+                ('instructions', c_uint64),
+                ('blocks', c_uint64),
+                ('calls', c_uint64),
+                ('loops', c_uint64),
+                ('refops', c_uint64)]
+
+
 def view_dot_graph(graph, filename=None, view=False):
     """
     View the given DOT source.  If view is True, the image is rendered
@@ -67,3 +137,19 @@ def view_dot_graph(graph, filename=None, view=False):
 
 # Ctypes binding
 ffi.lib.LLVMPY_WriteCFG.argtypes = [ffi.LLVMValueRef, POINTER(c_char_p), c_int]
+
+ffi.lib.LLVMPY_GetFunctionStats.argtypes = [ffi.LLVMModuleRef,
+                                            POINTER(c_char_p), c_size_t,
+                                            POINTER(_FunctionStats),
+                                            POINTER(c_uint64), c_size_t]
+ffi.lib.LLVMPY_GetFunctionStats.restype = c_size_t
+
+ffi.lib.LLVMPY_GetOpcodeCount.restype = c_uint
+
+ffi.lib.LLVMPY_GetOpcodeNameOf.argtypes = [c_uint]
+ffi.lib.LLVMPY_GetOpcodeNameOf.restype = c_char_p
+
+# These only read constant tables
+for _func in (ffi.lib.LLVMPY_GetOpcodeCount,
+              ffi.lib.LLVMPY_GetOpcodeNameOf):
+    _func.mark_threadsafe()
@@ -14,6 +14,19 @@ _encode_string.__doc__ = """Encode a string for use by LLVM."""
 _decode_string.__doc__ = """Decode a LLVM character (byte)string."""
 
 
+def _name_list(names):
+    """
+    Return *names*, a sequence of names or a single name, as a list, or
+    None if it is None.  A single name is not taken as the sequence of its
+    characters.
+    """
+    if names is None:
+        return None
+    if isinstance(names, str):
+        return [names]
+    return list(names)
+
+
 _shutting_down = [False]
 
 
@@ -1,3 +1,5 @@
+import threading
+
 from llvmlite.binding import ffi
 
 
@@ -18,6 +20,9 @@ class ContextRef(ffi.ObjectRef):
 
 
 class GlobalContextRef(ContextRef):
+    # All the references to the global context share its lock
+    _ffi_locks = (threading.RLock(),)
+
     def _dispose(self):
         pass
 
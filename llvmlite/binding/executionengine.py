@@ -1,8 +1,12 @@
 from ctypes import (POINTER, c_char_p, c_bool, c_void_p,
-                    c_int, c_uint64, c_size_t, CFUNCTYPE, string_at, cast,
-                    py_object, Structure)
+                    c_int, c_uint, c_uint64, c_size_t, CFUNCTYPE, string_at,
+                    byref, cast, py_object, Structure)
+
+from collections import namedtuple
+import os
 
 from llvmlite.binding import ffi, targets, object_file
+from llvmlite.binding.common import _encode_string
 
 
 # Just check these weren't optimized out of the DLL.
@@ -14,6 +18,7 @@ def create_mcjit_compiler(module, target_machine):
     Create a MCJIT ExecutionEngine from the given *module* and
     *target_machine*.
     """
+    module.materialize_all()
     with ffi.OutputString() as outerr:
         engine = ffi.lib.LLVMPY_CreateMCJITCompiler(
             module, target_machine, outerr)
@@ -24,6 +29,57 @@ def create_mcjit_compiler(module, target_machine):
     return ExecutionEngine(engine, module=module)
 
 
+def create_lljit_compiler(module, target_machine, num_compile_threads=0,
+                          lazy=False):
+    """
+    Create an ORC LLJIT-powered ExecutionEngine from the given *module* and
+    *target_machine*.  The configuration of *target_machine* is copied, so
+    it remains owned by the caller.
+
+    If *num_compile_threads* is non-zero, modules are compiled concurrently
+    on a pool of that many threads.
+
+    If *lazy* is true, functions are compiled one at a time on their first
+    call: the addresses returned by the engine point to stubs which trigger
+    the compilation.
+    """
+    with ffi.OutputString() as outerr:
+        engine = ffi.lib.LLVMPY_CreateLLJITCompiler(
+            target_machine, num_compile_threads, int(lazy), outerr)
+        if not engine:
+            raise RuntimeError(str(outerr))
+
+    return LLJITExecutionEngine(engine, module=module)
+
+
+def create_disk_object_cache(directory, max_size=0, compress=False,
+                             background_writes=False, max_queued_writes=64):
+    """
+    Create a DiskObjectCache storing compiled objects in *directory*, which
+    is created if needed.  If *max_size* is non-zero, the least recently
+    used objects are removed whenever the objects stored exceed that many
+    bytes.
+
+    If *compress* is true, objects are compressed with zlib.  If
+    *background_writes* is true, objects are written by a background
+    thread, with at most *max_queued_writes* objects waiting to be written;
+    see DiskObjectCache.flush().
+    """
+    if compress and not ffi.lib.LLVMPY_IsCompressionAvailable():
+        raise RuntimeError("LLVM was built without zlib support")
+    if background_writes and max_queued_writes <= 0:
+        raise ValueError("max_queued_writes must be positive")
+    directory = os.fspath(directory)
+    with ffi.OutputString() as outerr:
+        ptr = ffi.lib.LLVMPY_CreateDiskObjectCache(
+            _encode_string(directory), max_size, compress,
+            max_queued_writes if background_writes else 0, outerr)
+        if not ptr:
+            raise OSError("cannot create object cache in %r: %s"
+                          % (directory, outerr))
+    return DiskObjectCache(ptr, directory)
+
+
 def check_jit_execution():
     """
     Check the system allows execution of in-memory JITted functions.
@@ -51,9 +107,19 @@ class ExecutionEngine(ffi.ObjectRef):
         """
         self._modules = set([module])
         self._td = None
+        # Buffers used in place by the engine, see _raw_object_cache_getbuffer
+        self._object_cache_buffers = []
         module._owned = True
         ffi.ObjectRef.__init__(self, ptr)
 
+    @property
+    def _ffi_locks(self):
+        # The engine may touch any of its modules, hence their contexts
+        locks = ffi.ObjectRef._ffi_locks.fget(self)
+        for module in self._modules:
+            locks += module._ffi_locks
+        return locks
+
     def get_function_address(self, name):
         """
         Return the address of the function named *name* as an integer.
@@ -80,6 +146,7 @@ class ExecutionEngine(ffi.ObjectRef):
         """
         if module in self._modules:
             raise KeyError("module already added to this engine")
+        module.materialize_all()
         ffi.lib.LLVMPY_AddModule(self, module)
         module._owned = True
         self._modules.add(module)
@@ -159,6 +226,11 @@ class ExecutionEngine(ffi.ObjectRef):
         """
         Set the object cache "notifyObjectCompiled" and "getBuffer"
         callbacks to the given Python functions.
+
+        *getbuffer_func* can return None, an object supporting the buffer
+        protocol (e.g. bytes, bytearray or mmap, read-only or not), which
+        the engine then uses in place and keeps a reference to, or the path
+        of an object file, which LLVM maps into memory.
         """
         self._object_cache_notify = notify_func
         self._object_cache_getbuffer = getbuffer_func
@@ -168,6 +240,16 @@ class ExecutionEngine(ffi.ObjectRef):
         # cycles.
         ffi.lib.LLVMPY_SetObjectCache(self, self._object_cache)
 
+    def set_disk_object_cache(self, cache):
+        """
+        Set a DiskObjectCache as the object cache of this engine.  Objects
+        are looked up and stored without calling back into Python.
+        """
+        # The engine owns its view of the cache, which keeps the cache
+        # alive
+        view = ffi.lib.LLVMPY_SetDiskObjectCache(self, cache)
+        self._object_cache = _DiskObjectCacheViewRef(view, cache)
+
     def _raw_object_cache_notify(self, data):
         """
         Low-level notify hook.
@@ -201,10 +283,23 @@ class ExecutionEngine(ffi.ObjectRef):
                                "for unknown module %s" % (module_ptr,))
 
         buf = self._object_cache_getbuffer(module)
-        if buf is not None:
-            # Create a copy, which will be freed by the caller
-            data[0].buf_ptr = ffi.lib.LLVMPY_CreateByteString(buf, len(buf))
-            data[0].buf_len = len(buf)
+        if buf is None:
+            return
+        if isinstance(buf, (str, os.PathLike)):
+            # Freed by the caller
+            data[0].path = ffi.lib.LLVMPY_CreateString(
+                _encode_string(os.fspath(buf)))
+            return
+        try:
+            # Also prevents resizing or closing the buffer
+            view = ffi.BufferView(buf)
+        except BufferError:
+            # Non-contiguous buffers are copied
+            view = ffi.BufferView(memoryview(buf).tobytes())
+        # The engine refers to the buffer until it is disposed of
+        self._object_cache_buffers.append(view)
+        data[0].buf_ptr = view.address
+        data[0].buf_len = len(view)
 
     def _dispose(self):
         # The modules will be cleaned up by the EE
@@ -212,9 +307,205 @@ class ExecutionEngine(ffi.ObjectRef):
             mod.detach()
         if self._td is not None:
             self._td.detach()
-        self._modules.clear()
-        self._object_cache = None
+        # Disposing of the modules requires the locks of their contexts
         self._capi.LLVMPY_DisposeExecutionEngine(self)
+        # The object cache is only released once the engine is gone
+        self._object_cache = None
+        self._modules.clear()
+        for view in self._object_cache_buffers:
+            view.release()
+        self._object_cache_buffers.clear()
+
+
+class LLJITExecutionEngine(ExecutionEngine):
+    """An ExecutionEngine built on ORC LLJIT.
+
+    Each added module is compiled in its own LLVM context, which allows
+    several modules to be compiled at the same time when the engine was
+    created with compile threads.  As with MCJIT, the engine owns all the
+    modules associated with it.
+    """
+
+    def __init__(self, ptr, module):
+        self._modules = set()
+        self._td = None
+        ffi.ObjectRef.__init__(self, ptr)
+        self.add_module(module)
+
+    def get_function_address(self, name):
+        """
+        Return the address of the function named *name* as an integer.
+        RuntimeError is raised if the symbol cannot be found or compiled.
+        """
+        with ffi.OutputString() as outerr:
+            addr = ffi.lib.LLVMPY_LLJITLookup(self, name.encode("ascii"),
+                                              outerr)
+            if not addr:
+                raise RuntimeError(str(outerr))
+        return addr
+
+    get_global_value_address = get_function_address
+
+    def add_global_mapping(self, gv, addr):
+        """
+        Define the symbol of the global value *gv* at address *addr*.
+        """
+        with ffi.OutputString() as outerr:
+            if ffi.lib.LLVMPY_LLJITDefineSymbol(self, gv.name.encode("ascii"),
+                                                addr, outerr):
+                raise RuntimeError(str(outerr))
+
+    def add_module(self, module):
+        """
+        Ownership of module is transferred to the execution engine
+        """
+        if module in self._modules:
+            raise KeyError("module already added to this engine")
+        module.materialize_all()
+        with ffi.OutputString() as outerr:
+            if ffi.lib.LLVMPY_LLJITAddModule(self, module, outerr):
+                raise RuntimeError(str(outerr))
+        module._owned = True
+        self._modules.add(module)
+
+    def finalize_object(self):
+        """
+        Compile all the modules added since the last call.  With compile
+        threads, the modules are compiled concurrently.  This is a no-op for
+        lazy engines.
+        """
+        with ffi.OutputString() as outerr:
+            if ffi.lib.LLVMPY_LLJITFinalize(self, outerr):
+                raise RuntimeError(str(outerr))
+
+    def run_static_constructors(self):
+        """
+        Run static constructors which initialize module-level static objects.
+        """
+        with ffi.OutputString() as outerr:
+            if ffi.lib.LLVMPY_LLJITRunStaticConstructors(self, outerr):
+                raise RuntimeError(str(outerr))
+
+    def run_static_destructors(self):
+        """
+        Run static destructors which perform module-level cleanup of static
+        resources.
+        """
+        with ffi.OutputString() as outerr:
+            if ffi.lib.LLVMPY_LLJITRunStaticDestructors(self, outerr):
+                raise RuntimeError(str(outerr))
+
+    def remove_module(self, module):
+        raise NotImplementedError("LLJIT does not support removing modules")
+
+    @property
+    def target_data(self):
+        """
+        The TargetData for this execution engine.
+        """
+        if self._td is None:
+            self._td = targets.TargetData(
+                ffi.lib.LLVMPY_LLJITGetTargetData(self))
+        return self._td
+
+    def enable_jit_events(self):
+        """
+        JIT events are not supported by this engine, False is returned.
+        """
+        return False
+
+    def add_object_file(self, obj_file):
+        """
+        Add object file to the jit. object_file can be instance of
+        :class:ObjectFile or a string representing file system path
+        """
+        if isinstance(obj_file, str):
+            obj_file = object_file.ObjectFileRef.from_path(obj_file)
+
+        with ffi.OutputString() as outerr:
+            if ffi.lib.LLVMPY_LLJITAddObjectFile(self, obj_file, outerr):
+                raise RuntimeError(str(outerr))
+
+    def set_object_cache(self, notify_func=None, getbuffer_func=None):
+        raise NotImplementedError("LLJIT does not support object caches")
+
+    def set_disk_object_cache(self, cache):
+        raise NotImplementedError("LLJIT does not support object caches")
+
+    def _dispose(self):
+        # The modules will be cleaned up by the engine
+        for mod in self._modules:
+            mod.detach()
+        if self._td is not None:
+            self._td.close()
+        self._capi.LLVMPY_DisposeLLJIT(self)
+        self._modules.clear()
+
+
+ObjectCacheStats = namedtuple('ObjectCacheStats', ['hits', 'misses', 'writes'])
+
+
+class DiskObjectCache(ffi.ObjectRef):
+    """An object cache storing compiled objects in a directory, which can be
+    shared by several execution engines and processes.
+
+    Objects are keyed by a hash of the module's bitcode and of the
+    configuration of the engine's target machine.
+    """
+
+    def __init__(self, ptr, directory):
+        self._directory = directory
+        ffi.ObjectRef.__init__(self, ptr)
+
+    @property
+    def directory(self):
+        return self._directory
+
+    @property
+    def stats(self):
+        """
+        The numbers of cache hits, cache misses and objects written by this
+        cache object, as an ObjectCacheStats tuple.
+        """
+        hits, misses, writes = c_uint64(), c_uint64(), c_uint64()
+        ffi.lib.LLVMPY_DiskObjectCacheGetStats(self, byref(hits),
+                                               byref(misses), byref(writes))
+        return ObjectCacheStats(hits.value, misses.value, writes.value)
+
+    def flush(self):
+        """
+        Wait until the objects queued by background writes are written.
+        Disposing of the cache flushes it as well.
+        """
+        ffi.lib.LLVMPY_FlushDiskObjectCache(self)
+
+    def close(self):
+        """
+        Close the cache.  RuntimeError is raised if engines still use it.
+        """
+        if not self._closed:
+            n = ffi.lib.LLVMPY_DiskObjectCacheNumViews(self)
+            if n:
+                raise RuntimeError("DiskObjectCache is still used by %d "
+                                   "execution engine(s)" % (n,))
+        ffi.ObjectRef.close(self)
+
+    def _dispose(self):
+        self._capi.LLVMPY_DisposeDiskObjectCache(self)
+
+
+class _DiskObjectCacheViewRef(ffi.ObjectRef):
+    """
+    Internal: the view of a DiskObjectCache used by an ExecutionEngine.
+    """
+
+    def __init__(self, ptr, cache):
+        # Keep the cache alive as long as the view
+        self._cache = cache
+        ffi.ObjectRef.__init__(self, ptr)
+
+    def _dispose(self):
+        self._capi.LLVMPY_DisposeDiskObjectCacheView(self)
 
 
 class _ObjectCacheRef(ffi.ObjectRef):
@@ -287,11 +578,66 @@ ffi.lib.LLVMPY_MCJITAddObjectFile.argtypes = [
 ]
 
 
+ffi.lib.LLVMPY_CreateLLJITCompiler.argtypes = [
+    ffi.LLVMTargetMachineRef,
+    c_uint,
+    c_int,
+    POINTER(c_char_p),
+]
+ffi.lib.LLVMPY_CreateLLJITCompiler.restype = ffi.LLVMLLJITRef
+
+ffi.lib.LLVMPY_DisposeLLJIT.argtypes = [ffi.LLVMLLJITRef]
+
+ffi.lib.LLVMPY_LLJITAddModule.argtypes = [
+    ffi.LLVMLLJITRef,
+    ffi.LLVMModuleRef,
+    POINTER(c_char_p),
+]
+ffi.lib.LLVMPY_LLJITAddModule.restype = c_int
+
+ffi.lib.LLVMPY_LLJITAddObjectFile.argtypes = [
+    ffi.LLVMLLJITRef,
+    ffi.LLVMObjectFileRef,
+    POINTER(c_char_p),
+]
+ffi.lib.LLVMPY_LLJITAddObjectFile.restype = c_int
+
+ffi.lib.LLVMPY_LLJITFinalize.argtypes = [
+    ffi.LLVMLLJITRef,
+    POINTER(c_char_p),
+]
+ffi.lib.LLVMPY_LLJITFinalize.restype = c_int
+
+ffi.lib.LLVMPY_LLJITLookup.argtypes = [
+    ffi.LLVMLLJITRef,
+    c_char_p,
+    POINTER(c_char_p),
+]
+ffi.lib.LLVMPY_LLJITLookup.restype = c_uint64
+
+ffi.lib.LLVMPY_LLJITDefineSymbol.argtypes = [
+    ffi.LLVMLLJITRef,
+    c_char_p,
+    c_void_p,
+    POINTER(c_char_p),
+]
+ffi.lib.LLVMPY_LLJITDefineSymbol.restype = c_int
+
+for _func in (ffi.lib.LLVMPY_LLJITRunStaticConstructors,
+              ffi.lib.LLVMPY_LLJITRunStaticDestructors):
+    _func.argtypes = [ffi.LLVMLLJITRef, POINTER(c_char_p)]
+    _func.restype = c_int
+
+ffi.lib.LLVMPY_LLJITGetTargetData.argtypes = [ffi.LLVMLLJITRef]
+ffi.lib.LLVMPY_LLJITGetTargetData.restype = ffi.LLVMTargetDataRef
+
+
 class _ObjectCacheData(Structure):
     _fields_ = [
         ('module_ptr', ffi.LLVMModuleRef),
         ('buf_ptr', c_void_p),
         ('buf_len', c_size_t),
+        ('path', c_void_p),
     ]
 
 
@@ -318,5 +664,39 @@ ffi.lib.LLVMPY_DisposeObjectCache.argtypes = [ffi.LLVMObjectCacheRef]
 ffi.lib.LLVMPY_SetObjectCache.argtypes = [ffi.LLVMExecutionEngineRef,
                                           ffi.LLVMObjectCacheRef]
 
-ffi.lib.LLVMPY_CreateByteString.restype = c_void_p
-ffi.lib.LLVMPY_CreateByteString.argtypes = [c_void_p, c_size_t]
+ffi.lib.LLVMPY_IsCompressionAvailable.restype = c_bool
+
+ffi.lib.LLVMPY_CreateDiskObjectCache.argtypes = [c_char_p, c_uint64, c_bool,
+                                                 c_size_t,
+                                                 POINTER(c_char_p)]
+ffi.lib.LLVMPY_CreateDiskObjectCache.restype = ffi.LLVMDiskObjectCacheRef
+
+ffi.lib.LLVMPY_DisposeDiskObjectCache.argtypes = [ffi.LLVMDiskObjectCacheRef]
+
+ffi.lib.LLVMPY_SetDiskObjectCache.argtypes = [ffi.LLVMExecutionEngineRef,
+                                              ffi.LLVMDiskObjectCacheRef]
+ffi.lib.LLVMPY_SetDiskObjectCache.restype = ffi.LLVMDiskObjectCacheViewRef
+
+ffi.lib.LLVMPY_DisposeDiskObjectCacheView.argtypes = [
+    ffi.LLVMDiskObjectCacheViewRef]
+
+ffi.lib.LLVMPY_DiskObjectCacheNumViews.argtypes = [ffi.LLVMDiskObjectCacheRef]
+ffi.lib.LLVMPY_DiskObjectCacheNumViews.restype = c_size_t
+
+ffi.lib.LLVMPY_DiskObjectCacheGetStats.argtypes = [
+    ffi.LLVMDiskObjectCacheRef,
+    POINTER(c_uint64),
+    POINTER(c_uint64),
+    POINTER(c_uint64),
+]
+
+ffi.lib.LLVMPY_FlushDiskObjectCache.argtypes = [ffi.LLVMDiskObjectCacheRef]
+
+# The cache synchronizes its own state
+for _func in (ffi.lib.LLVMPY_DiskObjectCacheGetStats,
+              ffi.lib.LLVMPY_DiskObjectCacheNumViews,
+              ffi.lib.LLVMPY_FlushDiskObjectCache):
+    _func.mark_threadsafe()
+
+ffi.lib.LLVMPY_CreateString.restype = c_void_p
+ffi.lib.LLVMPY_CreateString.argtypes = [c_char_p]
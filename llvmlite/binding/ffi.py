@@ -16,8 +16,10 @@ LLVMModuleRef = _make_opaque_ref("LLVMModule")
 LLVMValueRef = _make_opaque_ref("LLVMValue")
 LLVMTypeRef = _make_opaque_ref("LLVMType")
 LLVMExecutionEngineRef = _make_opaque_ref("LLVMExecutionEngine")
+LLVMLLJITRef = _make_opaque_ref("LLVMLLJIT")
 LLVMPassManagerBuilderRef = _make_opaque_ref("LLVMPassManagerBuilder")
 LLVMPassManagerRef = _make_opaque_ref("LLVMPassManager")
+LLVMPipelineRef = _make_opaque_ref("LLVMPipeline")
 LLVMTargetDataRef = _make_opaque_ref("LLVMTargetData")
 LLVMTargetLibraryInfoRef = _make_opaque_ref("LLVMTargetLibraryInfo")
 LLVMTargetRef = _make_opaque_ref("LLVMTarget")
@@ -33,13 +35,27 @@ LLVMInstructionsIterator = _make_opaque_ref("LLVMInstructionsIterator")
 LLVMOperandsIterator = _make_opaque_ref("LLVMOperandsIterator")
 LLVMTypesIterator = _make_opaque_ref("LLVMTypesIterator")
 LLVMObjectCacheRef = _make_opaque_ref("LLVMObjectCache")
+LLVMDiskObjectCacheRef = _make_opaque_ref("LLVMDiskObjectCache")
+LLVMDiskObjectCacheViewRef = _make_opaque_ref("LLVMDiskObjectCacheView")
 LLVMObjectFileRef = _make_opaque_ref("LLVMObjectFile")
 LLVMSectionIteratorRef = _make_opaque_ref("LLVMSectionIterator")
+LLVMIRSnapshotRef = _make_opaque_ref("LLVMIRSnapshot")
+LLVMRefPruneStatsRef = _make_opaque_ref("LLVMRefPruneStats")
 
 
 class _lib_wrapper(object):
-    """Wrap libllvmlite with a lock such that only one thread may access it at
-    a time.
+    """Wrap libllvmlite with locks such that calls on the same LLVM objects
+    are serialized, while calls on independent objects may run in parallel.
+
+    Each wrapped function picks its locks from its arguments: an ObjectRef
+    argument contributes the locks returned by its ``_ffi_locks`` attribute,
+    e.g. a ModuleRef contributes the lock of its LLVM context.  Calls without
+    any such argument, and functions marked with ``mark_global()`` because
+    they touch process-wide state, take the global lock.  The global lock
+    is always taken after the locks of the arguments, so that callbacks
+    making global calls while those are held cannot deadlock.  While
+    ``_serialize_calls`` is true, every call takes the global lock, even
+    those of functions marked with ``mark_threadsafe()``.
 
     This class duck-types a CDLL.
     """
@@ -79,18 +95,36 @@ class _lib_wrapper(object):
         return self._lib._handle
 
 
+# Set while a time trace is recorded with LLVM < 11, whose profiler is
+# shared by all threads without synchronization.
+_serialize_calls = False
+
+
+def _get_arg_locks(args):
+    """Return the locks guarding the LLVM objects in *args*, in a consistent
+    order so that threads acquiring several of them cannot deadlock.
+    """
+    locks = []
+    for arg in args:
+        for lock in getattr(arg, '_ffi_locks', ()):
+            if lock not in locks:
+                locks.append(lock)
+    if len(locks) > 1:
+        locks.sort(key=id)
+    return locks
+
+
 class _lib_fn_wrapper(object):
     """Wraps and duck-types a ctypes.CFUNCTYPE to provide
     automatic locking when the wrapped function is called.
-
-    TODO: we can add methods to mark the function as threadsafe
-          and remove the locking-step on call when marked.
     """
-    __slots__ = ['_lock', '_cfn']
+    __slots__ = ['_lock', '_cfn', '_threadsafe', '_global']
 
     def __init__(self, lock, cfn):
         self._lock = lock
         self._cfn = cfn
+        self._threadsafe = False
+        self._global = False
 
     @property
     def argtypes(self):
@@ -108,9 +142,30 @@ class _lib_fn_wrapper(object):
     def restype(self, restype):
         self._cfn.restype = restype
 
+    def mark_threadsafe(self):
+        """Mark the function as safe to call without any lock held.
+        """
+        self._threadsafe = True
+
+    def mark_global(self):
+        """Mark the function as touching process-wide state, so that it is
+        always called with the global lock held.
+        """
+        self._global = True
+
     def __call__(self, *args, **kwargs):
-        with self._lock:
+        if self._threadsafe and not _serialize_calls:
+            return self._cfn(*args, **kwargs)
+        locks = _get_arg_locks(args)
+        if self._global or _serialize_calls or not locks:
+            locks.append(self._lock)
+        for lock in locks:
+            lock.acquire()
+        try:
             return self._cfn(*args, **kwargs)
+        finally:
+            for lock in reversed(locks):
+                lock.release()
 
 
 _lib_dir = os.path.dirname(__file__)
@@ -155,6 +210,12 @@ else:
 
 lib = _lib_wrapper(lib)
 
+# These only touch memory owned by the caller
+for _func in (lib.LLVMPY_CreateString,
+              lib.LLVMPY_CreateByteString,
+              lib.LLVMPY_DisposeString):
+    _func.mark_threadsafe()
+
 
 class _DeadPointer(object):
     """
@@ -254,6 +315,20 @@ class ObjectRef(object):
         self._as_parameter_ = ptr
         self._capi = lib
 
+    @property
+    def _ffi_locks(self):
+        """
+        The locks to hold while this object is passed to libllvmlite.  By
+        default each object has a lock of its own; subclasses representing
+        objects owned by another one return the locks of their owner.
+        """
+        try:
+            return self._own_ffi_locks
+        except AttributeError:
+            # setdefault() is atomic, so racing threads get the same lock
+            return self.__dict__.setdefault('_own_ffi_locks',
+                                            (threading.RLock(),))
+
     def close(self):
         """
         Close this object and do any required clean-up actions.
@@ -316,3 +391,86 @@ class ObjectRef(object):
     # XXX useful?
     def __hash__(self):
         return hash(ctypes.cast(self._ptr, ctypes.c_void_p).value)
+
+
+class ObjectRefArray(object):
+    """
+    A C array of the pointers of several ObjectRefs of the same *reftype*,
+    for functions taking them all at once.  Its locks are the locks of all
+    the objects.
+    """
+
+    def __init__(self, reftype, objs):
+        objs = list(objs)
+        for obj in objs:
+            if obj.closed:
+                raise ValueError("%s instance already closed"
+                                 % (obj.__class__,))
+        self._objs = objs
+        self._array = (reftype * len(objs))(*[obj._ptr for obj in objs])
+        self._as_parameter_ = ctypes.cast(self._array,
+                                          ctypes.POINTER(reftype))
+        self._ffi_locks = _get_arg_locks(objs)
+
+    def __len__(self):
+        return len(self._objs)
+
+
+class _Py_buffer(ctypes.Structure):
+    _fields_ = [('buf', ctypes.c_void_p),
+                ('obj', ctypes.c_void_p),
+                ('len', ctypes.c_ssize_t),
+                ('itemsize', ctypes.c_ssize_t),
+                ('readonly', ctypes.c_int),
+                ('ndim', ctypes.c_int),
+                ('format', ctypes.c_char_p),
+                ('shape', ctypes.POINTER(ctypes.c_ssize_t)),
+                ('strides', ctypes.POINTER(ctypes.c_ssize_t)),
+                ('suboffsets', ctypes.POINTER(ctypes.c_ssize_t)),
+                ('internal', ctypes.c_void_p)]
+
+
+_PyBUF_SIMPLE = 0
+
+_PyObject_GetBuffer = ctypes.PYFUNCTYPE(
+    ctypes.c_int, ctypes.py_object, ctypes.POINTER(_Py_buffer), ctypes.c_int
+)(('PyObject_GetBuffer', ctypes.pythonapi))
+
+_PyBuffer_Release = ctypes.PYFUNCTYPE(
+    None, ctypes.POINTER(_Py_buffer)
+)(('PyBuffer_Release', ctypes.pythonapi))
+
+
+class BufferView(object):
+    """
+    The memory of an object supporting the buffer protocol, e.g. bytes or
+    a read-only mmap or memoryview, exported without copying it.  The
+    object can't be resized or closed until the view is released.  A
+    BufferError is raised if the memory isn't contiguous.
+    """
+    _released = True
+
+    def __init__(self, obj):
+        self._view = _Py_buffer()
+        _PyObject_GetBuffer(obj, ctypes.byref(self._view), _PyBUF_SIMPLE)
+        self._released = False
+
+    @property
+    def address(self):
+        return self._view.buf
+
+    @property
+    def _as_parameter_(self):
+        return ctypes.c_void_p(self._view.buf)
+
+    def __len__(self):
+        return self._view.len
+
+    def release(self):
+        if not self._released:
+            self._released = True
+            _PyBuffer_Release(ctypes.byref(self._view))
+
+    def __del__(self):
+        if not _is_shutting_down():
+            self.release()
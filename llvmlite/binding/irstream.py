@@ -0,0 +1,675 @@
+"""
+A binary encoding of llvmlite.ir modules, from which LLVM modules are built
+directly with IRBuilder rather than by formatting and parsing textual IR.
+See ffi/irstream.cpp for the decoder.
+"""
+
+from array import array
+from ctypes import POINTER, c_char_p, c_size_t, c_void_p
+import re
+import struct
+
+from llvmlite import ir
+from llvmlite.ir.types import _as_float, _as_half
+from llvmlite.binding import ffi
+from llvmlite.binding.context import get_global_context
+from llvmlite.binding.module import ModuleRef, parse_assembly
+
+
+def build_ir_module(module, context=None):
+    """
+    Create a ModuleRef from the llvmlite.ir Module *module*.  The module is
+    built directly from its instructions, which is faster than parsing
+    str(*module*); modules using constructs that cannot be built that way,
+    such as metadata, are parsed from str(*module*) instead.
+    """
+    if context is None:
+        context = get_global_context()
+    stream = _encode_module(module)
+    if stream is not None:
+        words, strings = stream
+        with ffi.OutputString() as errmsg:
+            ptr = ffi.lib.LLVMPY_BuildModuleFromStream(
+                context, words.buffer_info()[0], len(words), strings,
+                len(strings), errmsg)
+        if ptr:
+            return ModuleRef(ptr, context)
+    # Let the assembly parser build the module or report what is wrong
+    # with it
+    return parse_assembly(str(module), context)
+
+
+# ============================================================================
+# Encoding
+#
+# The records and the tables below are kept in sync with ffi/irstream.cpp.
+
+_REC_MODULE = 1
+
+_REC_TYPE_VOID = 10
+_REC_TYPE_INT = 11
+_REC_TYPE_HALF = 12
+_REC_TYPE_FLOAT = 13
+_REC_TYPE_DOUBLE = 14
+_REC_TYPE_POINTER = 15
+_REC_TYPE_FUNCTION = 16
+_REC_TYPE_ARRAY = 17
+_REC_TYPE_VECTOR = 18
+_REC_TYPE_STRUCT = 19
+_REC_TYPE_NAMED = 20
+_REC_TYPE_BODY = 21
+
+_REC_GLOBAL_VARIABLE = 30
+_REC_FUNCTION = 31
+_REC_INITIALIZER = 32
+
+_REC_CONST_INT = 40
+_REC_CONST_WIDE_INT = 41
+_REC_CONST_FP = 42
+_REC_CONST_NULL = 43
+_REC_CONST_UNDEF = 44
+_REC_CONST_AGGREGATE = 45
+_REC_CONST_STRING = 46
+
+_REC_BODY = 50
+_REC_BLOCK = 51
+_REC_END = 52
+_REC_FORWARD = 53
+_REC_RESOLVE = 54
+
+_REC_BINOP = 60
+_REC_ICMP = 61
+_REC_FCMP = 62
+_REC_CAST = 63
+_REC_SELECT = 64
+_REC_LOAD = 65
+_REC_STORE = 66
+_REC_ALLOCA = 67
+_REC_GEP = 68
+_REC_PHI = 69
+_REC_CALL = 70
+_REC_RET = 71
+_REC_BR = 72
+_REC_CONDBR = 73
+_REC_SWITCH = 74
+_REC_UNREACHABLE = 75
+_REC_EXTRACTVALUE = 76
+_REC_INSERTVALUE = 77
+_REC_EXTRACTELEMENT = 78
+_REC_INSERTELEMENT = 79
+_REC_SHUFFLEVECTOR = 80
+
+
+def _index(names):
+    return {name: i for i, name in enumerate(names)}
+
+
+_FLAGS = _index(['nuw', 'nsw', 'exact', 'nnan', 'ninf', 'nsz', 'arcp',
+                 'contract', 'afn', 'reassoc'])
+_FLAGS = {name: 1 << i for name, i in _FLAGS.items()}
+_FLAGS['fast'] = sum(_FLAGS[name] for name in ('nnan', 'ninf', 'nsz', 'arcp',
+                                               'contract', 'afn', 'reassoc'))
+_FLAG_TAIL = 1 << 10
+
+_BINARY_OPS = _index(['add', 'fadd', 'sub', 'fsub', 'mul', 'fmul', 'udiv',
+                      'sdiv', 'fdiv', 'urem', 'srem', 'frem', 'shl', 'lshr',
+                      'ashr', 'and', 'or', 'xor'])
+
+_CAST_OPS = _index(['trunc', 'zext', 'sext', 'fptrunc', 'fpext', 'bitcast',
+                    'addrspacecast', 'fptoui', 'uitofp', 'fptosi', 'sitofp',
+                    'ptrtoint', 'inttoptr'])
+
+_ICMP_PREDICATES = _index(['eq', 'ne', 'ugt', 'uge', 'ult', 'ule', 'sgt',
+                           'sge', 'slt', 'sle'])
+
+_FCMP_PREDICATES = _index(['false', 'oeq', 'ogt', 'oge', 'olt', 'ole', 'one',
+                           'ord', 'ueq', 'ugt', 'uge', 'ult', 'ule', 'une',
+                           'uno', 'true'])
+
+_LINKAGES = _index(['external', 'available_externally', 'linkonce',
+                    'linkonce_odr', 'weak', 'weak_odr', 'appending',
+                    'internal', 'private', 'extern_weak', 'common'])
+
+_STORAGE_CLASSES = _index(['', 'dllimport', 'dllexport'])
+
+_ATTRIBUTES = _index([
+    'argmemonly', 'alwaysinline', 'builtin', 'cold', 'inaccessiblememonly',
+    'inaccessiblemem_or_argmemonly', 'inlinehint', 'jumptable', 'minsize',
+    'naked', 'nobuiltin', 'noduplicate', 'noimplicitfloat', 'noinline',
+    'nonlazybind', 'norecurse', 'noredzone', 'noreturn', 'nounwind',
+    'optnone', 'optsize', 'readnone', 'readonly', 'returns_twice',
+    'sanitize_address', 'sanitize_memory', 'sanitize_thread', 'ssp',
+    'sspstrong', 'uwtable',
+    'inreg', 'nest', 'noalias', 'nocapture', 'nonnull', 'returned',
+    'signext', 'zeroext',
+    'align', 'alignstack', 'dereferenceable', 'dereferenceable_or_null'])
+
+# Calling convention numbers, as in llvm/IR/CallingConv.h
+_CALLING_CONVENTIONS = {
+    '': 0, 'ccc': 0, 'fastcc': 8, 'coldcc': 9, 'ghccc': 10,
+    'webkit_jscc': 12, 'anyregcc': 13, 'preserve_mostcc': 14,
+    'preserve_allcc': 15, 'swiftcc': 16, 'x86_stdcallcc': 64,
+    'x86_fastcallcc': 65, 'x86_thiscallcc': 70, 'ptx_kernel': 71,
+    'ptx_device': 72, 'spir_func': 75, 'spir_kernel': 76, 'win64cc': 79,
+    'x86_vectorcallcc': 80,
+}
+
+_NUMBERED_CALLING_CONVENTION = re.compile(r'cc (\d+)$')
+
+_FLOAT_TYPES = {
+    ir.HalfType: (_REC_TYPE_HALF, _as_half),
+    ir.FloatType: (_REC_TYPE_FLOAT, _as_float),
+    ir.DoubleType: (_REC_TYPE_DOUBLE, float),
+}
+
+_double_bits = struct.Struct('<q')
+_double = struct.Struct('<d')
+
+
+class _Unsupported(Exception):
+    """
+    Raised when encoding a construct without a binary encoding.
+    """
+
+
+def _encode_module(module):
+    """
+    Return the words and the strings encoding the llvmlite.ir Module
+    *module*, or None if it uses constructs without a binary encoding.
+    """
+    try:
+        return _Encoder().encode(module)
+    except _Unsupported:
+        return None
+
+
+def _lookup(table, key):
+    try:
+        return table[key]
+    except (KeyError, TypeError):
+        raise _Unsupported(key)
+
+
+def _calling_convention(cconv):
+    if not cconv:
+        return 0
+    try:
+        return _CALLING_CONVENTIONS[cconv]
+    except KeyError:
+        match = _NUMBERED_CALLING_CONVENTION.match(cconv)
+        if match is None:
+            raise _Unsupported(cconv)
+        return int(match.group(1))
+
+
+def _alignment(align):
+    if align is None:
+        return 0
+    if not isinstance(align, int) or align <= 0:
+        raise _Unsupported(align)
+    return align
+
+
+def _flags(flags):
+    bits = 0
+    for flag in flags:
+        bits |= _lookup(_FLAGS, flag)
+    return bits
+
+
+class _Encoder(object):
+    """
+    Encode a module as records appended to an array of words, referring
+    to types and values by their index in the decoder's tables.
+    """
+
+    def __init__(self):
+        self.words = array('q')
+        self.strings = []
+        self.strings_size = 0
+        self.types = {}
+        self.value_count = 0
+        # The values defined at the module level
+        self.globals = {}
+        # The values and constants defined in the current scope, by id()
+        # and by record respectively
+        self.values = self.globals
+        self.constants = {}
+        self.function = None
+        self.blocks = None
+
+    def encode(self, module):
+        if module.metadata or module.namedmetadata:
+            raise _Unsupported("metadata")
+        self.words.append(_REC_MODULE)
+        self.string(module.name)
+        self.string(module.triple)
+        self.string(module.data_layout)
+        for typ in module.get_identified_types().values():
+            self.type(typ)
+
+        global_values = list(module.global_values)
+        for gv in global_values:
+            if isinstance(gv, ir.Function):
+                self.declare_function(gv)
+            elif isinstance(gv, ir.GlobalVariable):
+                self.declare_variable(gv)
+            else:
+                raise _Unsupported(gv)
+        for gv in global_values:
+            if isinstance(gv, ir.GlobalVariable):
+                self.define_variable(gv)
+        for gv in global_values:
+            if isinstance(gv, ir.Function) and gv.blocks:
+                self.define_function(gv)
+        return self.words, b''.join(self.strings)
+
+    def string(self, text):
+        data = text.encode('utf-8') if isinstance(text, str) else bytes(text)
+        self.words.extend((self.strings_size, len(data)))
+        self.strings.append(data)
+        self.strings_size += len(data)
+
+    def push(self):
+        """
+        Account for a value defined by the record just encoded.
+        """
+        index = self.value_count
+        self.value_count += 1
+        return index
+
+    # Types
+
+    def type(self, typ):
+        # The string representation is cached and tells apart all types,
+        # unlike their equality
+        key = str(typ)
+        try:
+            return self.types[key]
+        except KeyError:
+            pass
+        words = self.words
+        cls = type(typ)
+        if cls is ir.IntType:
+            words.extend((_REC_TYPE_INT, typ.width))
+        elif cls in _FLOAT_TYPES:
+            words.append(_FLOAT_TYPES[cls][0])
+        elif cls is ir.PointerType:
+            pointee = self.type(typ.pointee)
+            words.extend((_REC_TYPE_POINTER, pointee, typ.addrspace))
+        elif cls is ir.VoidType:
+            words.append(_REC_TYPE_VOID)
+        elif cls is ir.FunctionType:
+            elements = [self.type(t) for t in (typ.return_type,) + typ.args]
+            words.extend((_REC_TYPE_FUNCTION, elements[0], typ.var_arg,
+                          len(typ.args)))
+            words.extend(elements[1:])
+        elif cls in (ir.ArrayType, ir.VectorType):
+            element = self.type(typ.element)
+            words.extend((_REC_TYPE_ARRAY if cls is ir.ArrayType
+                          else _REC_TYPE_VECTOR, element, typ.count))
+        elif cls is ir.LiteralStructType:
+            elements = [self.type(t) for t in typ.elements]
+            words.extend((_REC_TYPE_STRUCT, typ.packed, len(elements)))
+            words.extend(elements)
+        elif cls is ir.IdentifiedStructType:
+            return self.identified_type(key, typ)
+        else:
+            raise _Unsupported(typ)
+        index = self.types[key] = len(self.types)
+        return index
+
+    def identified_type(self, key, typ):
+        words = self.words
+        words.append(_REC_TYPE_NAMED)
+        self.string(typ.name)
+        # Defined before its body, which may refer to it
+        index = self.types[key] = len(self.types)
+        if not typ.is_opaque:
+            elements = [self.type(t) for t in typ.elements]
+            words.extend((_REC_TYPE_BODY, index, typ.packed, len(elements)))
+            words.extend(elements)
+        return index
+
+    # Values
+
+    def value(self, value):
+        try:
+            return self.values[id(value)]
+        except KeyError:
+            pass
+        if type(value) is ir.Constant:
+            index = self.constant(value)
+        elif (isinstance(value, ir.Instruction) and
+              value.parent.parent is self.function):
+            # A forward reference, resolved when the instruction is encoded
+            typ = self.type(value.type)
+            self.words.extend((_REC_FORWARD, typ))
+            index = self.push()
+        else:
+            raise _Unsupported(value)
+        self.values[id(value)] = index
+        return index
+
+    def constant(self, const):
+        typ = const.type
+        value = const.constant
+        ty = self.type(typ)
+        cls = type(typ)
+        if value is None:
+            record = (_REC_CONST_NULL, ty)
+        elif value is ir.Undefined:
+            record = (_REC_CONST_UNDEF, ty)
+        elif cls is ir.IntType and isinstance(value, int):
+            width = typ.width
+            if value is True or value is False:
+                # Formatted as true or false, only valid for i1
+                if width != 1:
+                    raise _Unsupported(const)
+            value &= (1 << width) - 1
+            if width <= 64:
+                if value >= 1 << 63:
+                    value -= 1 << 64
+                record = (_REC_CONST_INT, ty, value)
+            else:
+                parts = []
+                for _ in range(0, width, 64):
+                    part = value & 0xffffffffffffffff
+                    parts.append(part - (1 << 64) if part >= 1 << 63
+                                 else part)
+                    value >>= 64
+                record = (_REC_CONST_WIDE_INT, ty, len(parts)) + tuple(parts)
+        elif cls in _FLOAT_TYPES and isinstance(value, (int, float)):
+            value = _FLOAT_TYPES[cls][1](value)
+            bits = _double_bits.unpack(_double.pack(value))[0]
+            record = (_REC_CONST_FP, ty, bits)
+        elif cls is ir.ArrayType and isinstance(value, bytearray):
+            record = (_REC_CONST_STRING, ty, bytes(value))
+        elif (isinstance(value, (list, tuple)) and
+              isinstance(typ, (ir.ArrayType, ir.VectorType,
+                               ir.BaseStructType))):
+            elements = tuple(self.value(v) for v in value)
+            record = (_REC_CONST_AGGREGATE, ty, len(elements)) + elements
+        else:
+            raise _Unsupported(const)
+
+        try:
+            return self.constants[record]
+        except KeyError:
+            pass
+        if record[0] == _REC_CONST_STRING:
+            self.words.extend(record[:2])
+            self.string(record[2])
+        else:
+            self.words.extend(record)
+        index = self.constants[record] = self.push()
+        return index
+
+    def block(self, block):
+        return _lookup(self.blocks, id(block))
+
+    # Global values
+
+    def attributes(self, attrs, ints=()):
+        """
+        Return the words encoding the attribute set *attrs* and the integer
+        attributes named *ints*, which are left out if zero.
+        """
+        words = []
+        for name in attrs:
+            words.extend((_lookup(_ATTRIBUTES, name), 0))
+        for name in ints:
+            value = getattr(attrs, name)
+            if value:
+                words.extend((_ATTRIBUTES[name], value))
+        return [len(words) // 2] + words
+
+    def linkage(self, gv):
+        linkage = _lookup(_LINKAGES, gv.linkage or 'external')
+        storage_class = _lookup(_STORAGE_CLASSES, gv.storage_class)
+        return linkage, storage_class
+
+    def declare_variable(self, gv):
+        ty = self.type(gv.value_type)
+        words = self.words
+        words.append(_REC_GLOBAL_VARIABLE)
+        words.append(ty)
+        self.string(gv.name)
+        words.extend(self.linkage(gv))
+        words.extend((gv.global_constant, gv.unnamed_addr, gv.addrspace,
+                      _alignment(gv.align)))
+        self.globals[id(gv)] = self.push()
+
+    def define_variable(self, gv):
+        init = gv.initializer
+        if init is None:
+            if gv.linkage in ('', 'external', 'extern_weak'):
+                return
+            init = gv.value_type(ir.Undefined)
+        elif gv.linkage == 'external' or init.type != gv.value_type:
+            raise _Unsupported(init)
+        # Not through value(), as *init* may be a temporary
+        if type(init) is ir.Constant:
+            index = self.constant(init)
+        else:
+            index = self.value(init)
+        self.words.extend((_REC_INITIALIZER, self.globals[id(gv)], index))
+
+    def declare_function(self, fn):
+        attrs = fn.attributes
+        if fn.metadata or attrs.personality is not None:
+            raise _Unsupported(fn)
+        ty = self.type(fn.ftype)
+        words = self.words
+        words.append(_REC_FUNCTION)
+        words.append(ty)
+        self.string(fn.name)
+        words.extend(self.linkage(fn))
+        words.append(_calling_convention(fn.calling_convention))
+        words.extend(self.attributes(attrs, ('alignstack',)))
+        words.extend(self.attributes(fn.return_value.attributes,
+                                     _ARGUMENT_INT_ATTRIBUTES))
+        for arg in fn.args:
+            self.string(arg.name)
+            words.extend(self.attributes(arg.attributes,
+                                         _ARGUMENT_INT_ATTRIBUTES))
+        self.globals[id(fn)] = self.push()
+
+    def define_function(self, fn):
+        words = self.words
+        start = self.value_count
+        self.values = dict(self.globals)
+        self.constants = {}
+        self.function = fn
+        self.blocks = {id(block): i for i, block in enumerate(fn.blocks)}
+
+        words.extend((_REC_BODY, self.globals[id(fn)], len(fn.blocks)))
+        for block in fn.blocks:
+            self.string(block.name)
+        for arg in fn.args:
+            self.values[id(arg)] = self.push()
+        for i, block in enumerate(fn.blocks):
+            words.extend((_REC_BLOCK, i))
+            for instr in block.instructions:
+                if instr.metadata:
+                    raise _Unsupported("metadata")
+                _lookup(_INSTRUCTIONS, type(instr))(self, instr)
+        words.append(_REC_END)
+
+        self.value_count = start
+        self.values = self.globals
+        self.constants = {}
+        self.function = self.blocks = None
+
+    # Instructions
+    #
+    # The operands are encoded first, as they may need records of their
+    # own, then the instruction record, starting with the name of its value.
+
+    def define(self, instr, record):
+        words = self.words
+        words.append(record[0])
+        if isinstance(instr.type, ir.VoidType):
+            words.extend((0, 0))
+        else:
+            self.string(instr.name)
+        words.extend(record[1:])
+        index = self.push()
+        forward = self.values.get(id(instr))
+        if forward is not None:
+            words.extend((_REC_RESOLVE, forward))
+        else:
+            self.values[id(instr)] = index
+
+    def binop(self, instr):
+        opcode = _lookup(_BINARY_OPS, instr.opname)
+        lhs, rhs = instr.operands
+        self.define(instr, (_REC_BINOP, opcode, _flags(instr.flags),
+                            self.value(lhs), self.value(rhs)))
+
+    def icmp(self, instr):
+        if instr.flags:
+            raise _Unsupported(instr)
+        lhs, rhs = instr.operands
+        self.define(instr, (_REC_ICMP, _lookup(_ICMP_PREDICATES, instr.op),
+                            self.value(lhs), self.value(rhs)))
+
+    def fcmp(self, instr):
+        lhs, rhs = instr.operands
+        self.define(instr, (_REC_FCMP, _lookup(_FCMP_PREDICATES, instr.op),
+                            _flags(instr.flags),
+                            self.value(lhs), self.value(rhs)))
+
+    def cast(self, instr):
+        [value] = instr.operands
+        self.define(instr, (_REC_CAST, _lookup(_CAST_OPS, instr.opname),
+                            self.type(instr.type), self.value(value)))
+
+    def select(self, instr):
+        self.define(instr, (_REC_SELECT,) +
+                    tuple(self.value(op) for op in instr.operands))
+
+    def load(self, instr):
+        [ptr] = instr.operands
+        self.define(instr, (_REC_LOAD, self.value(ptr),
+                            _alignment(instr.align)))
+
+    def store(self, instr):
+        value, ptr = instr.operands
+        self.define(instr, (_REC_STORE, self.value(value), self.value(ptr),
+                            _alignment(instr.align)))
+
+    def alloca(self, instr):
+        ty = self.type(instr.type.pointee)
+        size = [self.value(op) for op in instr.operands]
+        self.define(instr, (_REC_ALLOCA, ty, len(size)) + tuple(size) +
+                    (_alignment(instr.align),))
+
+    def gep(self, instr):
+        ptr = self.value(instr.pointer)
+        indices = tuple(self.value(i) for i in instr.indices)
+        self.define(instr, (_REC_GEP, instr.inbounds, ptr, len(indices)) +
+                    indices)
+
+    def phi(self, instr):
+        incomings = []
+        for value, block in instr.incomings:
+            incomings += (self.value(value), self.block(block))
+        self.define(instr, (_REC_PHI, self.type(instr.type),
+                            len(instr.incomings)) + tuple(incomings))
+
+    def call(self, instr):
+        callee = instr.callee
+        fnty = self.type(callee.function_type)
+        callee = self.value(callee)
+        args = tuple(self.value(arg) for arg in instr.args)
+        flags = _flags(instr.fastmath)
+        if instr.tail:
+            flags |= _FLAG_TAIL
+        self.define(instr, (_REC_CALL, fnty, callee, flags,
+                            _calling_convention(instr.cconv)) +
+                    tuple(self.attributes(instr.attributes)) +
+                    (len(args),) + args)
+
+    def ret(self, instr):
+        value = tuple(self.value(op) for op in instr.operands)
+        self.define(instr, (_REC_RET, len(value)) + value)
+
+    def branch(self, instr):
+        # Also the class of resume instructions
+        if instr.opname != 'br':
+            raise _Unsupported(instr)
+        [target] = instr.operands
+        self.define(instr, (_REC_BR, self.block(target)))
+
+    def cbranch(self, instr):
+        cond, true, false = instr.operands
+        self.define(instr, (_REC_CONDBR, self.value(cond), self.block(true),
+                            self.block(false)))
+
+    def switch(self, instr):
+        value = self.value(instr.value)
+        cases = []
+        for case, block in instr.cases:
+            cases += (self.value(case), self.block(block))
+        self.define(instr, (_REC_SWITCH, value, self.block(instr.default),
+                            len(instr.cases)) + tuple(cases))
+
+    def unreachable(self, instr):
+        self.define(instr, (_REC_UNREACHABLE,))
+
+    def extract_value(self, instr):
+        self.define(instr, (_REC_EXTRACTVALUE, self.value(instr.aggregate),
+                            len(instr.indices)) + tuple(instr.indices))
+
+    def insert_value(self, instr):
+        self.define(instr, (_REC_INSERTVALUE, self.value(instr.aggregate),
+                            self.value(instr.value), len(instr.indices)) +
+                    tuple(instr.indices))
+
+    def vector_op(self, instr):
+        self.define(instr, (_VECTOR_OPS[type(instr)],) +
+                    tuple(self.value(op) for op in instr.operands))
+
+
+_ARGUMENT_INT_ATTRIBUTES = ('align', 'dereferenceable',
+                            'dereferenceable_or_null')
+
+_VECTOR_OPS = {
+    ir.instructions.ExtractElement: _REC_EXTRACTELEMENT,
+    ir.instructions.InsertElement: _REC_INSERTELEMENT,
+    ir.instructions.ShuffleVector: _REC_SHUFFLEVECTOR,
+}
+
+# The encoders of the supported instructions, by exact class
+_INSTRUCTIONS = {
+    ir.Instruction: _Encoder.binop,
+    ir.instructions.ICMPInstr: _Encoder.icmp,
+    ir.instructions.FCMPInstr: _Encoder.fcmp,
+    ir.instructions.CastInstr: _Encoder.cast,
+    ir.instructions.SelectInstr: _Encoder.select,
+    ir.instructions.LoadInstr: _Encoder.load,
+    ir.instructions.StoreInstr: _Encoder.store,
+    ir.instructions.AllocaInstr: _Encoder.alloca,
+    ir.instructions.GEPInstr: _Encoder.gep,
+    ir.instructions.PhiInstr: _Encoder.phi,
+    ir.instructions.CallInstr: _Encoder.call,
+    ir.instructions.Ret: _Encoder.ret,
+    ir.instructions.Branch: _Encoder.branch,
+    ir.instructions.ConditionalBranch: _Encoder.cbranch,
+    ir.instructions.SwitchInstr: _Encoder.switch,
+    ir.instructions.Unreachable: _Encoder.unreachable,
+    ir.instructions.ExtractValue: _Encoder.extract_value,
+    ir.instructions.InsertValue: _Encoder.insert_value,
+}
+_INSTRUCTIONS.update(dict.fromkeys(_VECTOR_OPS, _Encoder.vector_op))
+
+
+# ============================================================================
+# FFI
+
+ffi.lib.LLVMPY_BuildModuleFromStream.argtypes = [ffi.LLVMContextRef,
+                                                 c_void_p, c_size_t,
+                                                 c_char_p, c_size_t,
+                                                 POINTER(c_char_p)]
+ffi.lib.LLVMPY_BuildModuleFromStream.restype = ffi.LLVMModuleRef
@@ -1,12 +1,43 @@
-from ctypes import c_int, c_char_p, POINTER
+from ctypes import c_int, c_char_p, c_size_t, c_uint, POINTER
 from llvmlite.binding import ffi
 
 
-def link_modules(dst, src):
+# Flags of LLVMPY_LinkModulesBatch()
+_LINK_ONLY_NEEDED = 1
+_LINK_INTERNALIZE = 2
+
+
+def link_modules(dst, src, only_needed=False, internalize=False):
+    """
+    Link *src*, a module or a sequence of modules linked in order, into
+    *dst*.  The linked modules are destroyed, even if linking fails.
+
+    If *only_needed* is true, only the definitions *dst* refers to are
+    taken from each module.  If *internalize* is true, the definitions
+    taken are made internal to *dst*.
+    """
+    # The linker reads the parts of *src* it needs if it is loaded lazily,
+    # but expects *dst* to be complete.
+    dst.materialize_all()
+    if not (only_needed or internalize or isinstance(src, (list, tuple))):
+        with ffi.OutputString() as outerr:
+            err = ffi.lib.LLVMPY_LinkModules(dst, src, outerr)
+            # The underlying module was destroyed
+            src.detach()
+            if err:
+                raise RuntimeError(str(outerr))
+        return
+    srcs = ffi.ObjectRefArray(ffi.LLVMModuleRef,
+                              src if isinstance(src, (list, tuple))
+                              else [src])
+    flags = ((_LINK_ONLY_NEEDED if only_needed else 0) |
+             (_LINK_INTERNALIZE if internalize else 0))
     with ffi.OutputString() as outerr:
-        err = ffi.lib.LLVMPY_LinkModules(dst, src, outerr)
-        # The underlying module was destroyed
-        src.detach()
+        err = ffi.lib.LLVMPY_LinkModulesBatch(dst, srcs, len(srcs), flags,
+                                              outerr)
+        # The underlying modules were destroyed
+        for mod in srcs._objs:
+            mod.detach()
         if err:
             raise RuntimeError(str(outerr))
 
@@ -18,3 +49,13 @@ ffi.lib.LLVMPY_LinkModules.argtypes = [
 ]
 
 ffi.lib.LLVMPY_LinkModules.restype = c_int
+
+ffi.lib.LLVMPY_LinkModulesBatch.argtypes = [
+    ffi.LLVMModuleRef,
+    POINTER(ffi.LLVMModuleRef),
+    c_size_t,
+    c_uint,
+    POINTER(c_char_p),
+]
+
+ffi.lib.LLVMPY_LinkModulesBatch.restype = c_int
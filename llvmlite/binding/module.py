@@ -1,24 +1,32 @@
-from ctypes import (c_char_p, byref, POINTER, c_bool, create_string_buffer,
-                    c_size_t, string_at)
+from ctypes import (c_char, c_char_p, c_int, c_uint, c_void_p, POINTER,
+                    c_bool, cast, create_string_buffer, c_size_t, c_ssize_t,
+                    string_at, byref, pythonapi, CFUNCTYPE, py_object)
+import os
 
 from llvmlite.binding import ffi
 from llvmlite.binding.linker import link_modules
 from llvmlite.binding.common import _decode_string, _encode_string
 from llvmlite.binding.value import ValueRef, TypeRef
-from llvmlite.binding.context import get_global_context
+from llvmlite.binding.context import get_global_context, ContextRef
+from llvmlite.binding.snapshot import _snapshot
 
 
 def parse_assembly(llvmir, context=None):
     """
-    Create Module from a LLVM IR string
+    Create Module from LLVM IR, either a string or an object supporting the
+    buffer protocol such as bytes or a memoryview.  Strings, bytes and
+    bytearray objects, and views of their whole content, are parsed in
+    place.  Other buffers, e.g. mmaps, are copied once, as LLVM needs a NUL
+    character after the IR: use parse_assembly_file() to parse a file in
+    place.
     """
     if context is None:
         context = get_global_context()
-    llvmir = _encode_string(llvmir)
-    strbuf = c_char_p(llvmir)
+    ptr, size, nullterminated = _ir_buffer(llvmir)
     with ffi.OutputString() as errmsg:
         mod = ModuleRef(
-            ffi.lib.LLVMPY_ParseAssembly(context, strbuf, errmsg),
+            ffi.lib.LLVMPY_ParseAssembly(context, ptr, size, nullterminated,
+                                         errmsg),
             context)
         if errmsg:
             mod.close()
@@ -26,52 +34,264 @@ def parse_assembly(llvmir, context=None):
     return mod
 
 
-def parse_bitcode(bitcode, context=None):
+def parse_assembly_file(path, context=None):
+    """
+    Create Module from the LLVM IR file at *path*, which is mapped into
+    memory rather than read if large enough.
+    """
+    if context is None:
+        context = get_global_context()
+    with ffi.OutputString() as errmsg:
+        ptr = ffi.lib.LLVMPY_ParseAssemblyFile(
+            context, _encode_string(os.fspath(path)), errmsg)
+        if not ptr:
+            raise RuntimeError("LLVM IR parsing error\n{0}".format(errmsg))
+    return ModuleRef(ptr, context)
+
+
+def parse_assembly_batch(llvmirs, threads=0):
+    """
+    Create Modules from several LLVM IR strings or buffers, as
+    parse_assembly() does, parsing them in parallel on up to *threads*
+    native threads (one per CPU if 0).  Each module gets a context of its
+    own.  A list is returned with, for each IR, either its module or the
+    RuntimeError describing why it could not be parsed.
+    """
+    # The buffers point into the IR objects, keep them all alive until
+    # parsed, e.g. if they are produced by a generator
+    llvmirs = list(llvmirs)
+    buffers = [_ir_buffer(llvmir) for llvmir in llvmirs]
+    count = len(buffers)
+    ptrs = (c_void_p * count)(*[cast(ptr, c_void_p)
+                                for ptr, _, _ in buffers])
+    sizes = (c_size_t * count)(*[size for _, size, _ in buffers])
+    nullterminated = (c_int * count)(*[nt for _, _, nt in buffers])
+    contexts = (ffi.LLVMContextRef * count)()
+    modules = (ffi.LLVMModuleRef * count)()
+    errors = (c_void_p * count)()
+    ffi.lib.LLVMPY_ParseAssemblyBatch(ptrs, sizes, nullterminated, count,
+                                      threads, contexts, modules, errors)
+    results = []
+    for i in range(count):
+        if modules[i]:
+            results.append(ModuleRef(modules[i], ContextRef(contexts[i])))
+        else:
+            results.append(RuntimeError("LLVM IR parsing error\n{0}".format(
+                ffi.ret_string(errors[i]))))
+    return results
+
+
+def _ir_buffer(llvmir):
+    """
+    Return a pointer to the IR in *llvmir*, its size and whether it is
+    followed by a NUL character, which lets LLVM parse it in place.  The
+    pointer is valid as long as it and *llvmir* are alive and unchanged.
+    """
+    if isinstance(llvmir, str):
+        # The UTF-8 representation cached by the string itself, which
+        # is its actual data for ASCII strings
+        size = c_ssize_t()
+        ptr = _PyUnicode_AsUTF8AndSize(llvmir, byref(size))
+        return ptr, size.value, True
+    if isinstance(llvmir, bytes):
+        return c_char_p(llvmir), len(llvmir), True
+    view = memoryview(llvmir)
+    # bytes and bytearray objects are NUL-terminated, so are views of
+    # their whole content
+    nullterminated = (isinstance(view.obj, (bytes, bytearray)) and
+                      view.nbytes == len(view.obj))
+    try:
+        # Read-only or not, e.g. an mmap, without copying it
+        buf = ffi.BufferView(view)
+    except BufferError:
+        raise ValueError("the IR buffer must be contiguous")
+    return buf, len(buf), nullterminated
+
+
+_PyUnicode_AsUTF8AndSize = pythonapi.PyUnicode_AsUTF8AndSize
+_PyUnicode_AsUTF8AndSize.argtypes = [py_object, POINTER(c_ssize_t)]
+_PyUnicode_AsUTF8AndSize.restype = c_void_p
+
+
+def parse_bitcode(bitcode, context=None, lazy=False):
     """
     Create Module from a LLVM *bitcode* (a bytes object).
+
+    If *lazy* is true, the bodies of the functions are only read when
+    materialized, see ModuleRef.materialize_all() and ValueRef.materialize().
+    The module then refers to *bitcode* until fully materialized.
     """
     if context is None:
         context = get_global_context()
     buf = c_char_p(bitcode)
     bufsize = len(bitcode)
     with ffi.OutputString() as errmsg:
-        mod = ModuleRef(ffi.lib.LLVMPY_ParseBitcode(
-            context, buf, bufsize, errmsg), context)
+        if lazy:
+            ptr = ffi.lib.LLVMPY_ParseLazyBitcode(context, buf, bufsize,
+                                                  errmsg)
+        else:
+            ptr = ffi.lib.LLVMPY_ParseBitcode(context, buf, bufsize, errmsg)
         if errmsg:
-            mod.close()
+            if ptr:
+                ModuleRef(ptr, context).close()
+            raise RuntimeError(
+                "LLVM bitcode parsing error\n{0}".format(errmsg))
+    mod = ModuleRef(ptr, context)
+    if lazy:
+        mod._materializable = True
+        mod._bitcode = bitcode
+    return mod
+
+
+def parse_bitcode_file(path, context=None, lazy=False):
+    """
+    Create Module from the LLVM bitcode file at *path*, which is mapped
+    into memory rather than read if large enough.
+
+    If *lazy* is true, the bodies of the functions are only read when
+    materialized, as with parse_bitcode().
+    """
+    if context is None:
+        context = get_global_context()
+    with ffi.OutputString() as errmsg:
+        ptr = ffi.lib.LLVMPY_ParseBitcodeFile(
+            context, _encode_string(os.fspath(path)), lazy, errmsg)
+        if not ptr:
             raise RuntimeError(
                 "LLVM bitcode parsing error\n{0}".format(errmsg))
+    mod = ModuleRef(ptr, context)
+    mod._materializable = lazy
     return mod
 
 
+def parse_bitcode_modules(bitcode, context=None):
+    """
+    Create Modules from a LLVM *bitcode* file (a bytes object) containing
+    one or several modules, such as written by write_bitcode().
+    """
+    if context is None:
+        context = get_global_context()
+    buf = c_char_p(bitcode)
+    bufsize = len(bitcode)
+    with ffi.OutputString() as errmsg:
+        count = ffi.lib.LLVMPY_GetBitcodeModuleCount(buf, bufsize, errmsg)
+        if count >= 0:
+            ptrs = (ffi.LLVMModuleRef * count)()
+            ffi.lib.LLVMPY_ParseBitcodeModules(context, buf, bufsize, ptrs,
+                                               errmsg)
+        if errmsg:
+            raise RuntimeError(
+                "LLVM bitcode parsing error\n{0}".format(errmsg))
+    return [ModuleRef(ptr, context) for ptr in ptrs]
+
+
+def write_bitcode(modules, out=None):
+    """
+    Write the bitcode of one or several *modules* as a single bitcode file.
+    Several modules can be read back with parse_bitcode_modules().
+
+    *out* can be:
+    - None, to return the bitcode as a bytes object;
+    - a file descriptor, to which LLVM writes directly;
+    - a bytearray, which the bitcode is appended to;
+    - an object with a write() method, such as a file, which is passed
+      memoryviews of LLVM's buffer, valid only during the call.
+    """
+    modules = ffi.ObjectRefArray(ffi.LLVMModuleRef, modules)
+    if not modules:
+        raise ValueError("no modules to write")
+    for mod in modules._objs:
+        mod.materialize_all()
+    if isinstance(out, int):
+        fd, sink = out, None
+    else:
+        fd, sink = -1, _BitcodeSink(out)
+    with ffi.OutputString() as outerr:
+        if ffi.lib.LLVMPY_WriteBitcode(modules, len(modules), fd,
+                                       _write_c_hook, sink, outerr):
+            raise OSError(str(outerr))
+    if sink is not None:
+        if sink.error is not None:
+            raise sink.error
+        if out is None:
+            return b"".join(sink.chunks)
+
+
+class _BitcodeSink(object):
+    """
+    Internal: the destination of bitcode written through a callback.
+    """
+
+    def __init__(self, out):
+        self.out = out
+        self.chunks = []
+        self.error = None
+
+    def write(self, ptr, size):
+        if self.error is not None or not size:
+            return
+        try:
+            if self.out is None:
+                self.chunks.append(string_at(ptr, size))
+            else:
+                data = memoryview((c_char * size).from_address(ptr)).cast('B')
+                if isinstance(self.out, bytearray):
+                    self.out += data
+                else:
+                    self.out.write(data)
+        except BaseException as e:
+            # Exceptions can't propagate through LLVM, raise it afterwards
+            self.error = e
+
+
 class ModuleRef(ffi.ObjectRef):
     """
     A reference to a LLVM module.
     """
 
+    # Whether the module was loaded lazily and not fully materialized yet
+    _materializable = False
+
     def __init__(self, module_ptr, context):
         super(ModuleRef, self).__init__(module_ptr)
         self._context = context
 
+    @property
+    def _ffi_locks(self):
+        # A module is guarded by the lock of its context
+        return self._context._ffi_locks
+
     def __str__(self):
         with ffi.OutputString() as outstr:
             ffi.lib.LLVMPY_PrintModuleToString(self, outstr)
             return str(outstr)
 
+    def materialize_all(self):
+        """
+        Materialize all the functions of a module loaded lazily.  This is
+        done implicitly by operations on the whole module, such as running
+        a module pass manager, code generation, cloning and verification.
+        """
+        if not self._materializable:
+            return
+        with ffi.OutputString() as outerr:
+            if ffi.lib.LLVMPY_MaterializeAll(self, outerr):
+                raise RuntimeError(str(outerr))
+        self._materializable = False
+        # The bitcode is not used anymore
+        self._bitcode = None
+
     def as_bitcode(self):
         """
         Return the module's LLVM bitcode, as a bytes object.
         """
-        ptr = c_char_p(None)
-        size = c_size_t(-1)
-        ffi.lib.LLVMPY_WriteBitcodeToString(self, byref(ptr), byref(size))
-        if not ptr:
-            raise MemoryError
-        try:
-            assert size.value >= 0
-            return string_at(ptr, size.value)
-        finally:
-            ffi.lib.LLVMPY_DisposeString(ptr)
+        return write_bitcode([self])
+
+    def write_bitcode(self, out):
+        """
+        Write the module's LLVM bitcode to *out*, as write_bitcode() does.
+        """
+        write_bitcode([self], out)
 
     def _dispose(self):
         self._capi.LLVMPY_DisposeModule(self)
@@ -104,12 +324,13 @@ class ModuleRef(ffi.ObjectRef):
         p = ffi.lib.LLVMPY_GetNamedStructType(self, _encode_string(name))
         if not p:
             raise NameError(name)
-        return TypeRef(p)
+        return TypeRef(p, dict(module=self))
 
     def verify(self):
         """
         Verify the module IR's correctness.  RuntimeError is raised on error.
         """
+        self.materialize_all()
         with ffi.OutputString() as outmsg:
             if ffi.lib.LLVMPY_VerifyModule(self, outmsg):
                 raise RuntimeError(str(outmsg))
@@ -157,14 +378,23 @@ class ModuleRef(ffi.ObjectRef):
                                  create_string_buffer(
                                      strrep.encode('utf8')))
 
-    def link_in(self, other, preserve=False):
+    def link_in(self, other, preserve=False, only_needed=False,
+                internalize=False):
         """
-        Link the *other* module into this one.  The *other* module will
-        be destroyed unless *preserve* is true.
+        Link the *other* module, or list of modules linked in order, into
+        this one.  The *other* modules will be destroyed unless *preserve*
+        is true.
+
+        If *only_needed* is true, only the definitions this module refers
+        to are linked in.  If *internalize* is true, the definitions linked
+        in are made internal to this module.
         """
-        if preserve:
+        if isinstance(other, (list, tuple)):
+            if preserve:
+                other = [mod.clone() for mod in other]
+        elif preserve:
             other = other.clone()
-        link_modules(self, other)
+        link_modules(self, other, only_needed, internalize)
 
     @property
     def global_variables(self):
@@ -197,8 +427,31 @@ class ModuleRef(ffi.ObjectRef):
         it = ffi.lib.LLVMPY_ModuleTypesIter(self)
         return _TypesIterator(it, dict(module=self))
 
-    def clone(self):
-        return ModuleRef(ffi.lib.LLVMPY_CloneModule(self), self._context)
+    def snapshot(self):
+        """
+        Return an IRSnapshot of all the functions of this module, read in
+        a single call.
+        """
+        self.materialize_all()
+        return _snapshot(ffi.lib.LLVMPY_SnapshotModule(self))
+
+    def clone(self, keep=None):
+        """
+        Return a copy of this module.  If *keep* is given, only the
+        definitions of the functions and global variables named in *keep*
+        are copied: the other globals are turned into declarations, and
+        only the kept functions of a module loaded lazily are materialized.
+        """
+        if keep is None:
+            self.materialize_all()
+            return ModuleRef(ffi.lib.LLVMPY_CloneModule(self), self._context)
+        names = [_encode_string(name) for name in keep]
+        with ffi.OutputString() as outerr:
+            ptr = ffi.lib.LLVMPY_CloneModuleSubset(
+                self, (c_char_p * len(names))(*names), len(names), outerr)
+            if not ptr:
+                raise RuntimeError(str(outerr))
+        return ModuleRef(ptr, self._context)
 
 
 class _Iterator(ffi.ObjectRef):
@@ -210,6 +463,10 @@ class _Iterator(ffi.ObjectRef):
         self._parents = parents
         assert self.kind is not None
 
+    @property
+    def _ffi_locks(self):
+        return self._parents['module']._ffi_locks
+
     def __next__(self):
         vp = self._next()
         if vp:
@@ -255,7 +512,7 @@ class _TypesIterator(_Iterator):
     def __next__(self):
         vp = self._next()
         if vp:
-            return TypeRef(vp)
+            return TypeRef(vp, self._parents)
         else:
             raise StopIteration
 
@@ -269,22 +526,68 @@ class _TypesIterator(_Iterator):
 # Set function FFI
 
 ffi.lib.LLVMPY_ParseAssembly.argtypes = [ffi.LLVMContextRef,
-                                         c_char_p,
+                                         c_void_p, c_size_t, c_int,
                                          POINTER(c_char_p)]
 ffi.lib.LLVMPY_ParseAssembly.restype = ffi.LLVMModuleRef
 
+ffi.lib.LLVMPY_ParseAssemblyBatch.argtypes = [POINTER(c_void_p),
+                                              POINTER(c_size_t),
+                                              POINTER(c_int),
+                                              c_size_t, c_uint,
+                                              POINTER(ffi.LLVMContextRef),
+                                              POINTER(ffi.LLVMModuleRef),
+                                              POINTER(c_void_p)]
+# Each IR is parsed into a new context
+ffi.lib.LLVMPY_ParseAssemblyBatch.mark_threadsafe()
+
+ffi.lib.LLVMPY_ParseAssemblyFile.argtypes = [ffi.LLVMContextRef,
+                                             c_char_p,
+                                             POINTER(c_char_p)]
+ffi.lib.LLVMPY_ParseAssemblyFile.restype = ffi.LLVMModuleRef
+
 ffi.lib.LLVMPY_ParseBitcode.argtypes = [ffi.LLVMContextRef,
                                         c_char_p, c_size_t,
                                         POINTER(c_char_p)]
 ffi.lib.LLVMPY_ParseBitcode.restype = ffi.LLVMModuleRef
 
+ffi.lib.LLVMPY_ParseLazyBitcode.argtypes = [ffi.LLVMContextRef,
+                                            c_char_p, c_size_t,
+                                            POINTER(c_char_p)]
+ffi.lib.LLVMPY_ParseLazyBitcode.restype = ffi.LLVMModuleRef
+
+ffi.lib.LLVMPY_ParseBitcodeFile.argtypes = [ffi.LLVMContextRef, c_char_p,
+                                            c_int, POINTER(c_char_p)]
+ffi.lib.LLVMPY_ParseBitcodeFile.restype = ffi.LLVMModuleRef
+
+ffi.lib.LLVMPY_MaterializeAll.argtypes = [ffi.LLVMModuleRef,
+                                          POINTER(c_char_p)]
+ffi.lib.LLVMPY_MaterializeAll.restype = c_int
+
 ffi.lib.LLVMPY_DisposeModule.argtypes = [ffi.LLVMModuleRef]
 
 ffi.lib.LLVMPY_PrintModuleToString.argtypes = [ffi.LLVMModuleRef,
                                                POINTER(c_char_p)]
-ffi.lib.LLVMPY_WriteBitcodeToString.argtypes = [ffi.LLVMModuleRef,
-                                                POINTER(c_char_p),
-                                                POINTER(c_size_t)]
+
+_BitcodeWriteFunc = CFUNCTYPE(None, py_object, c_void_p, c_size_t)
+
+# The ctypes function wrappers are created at the top-level, as in
+# executionengine.py.
+_write_c_hook = _BitcodeWriteFunc(_BitcodeSink.write)
+
+ffi.lib.LLVMPY_WriteBitcode.argtypes = [POINTER(ffi.LLVMModuleRef), c_size_t,
+                                        c_int, _BitcodeWriteFunc, py_object,
+                                        POINTER(c_char_p)]
+ffi.lib.LLVMPY_WriteBitcode.restype = c_int
+
+ffi.lib.LLVMPY_GetBitcodeModuleCount.argtypes = [c_char_p, c_size_t,
+                                                 POINTER(c_char_p)]
+ffi.lib.LLVMPY_GetBitcodeModuleCount.restype = c_int
+
+ffi.lib.LLVMPY_ParseBitcodeModules.argtypes = [ffi.LLVMContextRef,
+                                               c_char_p, c_size_t,
+                                               POINTER(ffi.LLVMModuleRef),
+                                               POINTER(c_char_p)]
+ffi.lib.LLVMPY_ParseBitcodeModules.restype = c_int
 
 ffi.lib.LLVMPY_GetNamedFunction.argtypes = [ffi.LLVMModuleRef,
                                             c_char_p]
@@ -333,6 +636,11 @@ ffi.lib.LLVMPY_TypesIterNext.restype = ffi.LLVMTypeRef
 ffi.lib.LLVMPY_CloneModule.argtypes = [ffi.LLVMModuleRef]
 ffi.lib.LLVMPY_CloneModule.restype = ffi.LLVMModuleRef
 
+ffi.lib.LLVMPY_CloneModuleSubset.argtypes = [ffi.LLVMModuleRef,
+                                             POINTER(c_char_p), c_size_t,
+                                             POINTER(c_char_p)]
+ffi.lib.LLVMPY_CloneModuleSubset.restype = ffi.LLVMModuleRef
+
 ffi.lib.LLVMPY_GetModuleName.argtypes = [ffi.LLVMModuleRef]
 ffi.lib.LLVMPY_GetModuleName.restype = c_char_p
 
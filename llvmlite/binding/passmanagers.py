@@ -1,10 +1,14 @@
-from ctypes import c_bool, c_int, c_size_t, Structure, byref
+from ctypes import (c_bool, c_char_p, c_double, c_int, c_size_t, c_void_p,
+                    Structure, byref, POINTER)
 from collections import namedtuple
 from enum import IntFlag
 from llvmlite.binding import ffi
+from llvmlite.binding.common import _encode_string, _name_list
 
 _prunestats = namedtuple('PruneStats',
-                         ('basicblock diamond fanout fanout_raise'))
+                         ('basicblock diamond fanout fanout_raise hoisted'))
+# The hoisted field was added later, keep it optional
+_prunestats.__new__.__defaults__ = (0,)
 
 
 class PruneStats(_prunestats):
@@ -18,7 +22,8 @@ class PruneStats(_prunestats):
         return PruneStats(self.basicblock + other.basicblock,
                           self.diamond + other.diamond,
                           self.fanout + other.fanout,
-                          self.fanout_raise + other.fanout_raise)
+                          self.fanout_raise + other.fanout_raise,
+                          self.hoisted + other.hoisted)
 
     def __sub__(self, other):
         if not isinstance(other, PruneStats):
@@ -28,7 +33,8 @@ class PruneStats(_prunestats):
         return PruneStats(self.basicblock - other.basicblock,
                           self.diamond - other.diamond,
                           self.fanout - other.fanout,
-                          self.fanout_raise - other.fanout_raise)
+                          self.fanout_raise - other.fanout_raise,
+                          self.hoisted - other.hoisted)
 
 
 class _c_PruneStats(Structure):
@@ -36,29 +42,60 @@ class _c_PruneStats(Structure):
         ('basicblock', c_size_t),
         ('diamond', c_size_t),
         ('fanout', c_size_t),
-        ('fanout_raise', c_size_t)]
+        ('fanout_raise', c_size_t),
+        ('hoisted', c_size_t)]
+
+    def to_stats(self):
+        return PruneStats(self.basicblock, self.diamond, self.fanout,
+                          self.fanout_raise, self.hoisted)
+
+
+# The number of subpasses statistics are kept for
+_N_PRUNE_STATS = len(_c_PruneStats._fields_)
+
+
+FunctionPruneStats = namedtuple('FunctionPruneStats',
+                                ['runs', 'pruned', 'times'])
 
 
 def dump_refprune_stats(printout=False):
     """ Returns a namedtuple containing the current values for the refop pruning
-    statistics. If kwarg `printout` is True the stats are printed to stderr,
-    default is False.
+    statistics, summed over all the pass managers of the process. If kwarg
+    `printout` is True the stats are printed to stderr, default is False.
     """
 
-    stats = _c_PruneStats(0, 0, 0, 0)
+    stats = _c_PruneStats()
     do_print = c_bool(printout)
 
     ffi.lib.LLVMPY_DumpRefPruneStats(byref(stats), do_print)
-    return PruneStats(stats.basicblock, stats.diamond, stats.fanout,
-                      stats.fanout_raise)
+    return stats.to_stats()
+
 
+def create_module_pass_manager(timing=False):
+    return ModulePassManager(timing=timing)
 
-def create_module_pass_manager():
-    return ModulePassManager()
 
+def create_function_pass_manager(module, timing=False):
+    return FunctionPassManager(module, timing=timing)
 
-def create_function_pass_manager(module):
-    return FunctionPassManager(module)
+
+def create_pipeline(pipeline, target_machine=None):
+    """
+    Create a new pass manager pipeline from its textual description, such as
+    ``"default<O3>"`` or ``"function(sroa,instcombine)"``, using the syntax
+    of ``opt -passes``.  If *target_machine* is given, the passes use its
+    target-specific cost models.
+    """
+    with ffi.OutputString() as outerr:
+        ptr = ffi.lib.LLVMPY_CreatePipeline(_encode_string(pipeline),
+                                            target_machine, outerr)
+        if not ptr:
+            raise ValueError(str(outerr))
+    return Pipeline(ptr, pipeline, target_machine)
+
+
+PassTiming = namedtuple('PassTiming',
+                        ('name count wall_time user_time system_time'))
 
 
 class RefPruneSubpasses(IntFlag):
@@ -66,16 +103,94 @@ class RefPruneSubpasses(IntFlag):
     DIAMOND      = 0b0010    # noqa: E221
     FANOUT       = 0b0100    # noqa: E221
     FANOUT_RAISE = 0b1000
+    LOOP_HOIST   = 0b10000   # noqa: E221
+    # Loop hoisting is opt-in, it is not part of ALL
     ALL = PER_BB | DIAMOND | FANOUT | FANOUT_RAISE
 
 
+class _RefPruneStatsRef(ffi.ObjectRef):
+    """
+    Internal: the refprune statistics of a pass manager, shared with its
+    refprune passes.
+    """
+
+    def __init__(self):
+        ffi.ObjectRef.__init__(self, ffi.lib.LLVMPY_CreateRefPruneStats())
+
+    def get_stats(self):
+        stats = _c_PruneStats()
+        ffi.lib.LLVMPY_GetRefPruneStats(self, byref(stats))
+        return stats.to_stats()
+
+    def get_function_stats(self):
+        n = ffi.lib.LLVMPY_GetRefPruneFunctionStats(self, 0, None, None,
+                                                    None, None)
+        names = (c_void_p * n)()
+        runs = (c_size_t * n)()
+        pruned = (_c_PruneStats * n)()
+        times = (c_double * (_N_PRUNE_STATS * n))()
+        # Functions pruned in the meantime are left out
+        n = min(n, ffi.lib.LLVMPY_GetRefPruneFunctionStats(self, n, names,
+                                                           runs, pruned,
+                                                           times))
+        result = {}
+        for i in range(n):
+            with ffi.OutputString.from_return(names[i]) as name:
+                start = _N_PRUNE_STATS * i
+                result[str(name)] = FunctionPruneStats(
+                    runs[i], pruned[i].to_stats(),
+                    PruneStats(*times[start:start + _N_PRUNE_STATS]))
+        return result
+
+    def _dispose(self):
+        self._capi.LLVMPY_DisposeRefPruneStats(self)
+
+
 class PassManager(ffi.ObjectRef):
     """PassManager
     """
 
+    _timing = False
+    _refprune_stats = None
+
     def _dispose(self):
         self._capi.LLVMPY_DisposePassManager(self)
 
+    def get_timings(self):
+        """
+        Return the time spent in each pass by the runs of this pass manager,
+        which must have been created with timing enabled, as a list of
+        PassTiming tuples sorted by decreasing wall time.  *count* is the
+        number of times the pass ran (e.g. once per function for a function
+        pass) and the times, in seconds, are the totals over those runs.
+        """
+        if not self._timing:
+            raise RuntimeError("pass manager was created without timing")
+        is_fpm = isinstance(self, FunctionPassManager)
+        n = ffi.lib.LLVMPY_GetPassTimings(self, is_fpm, 0, None, None, None,
+                                          None, None)
+        names = (c_void_p * n)()
+        counts = (c_size_t * n)()
+        walls, users, systems = [(c_double * n)() for _ in range(3)]
+        ffi.lib.LLVMPY_GetPassTimings(self, is_fpm, n, names, counts, walls,
+                                      users, systems)
+        timings = []
+        for i in range(n):
+            with ffi.OutputString.from_return(names[i]) as name:
+                timings.append(PassTiming(str(name), counts[i], walls[i],
+                                          users[i], systems[i]))
+        timings.sort(key=lambda t: t.wall_time, reverse=True)
+        return timings
+
+    def reset_timings(self):
+        """
+        Discard the pass timings recorded so far.
+        """
+        if not self._timing:
+            raise RuntimeError("pass manager was created without timing")
+        ffi.lib.LLVMPY_ResetPassTimings(self,
+                                        isinstance(self, FunctionPassManager))
+
     def add_constant_merge_pass(self):
         """See http://llvm.org/docs/Passes.html#constmerge-merge-duplicate-global-constants."""  # noqa E501
         ffi.lib.LLVMPY_AddConstantMergePass(self)
@@ -143,40 +258,91 @@ class PassManager(ffi.ObjectRef):
 
     # Non-standard LLVM passes
 
-    def add_refprune_pass(self, subpasses_flags=RefPruneSubpasses.ALL):
+    def add_refprune_pass(self, subpasses_flags=RefPruneSubpasses.ALL,
+                          incref_names=None, decref_names=None):
         """Add Numba specific Reference count pruning pass.
 
         Parameters
         ----------
         subpasses_flags : RefPruneSubpasses
             A bitmask to control the subpasses to be enabled.
+        incref_names, decref_names : str or sequence of str
+            The names of the functions incrementing and decrementing the
+            reference count of the pointer passed as their first argument.
+            Defaults to the functions of Numba's runtime, NRT_incref and
+            NRT_decref.
         """
         iflags = RefPruneSubpasses(subpasses_flags)
-        ffi.lib.LLVMPY_AddRefPrunePass(self, iflags)
+        if self._refprune_stats is None:
+            self._refprune_stats = _RefPruneStatsRef()
+        incref_names = _name_list(incref_names)
+        decref_names = _name_list(decref_names)
+        increfs, decrefs = [
+            None if names is None else
+            (c_char_p * len(names))(*map(_encode_string, names))
+            for names in (incref_names, decref_names)]
+        ffi.lib.LLVMPY_AddRefPrunePass(self, iflags, self._refprune_stats,
+                                       increfs, len(incref_names or ()),
+                                       decrefs, len(decref_names or ()))
+
+    def get_refprune_stats(self):
+        """
+        Return a PruneStats of the refops pruned by the refprune passes of
+        this pass manager.
+        """
+        if self._refprune_stats is None:
+            return PruneStats(0, 0, 0, 0, 0)
+        return self._refprune_stats.get_stats()
+
+    def get_refprune_function_stats(self):
+        """
+        Return a dict mapping the names of the functions run through the
+        refprune passes of this pass manager to FunctionPruneStats tuples:
+        *runs* is the number of times the functions of that name were
+        pruned, *pruned* a PruneStats of the refops pruned and *times* a
+        PruneStats of the seconds spent in each subpass.
+        """
+        if self._refprune_stats is None:
+            return {}
+        return self._refprune_stats.get_function_stats()
 
 
 class ModulePassManager(PassManager):
 
-    def __init__(self, ptr=None):
+    def __init__(self, ptr=None, timing=False):
         if ptr is None:
-            ptr = ffi.lib.LLVMPY_CreatePassManager()
+            if timing:
+                ptr = ffi.lib.LLVMPY_CreateTimedPassManager()
+            else:
+                ptr = ffi.lib.LLVMPY_CreatePassManager()
+            self._timing = timing
         PassManager.__init__(self, ptr)
 
     def run(self, module):
         """
         Run optimization passes on the given module.
         """
+        module.materialize_all()
         return ffi.lib.LLVMPY_RunPassManager(self, module)
 
 
 class FunctionPassManager(PassManager):
 
-    def __init__(self, module):
-        ptr = ffi.lib.LLVMPY_CreateFunctionPassManager(module)
+    def __init__(self, module, timing=False):
+        if timing:
+            ptr = ffi.lib.LLVMPY_CreateTimedFunctionPassManager(module)
+        else:
+            ptr = ffi.lib.LLVMPY_CreateFunctionPassManager(module)
+        self._timing = timing
         self._module = module
         module._owned = True
         PassManager.__init__(self, ptr)
 
+    @property
+    def _ffi_locks(self):
+        # The pass manager owns the module, share the lock of its context
+        return self._module._ffi_locks
+
     def initialize(self):
         """
         Initialize the FunctionPassManager.  Returns True if it produced
@@ -195,9 +361,36 @@ class FunctionPassManager(PassManager):
         """
         Run optimization passes on the given function.
         """
+        function._materialize_if_lazy()
         return ffi.lib.LLVMPY_RunFunctionPassManager(self, function)
 
 
+class Pipeline(ffi.ObjectRef):
+    """A module pipeline of the new pass manager.
+    """
+
+    def __init__(self, ptr, pipeline, target_machine):
+        # The passes refer to the target machine
+        self._target_machine = target_machine
+        self._pipeline = pipeline
+        ffi.ObjectRef.__init__(self, ptr)
+
+    def __str__(self):
+        return self._pipeline
+
+    def run(self, module):
+        """
+        Run the pipeline on the given module.  Analysis results are shared
+        between the passes and the functions of the module for the duration
+        of the run.  Returns True if the module was modified.
+        """
+        module.materialize_all()
+        return ffi.lib.LLVMPY_RunPipeline(self, module)
+
+    def _dispose(self):
+        self._capi.LLVMPY_DisposePipeline(self)
+
+
 # ============================================================================
 # FFI
 
@@ -206,8 +399,24 @@ ffi.lib.LLVMPY_CreatePassManager.restype = ffi.LLVMPassManagerRef
 ffi.lib.LLVMPY_CreateFunctionPassManager.argtypes = [ffi.LLVMModuleRef]
 ffi.lib.LLVMPY_CreateFunctionPassManager.restype = ffi.LLVMPassManagerRef
 
+ffi.lib.LLVMPY_CreateTimedPassManager.restype = ffi.LLVMPassManagerRef
+
+ffi.lib.LLVMPY_CreateTimedFunctionPassManager.argtypes = [ffi.LLVMModuleRef]
+ffi.lib.LLVMPY_CreateTimedFunctionPassManager.restype = \
+    ffi.LLVMPassManagerRef
+
 ffi.lib.LLVMPY_DisposePassManager.argtypes = [ffi.LLVMPassManagerRef]
 
+ffi.lib.LLVMPY_GetPassTimings.argtypes = [ffi.LLVMPassManagerRef, c_bool,
+                                          c_size_t, POINTER(c_void_p),
+                                          POINTER(c_size_t),
+                                          POINTER(c_double),
+                                          POINTER(c_double),
+                                          POINTER(c_double)]
+ffi.lib.LLVMPY_GetPassTimings.restype = c_size_t
+
+ffi.lib.LLVMPY_ResetPassTimings.argtypes = [ffi.LLVMPassManagerRef, c_bool]
+
 ffi.lib.LLVMPY_RunPassManager.argtypes = [ffi.LLVMPassManagerRef,
                                           ffi.LLVMModuleRef]
 ffi.lib.LLVMPY_RunPassManager.restype = c_bool
@@ -241,4 +450,42 @@ ffi.lib.LLVMPY_AddSROAPass.argtypes = [ffi.LLVMPassManagerRef]
 ffi.lib.LLVMPY_AddTypeBasedAliasAnalysisPass.argtypes = [ffi.LLVMPassManagerRef]
 ffi.lib.LLVMPY_AddBasicAliasAnalysisPass.argtypes = [ffi.LLVMPassManagerRef]
 
-ffi.lib.LLVMPY_AddRefPrunePass.argtypes = [ffi.LLVMPassManagerRef, c_int]
+ffi.lib.LLVMPY_AddRefPrunePass.argtypes = [ffi.LLVMPassManagerRef, c_int,
+                                           ffi.LLVMRefPruneStatsRef,
+                                           POINTER(c_char_p), c_size_t,
+                                           POINTER(c_char_p), c_size_t]
+# Registers the pass with the global PassRegistry
+ffi.lib.LLVMPY_AddRefPrunePass.mark_global()
+
+ffi.lib.LLVMPY_CreateRefPruneStats.restype = ffi.LLVMRefPruneStatsRef
+
+ffi.lib.LLVMPY_DisposeRefPruneStats.argtypes = [ffi.LLVMRefPruneStatsRef]
+
+ffi.lib.LLVMPY_GetRefPruneStats.argtypes = [ffi.LLVMRefPruneStatsRef,
+                                            POINTER(_c_PruneStats)]
+
+ffi.lib.LLVMPY_GetRefPruneFunctionStats.argtypes = [
+    ffi.LLVMRefPruneStatsRef,
+    c_size_t,
+    POINTER(c_void_p),
+    POINTER(c_size_t),
+    POINTER(_c_PruneStats),
+    POINTER(c_double),
+]
+ffi.lib.LLVMPY_GetRefPruneFunctionStats.restype = c_size_t
+
+# The statistics are updated atomically and under their own lock
+for _func in (ffi.lib.LLVMPY_DisposeRefPruneStats,
+              ffi.lib.LLVMPY_GetRefPruneStats,
+              ffi.lib.LLVMPY_GetRefPruneFunctionStats):
+    _func.mark_threadsafe()
+
+ffi.lib.LLVMPY_CreatePipeline.argtypes = [c_char_p,
+                                          ffi.LLVMTargetMachineRef,
+                                          POINTER(c_char_p)]
+ffi.lib.LLVMPY_CreatePipeline.restype = ffi.LLVMPipelineRef
+
+ffi.lib.LLVMPY_DisposePipeline.argtypes = [ffi.LLVMPipelineRef]
+
+ffi.lib.LLVMPY_RunPipeline.argtypes = [ffi.LLVMPipelineRef, ffi.LLVMModuleRef]
+ffi.lib.LLVMPY_RunPipeline.restype = c_bool
@@ -0,0 +1,126 @@
+from array import array
+from ctypes import POINTER, c_size_t, c_uint, c_void_p, byref, string_at
+import enum
+
+from llvmlite.binding import ffi
+
+
+class OperandKind(enum.IntEnum):
+    """
+    What the values of the operands of an IRSnapshot refer to.
+    """
+    # The OperandKind enum from ffi/snapshot.cpp
+
+    instruction = 0     # an instruction number
+    argument = 1        # an argument number
+    block = 2           # a block number
+    global_value = 3    # the string of the name of a global
+    constant = 4        # the string of the constant, with its type
+    other = 5           # the string of the value, such as metadata
+
+
+# The SnapshotArray enum from ffi/snapshot.cpp
+_ARRAYS = (
+    'function_names',
+    'function_types',
+    'function_arguments',
+    'function_blocks',
+    'argument_names',
+    'argument_types',
+    'block_names',
+    'block_instructions',
+    'instruction_blocks',
+    'instruction_opcodes',
+    'instruction_names',
+    'instruction_types',
+    'instruction_operands',
+    'operand_kinds',
+    'operand_values',
+    'operand_types',
+    'type_names',
+    '_string_offsets',
+)
+
+
+class IRSnapshot(object):
+    """
+    A snapshot of the IR of one or several functions as flat arrays of
+    integers, read in a single call.  It doesn't refer to LLVM objects,
+    and is left unchanged if the IR changes.
+
+    Functions, arguments, blocks, instructions and operands are numbered
+    in order across the snapshot.  The arrays named after them give, for
+    each of them:
+
+    - *_names, *_opcodes: the index of a string in `strings`.
+    - *_types: the index of a type, whose text is the string indexed by
+      `type_names`.
+    - function_arguments, function_blocks, block_instructions and
+      instruction_operands: offsets of the first child of each parent
+      in the children arrays, with a last entry for the end of the last
+      parent.
+    - instruction_blocks: the number of the block of the instruction.
+    - operand_kinds and operand_values: an OperandKind, and the number of
+      the value or the index of a string depending on that kind.
+    """
+
+    def __init__(self, ptr):
+        size = c_size_t()
+        for which, name in enumerate(_ARRAYS):
+            data = ffi.lib.LLVMPY_GetSnapshotArray(ptr, which, byref(size))
+            values = array('i')
+            values.frombytes(string_at(data, 4 * size.value))
+            setattr(self, name, values)
+        data = ffi.lib.LLVMPY_GetSnapshotStrings(ptr, byref(size))
+        blob = string_at(data, size.value)
+        offsets = self._string_offsets
+        self.strings = [blob[offsets[i]:offsets[i + 1] - 1].decode('utf8')
+                        for i in range(len(offsets) - 1)]
+        del self._string_offsets
+
+    def string(self, index):
+        """
+        Return the string at *index*.
+        """
+        return self.strings[index]
+
+    def type_name(self, index):
+        """
+        Return the text of the type at *index*.
+        """
+        return self.strings[self.type_names[index]]
+
+
+def _snapshot(ptr):
+    """
+    Read the snapshot at *ptr* and dispose of it.
+    """
+    try:
+        return IRSnapshot(ptr)
+    finally:
+        ffi.lib.LLVMPY_DisposeSnapshot(ptr)
+
+
+# FFI
+
+ffi.lib.LLVMPY_SnapshotModule.argtypes = [ffi.LLVMModuleRef]
+ffi.lib.LLVMPY_SnapshotModule.restype = ffi.LLVMIRSnapshotRef
+
+ffi.lib.LLVMPY_SnapshotFunction.argtypes = [ffi.LLVMValueRef]
+ffi.lib.LLVMPY_SnapshotFunction.restype = ffi.LLVMIRSnapshotRef
+
+ffi.lib.LLVMPY_GetSnapshotArray.argtypes = [ffi.LLVMIRSnapshotRef, c_uint,
+                                            POINTER(c_size_t)]
+ffi.lib.LLVMPY_GetSnapshotArray.restype = c_void_p
+
+ffi.lib.LLVMPY_GetSnapshotStrings.argtypes = [ffi.LLVMIRSnapshotRef,
+                                              POINTER(c_size_t)]
+ffi.lib.LLVMPY_GetSnapshotStrings.restype = c_void_p
+
+ffi.lib.LLVMPY_DisposeSnapshot.argtypes = [ffi.LLVMIRSnapshotRef]
+
+# Snapshots are owned by the caller
+for _func in (ffi.lib.LLVMPY_GetSnapshotArray,
+              ffi.lib.LLVMPY_GetSnapshotStrings,
+              ffi.lib.LLVMPY_DisposeSnapshot):
+    _func.mark_threadsafe()
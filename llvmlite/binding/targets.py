@@ -1,5 +1,5 @@
 import os
-from ctypes import (POINTER, c_char_p, c_longlong, c_int, c_size_t,
+from ctypes import (POINTER, c_char_p, c_longlong, c_int, c_uint, c_size_t,
                     c_void_p, string_at)
 
 from llvmlite.binding import ffi
@@ -297,6 +297,7 @@ class TargetMachine(ffi.ObjectRef):
         use_object : bool
             Emit object code or (if False) emit assembly code.
         """
+        module.materialize_all()
         with ffi.OutputString() as outerr:
             mb = ffi.lib.LLVMPY_TargetMachineEmitToMemory(self, module,
                                                           int(use_object),
@@ -311,6 +312,44 @@ class TargetMachine(ffi.ObjectRef):
         finally:
             ffi.lib.LLVMPY_DisposeMemoryBuffer(mb)
 
+    def emit_object_parallel(self, module, num_threads, consume=False):
+        """
+        Split the module into *num_threads* partitions and generate a code
+        object for each of them concurrently, each on its own thread.
+        Returns a list of *num_threads* byte strings which, linked together,
+        are equivalent to the result of ``emit_object(module)``.
+
+        The module is left unchanged: the partitions are taken from a copy
+        of it.  If *consume* is true, the module is split itself, saving
+        that copy, and destroyed once code is generated.
+
+        As with emit_object(), each code object is copied out of its
+        native buffer into a new bytes object.
+        """
+        if num_threads < 1:
+            raise ValueError("num_threads must be at least 1")
+        module.materialize_all()
+        bufs = (ffi.LLVMMemoryBufferRef * num_threads)()
+        with ffi.OutputString() as outerr:
+            if ffi.lib.LLVMPY_TargetMachineEmitSplitToMemory(
+                    self, module, 1, num_threads, int(consume), bufs,
+                    outerr):
+                raise RuntimeError(str(outerr))
+        if consume:
+            # The underlying module was destroyed
+            module.detach()
+
+        objects = []
+        try:
+            for mb in bufs:
+                bufptr = ffi.lib.LLVMPY_GetBufferStart(mb)
+                bufsz = ffi.lib.LLVMPY_GetBufferSize(mb)
+                objects.append(string_at(bufptr, bufsz))
+        finally:
+            for mb in bufs:
+                ffi.lib.LLVMPY_DisposeMemoryBuffer(mb)
+        return objects
+
     @property
     def target_data(self):
         return TargetData(ffi.lib.LLVMPY_CreateTargetMachineData(self))
@@ -427,6 +466,17 @@ ffi.lib.LLVMPY_TargetMachineEmitToMemory.argtypes = [
 ]
 ffi.lib.LLVMPY_TargetMachineEmitToMemory.restype = ffi.LLVMMemoryBufferRef
 
+ffi.lib.LLVMPY_TargetMachineEmitSplitToMemory.argtypes = [
+    ffi.LLVMTargetMachineRef,
+    ffi.LLVMModuleRef,
+    c_int,
+    c_uint,
+    c_int,
+    POINTER(ffi.LLVMMemoryBufferRef),
+    POINTER(c_char_p),
+]
+ffi.lib.LLVMPY_TargetMachineEmitSplitToMemory.restype = c_int
+
 ffi.lib.LLVMPY_GetBufferStart.argtypes = [ffi.LLVMMemoryBufferRef]
 ffi.lib.LLVMPY_GetBufferStart.restype = c_void_p
 
@@ -435,6 +485,12 @@ ffi.lib.LLVMPY_GetBufferSize.restype = c_size_t
 
 ffi.lib.LLVMPY_DisposeMemoryBuffer.argtypes = [ffi.LLVMMemoryBufferRef]
 
+# Memory buffers are owned by the caller
+for _func in (ffi.lib.LLVMPY_GetBufferStart,
+              ffi.lib.LLVMPY_GetBufferSize,
+              ffi.lib.LLVMPY_DisposeMemoryBuffer):
+    _func.mark_threadsafe()
+
 ffi.lib.LLVMPY_CreateTargetMachineData.argtypes = [
     ffi.LLVMTargetMachineRef,
 ]
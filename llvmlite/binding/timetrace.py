@@ -0,0 +1,81 @@
+from contextlib import contextmanager
+from ctypes import c_char_p, c_int, c_uint, POINTER
+
+from llvmlite.binding import ffi
+from llvmlite.binding.common import _encode_string
+from llvmlite.binding.initfini import llvm_version_info
+
+
+def start_time_trace(granularity=500, process_name="llvmlite"):
+    """
+    Start recording a time trace of the compilation stages run by LLVM:
+    parsing, pass manager runs, code generation, linking and finalization,
+    as well as the passes themselves.  Sections shorter than *granularity*
+    microseconds are not recorded.
+
+    From LLVM 11, only the calling thread is traced.  With earlier
+    versions, the profiler is shared by all threads: the calls into LLVM
+    are serialized while tracing, and the operations which would compile
+    on threads of their own are either run on the calling thread or raise
+    a RuntimeError.  The trace must then be started and finished while no
+    other thread is calling into LLVM.
+    """
+    if llvm_version_info < (11,):
+        ffi._serialize_calls = True
+    with ffi.OutputString() as outerr:
+        if ffi.lib.LLVMPY_TimeTraceProfilerInitialize(
+                granularity, _encode_string(process_name), outerr):
+            raise RuntimeError(str(outerr))
+
+
+def is_time_trace_enabled():
+    """
+    Whether a time trace is being recorded.
+    """
+    return bool(ffi.lib.LLVMPY_TimeTraceProfilerEnabled())
+
+
+def finish_time_trace():
+    """
+    Stop recording the time trace and return it as a JSON string in the
+    Chrome trace event format, which can be loaded in ``chrome://tracing``
+    or https://ui.perfetto.dev.
+    """
+    with ffi.OutputString() as outerr, ffi.OutputString() as outtrace:
+        if ffi.lib.LLVMPY_TimeTraceProfilerFinish(outtrace, outerr):
+            raise RuntimeError(str(outerr))
+        ffi._serialize_calls = False
+        return str(outtrace)
+
+
+@contextmanager
+def time_trace_scope(name, detail=""):
+    """
+    A context manager recording its body as a section of the time trace,
+    so that stages outside of LLVM appear on the same timeline.  It does
+    nothing if no time trace is being recorded.
+    """
+    began = ffi.lib.LLVMPY_TimeTraceProfilerBegin(_encode_string(name),
+                                                  _encode_string(detail))
+    try:
+        yield
+    finally:
+        if began:
+            ffi.lib.LLVMPY_TimeTraceProfilerEnd()
+
+
+# ============================================================================
+# FFI
+
+ffi.lib.LLVMPY_TimeTraceProfilerInitialize.argtypes = [c_uint, c_char_p,
+                                                       POINTER(c_char_p)]
+ffi.lib.LLVMPY_TimeTraceProfilerInitialize.restype = c_int
+
+ffi.lib.LLVMPY_TimeTraceProfilerEnabled.restype = c_int
+
+ffi.lib.LLVMPY_TimeTraceProfilerFinish.argtypes = [POINTER(c_char_p),
+                                                   POINTER(c_char_p)]
+ffi.lib.LLVMPY_TimeTraceProfilerFinish.restype = c_int
+
+ffi.lib.LLVMPY_TimeTraceProfilerBegin.argtypes = [c_char_p, c_char_p]
+ffi.lib.LLVMPY_TimeTraceProfilerBegin.restype = c_int
@@ -3,6 +3,7 @@ import enum
 
 from llvmlite.binding import ffi
 from llvmlite.binding.common import _decode_string, _encode_string
+from llvmlite.binding.snapshot import _snapshot
 
 
 class Linkage(enum.IntEnum):
@@ -43,9 +44,30 @@ class StorageClass(enum.IntEnum):
     dllexport = 2
 
 
+def _parent_module_locks(obj):
+    """
+    Values are guarded by the lock of the context of their module.
+    """
+    module = obj._parents.get('module')
+    if module is None:
+        return ffi.ObjectRef._ffi_locks.fget(obj)
+    return module._ffi_locks
+
+
 class TypeRef(ffi.ObjectRef):
     """A weak reference to a LLVM type
     """
+
+    def __init__(self, ptr, parents=None):
+        # Keep the module the type was obtained from alive, and guard
+        # the type with the lock of its context
+        self._parents = parents if parents is not None else {}
+        ffi.ObjectRef.__init__(self, ptr)
+
+    @property
+    def _ffi_locks(self):
+        return _parent_module_locks(self)
+
     @property
     def name(self):
         """
@@ -68,7 +90,7 @@ class TypeRef(ffi.ObjectRef):
         """
         if not self.is_pointer:
             raise ValueError("Type {} is not a pointer".format(self))
-        return TypeRef(ffi.lib.LLVMPY_GetElementType(self))
+        return TypeRef(ffi.lib.LLVMPY_GetElementType(self), self._parents)
 
     def __str__(self):
         return ffi.ret_string(ffi.lib.LLVMPY_PrintType(self))
@@ -83,6 +105,10 @@ class ValueRef(ffi.ObjectRef):
         self._parents = parents
         ffi.ObjectRef.__init__(self, ptr)
 
+    @property
+    def _ffi_locks(self):
+        return _parent_module_locks(self)
+
     def __str__(self):
         with ffi.OutputString() as outstr:
             ffi.lib.LLVMPY_PrintValueToString(self, outstr)
@@ -201,7 +227,7 @@ class ValueRef(ffi.ObjectRef):
         This value's LLVM type.
         """
         # XXX what does this return?
-        return TypeRef(ffi.lib.LLVMPY_TypeOf(self))
+        return TypeRef(ffi.lib.LLVMPY_TypeOf(self), self._parents)
 
     @property
     def is_declaration(self):
@@ -214,6 +240,37 @@ class ValueRef(ffi.ObjectRef):
                              % (self._kind,))
         return ffi.lib.LLVMPY_IsDeclaration(self)
 
+    @property
+    def is_materializable(self):
+        """
+        Whether this function belongs to a module loaded lazily, and its
+        body has not been read yet.  Only function bodies are read lazily.
+        """
+        if not (self.is_global or self.is_function):
+            raise ValueError('expected global or function value, got %s'
+                             % (self._kind,))
+        return bool(ffi.lib.LLVMPY_IsMaterializable(self))
+
+    def materialize(self):
+        """
+        Read the body of this global value, if it belongs to a module loaded
+        lazily.  This is done implicitly when iterating over the blocks of
+        a function.
+        """
+        if not (self.is_global or self.is_function):
+            raise ValueError('expected global or function value, got %s'
+                             % (self._kind,))
+        with ffi.OutputString() as outerr:
+            if ffi.lib.LLVMPY_Materialize(self, outerr):
+                raise RuntimeError(str(outerr))
+
+    def _materialize_if_lazy(self):
+        # Only modules loaded lazily need materializing, spare the others
+        # the call
+        module = self._parents.get('module')
+        if module is None or module._materializable:
+            self.materialize()
+
     @property
     def attributes(self):
         """
@@ -223,20 +280,20 @@ class ValueRef(ffi.ObjectRef):
         itr = iter(())
         if self.is_function:
             it = ffi.lib.LLVMPY_FunctionAttributesIter(self)
-            itr = _AttributeListIterator(it)
+            itr = _AttributeListIterator(it, self._parents)
         elif self.is_instruction:
             if self.opcode == 'call':
                 it = ffi.lib.LLVMPY_CallInstAttributesIter(self)
-                itr = _AttributeListIterator(it)
+                itr = _AttributeListIterator(it, self._parents)
             elif self.opcode == 'invoke':
                 it = ffi.lib.LLVMPY_InvokeInstAttributesIter(self)
-                itr = _AttributeListIterator(it)
+                itr = _AttributeListIterator(it, self._parents)
         elif self.is_global:
             it = ffi.lib.LLVMPY_GlobalAttributesIter(self)
-            itr = _AttributeSetIterator(it)
+            itr = _AttributeSetIterator(it, self._parents)
         elif self.is_argument:
             it = ffi.lib.LLVMPY_ArgumentAttributesIter(self)
-            itr = _AttributeSetIterator(it)
+            itr = _AttributeSetIterator(it, self._parents)
         return itr
 
     @property
@@ -247,6 +304,7 @@ class ValueRef(ffi.ObjectRef):
         """
         if not self.is_function:
             raise ValueError('expected function value, got %s' % (self._kind,))
+        self._materialize_if_lazy()
         it = ffi.lib.LLVMPY_FunctionBlocksIter(self)
         parents = self._parents.copy()
         parents.update(function=self)
@@ -292,6 +350,15 @@ class ValueRef(ffi.ObjectRef):
         parents.update(instruction=self)
         return _OperandsIterator(it, parents)
 
+    def snapshot(self):
+        """
+        Return an IRSnapshot of this function, read in a single call.
+        """
+        if not self.is_function:
+            raise ValueError('expected function value, got %s' % (self._kind,))
+        self._materialize_if_lazy()
+        return _snapshot(ffi.lib.LLVMPY_SnapshotFunction(self))
+
     @property
     def opcode(self):
         if not self.is_instruction:
@@ -313,6 +380,10 @@ class _ValueIterator(ffi.ObjectRef):
             raise NotImplementedError('%s must specify kind attribute'
                                       % (type(self).__name__,))
 
+    @property
+    def _ffi_locks(self):
+        return _parent_module_locks(self)
+
     def __next__(self):
         vp = self._next()
         if vp:
@@ -328,6 +399,14 @@ class _ValueIterator(ffi.ObjectRef):
 
 class _AttributeIterator(ffi.ObjectRef):
 
+    def __init__(self, ptr, parents):
+        ffi.ObjectRef.__init__(self, ptr)
+        self._parents = parents
+
+    @property
+    def _ffi_locks(self):
+        return _parent_module_locks(self)
+
     def __next__(self):
         vp = self._next()
         if vp:
@@ -458,6 +537,12 @@ ffi.lib.LLVMPY_AddFunctionAttr.argtypes = [ffi.LLVMValueRef, c_uint]
 ffi.lib.LLVMPY_IsDeclaration.argtypes = [ffi.LLVMValueRef]
 ffi.lib.LLVMPY_IsDeclaration.restype = c_int
 
+ffi.lib.LLVMPY_IsMaterializable.argtypes = [ffi.LLVMValueRef]
+ffi.lib.LLVMPY_IsMaterializable.restype = c_int
+
+ffi.lib.LLVMPY_Materialize.argtypes = [ffi.LLVMValueRef, POINTER(c_char_p)]
+ffi.lib.LLVMPY_Materialize.restype = c_int
+
 ffi.lib.LLVMPY_FunctionAttributesIter.argtypes = [ffi.LLVMValueRef]
 ffi.lib.LLVMPY_FunctionAttributesIter.restype = ffi.LLVMAttributeListIterator
 
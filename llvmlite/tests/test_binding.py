@@ -2,15 +2,20 @@ import ctypes
 from ctypes import CFUNCTYPE, c_int
 from ctypes.util import find_library
 import gc
+import json
 import locale
+import mmap
 import os
 import platform
 import re
 import subprocess
 import sys
+import threading
+import time
 import unittest
+from unittest import mock
 from contextlib import contextmanager
-from tempfile import mkstemp
+from tempfile import mkstemp, TemporaryDirectory
 
 from llvmlite import ir
 from llvmlite import binding as llvm
@@ -154,6 +159,24 @@ asm_global_ctors = r"""
     """  # noqa E501
 
 
+asm_lazy_broken = r"""
+    ; ModuleID = '<string>'
+    target triple = "{triple}"
+
+    declare i32 @llvmlite_undefined_symbol(i32)
+
+    define i32 @sum(i32 %.1, i32 %.2) {{
+      %.3 = add i32 %.1, %.2
+      ret i32 %.3
+    }}
+
+    define i32 @broken(i32 %.1) {{
+      %.2 = call i32 @llvmlite_undefined_symbol(i32 %.1)
+      ret i32 %.2
+    }}
+    """
+
+
 asm_nonalphanum_blocklabel = """; ModuleID = ""
 target triple = "unknown-unknown-unknown"
 target datalayout = ""
@@ -264,6 +287,109 @@ class TestMisc(BaseTest):
         self.assertIn("parsing error", s)
         self.assertIn("invalid operand type", s)
 
+    def test_parse_assembly_buffer(self):
+        asm = asm_sum.format(triple=llvm.get_default_triple())
+        expected = str(llvm.parse_assembly(asm, llvm.create_context()))
+        data = asm.encode()
+        buffers = [data, bytearray(data), memoryview(data),
+                   memoryview(data).toreadonly(),
+                   memoryview(bytearray(data)),
+                   # Views not followed by a NUL character
+                   memoryview(b"  " + data)[2:],
+                   memoryview(bytearray(data + b"@"))[:-1]]
+        for buf in buffers:
+            mod = llvm.parse_assembly(buf, llvm.create_context())
+            self.assertEqual(str(mod), expected)
+        with self.assertRaises(RuntimeError) as cm:
+            llvm.parse_assembly(memoryview(b"declare void @f()")[:7])
+        # The view ends after "declare"
+        self.assertIn("<string>:1:8: error: expected type",
+                      str(cm.exception))
+        # Read-only buffers are passed without copying them
+        from llvmlite.binding.module import _ir_buffer
+        src = b"  " + data
+        buf, size, nullterminated = _ir_buffer(memoryview(src)[2:])
+        address = ctypes.cast(src, ctypes.c_void_p).value
+        self.assertEqual(buf.address, address + 2)
+        self.assertEqual(size, len(data))
+        self.assertFalse(nullterminated)
+        with self.assertRaises(ValueError):
+            llvm.parse_assembly(memoryview(data)[::2])
+
+    def test_parse_assembly_file(self):
+        asm = asm_sum.format(triple=llvm.get_default_triple())
+        expected = str(llvm.parse_assembly(asm, llvm.create_context()))
+        with TemporaryDirectory() as tmpdir:
+            path = os.path.join(tmpdir, "sum.ll")
+            with open(path, "w") as f:
+                f.write(asm)
+            mod = llvm.parse_assembly_file(path, llvm.create_context())
+            # The module is named after the file
+            self.assertEqual(mod.name, path)
+            mod.name = "<string>"
+            self.assertEqual(str(mod).replace(path, "<string>"), expected)
+            with open(path, "r+b") as f:
+                m = mmap.mmap(f.fileno(), 0)
+            try:
+                mod = llvm.parse_assembly(m, llvm.create_context())
+                self.assertEqual(str(mod), expected)
+            finally:
+                m.close()
+            with open(path, "rb") as f:
+                m = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+            try:
+                mod = llvm.parse_assembly(m, llvm.create_context())
+                self.assertEqual(str(mod), expected)
+                mod, = llvm.parse_assembly_batch([m])
+                self.assertEqual(str(mod), expected)
+            finally:
+                m.close()
+            with open(path, "w") as f:
+                f.write(asm_parse_error)
+            with self.assertRaises(RuntimeError) as cm:
+                llvm.parse_assembly_file(path)
+            self.assertIn("sum.ll", str(cm.exception))
+            with self.assertRaises(RuntimeError) as cm:
+                llvm.parse_assembly_file(os.path.join(tmpdir, "nope.ll"))
+            self.assertIn("nope.ll", str(cm.exception))
+
+    def test_parse_assembly_batch(self):
+        asm = asm_sum.format(triple=llvm.get_default_triple())
+        asms = [asm.replace("@sum", "@sum%d" % i) for i in range(8)]
+        expected = [str(llvm.parse_assembly(a, llvm.create_context()))
+                    for a in asms]
+        asms[3] = asms[3].encode()
+        asms[5] = asm_parse_error.format(triple=llvm.get_default_triple())
+        for threads in (0, 1, 3, 20):
+            results = llvm.parse_assembly_batch(asms, threads=threads)
+            self.assertEqual(len(results), len(asms))
+            for i, res in enumerate(results):
+                if i == 5:
+                    self.assertIsInstance(res, RuntimeError)
+                    self.assertIn("invalid operand type", str(res))
+                else:
+                    self.assertEqual(str(res), expected[i])
+            # Each module has a context of its own
+            contexts = set(res._context for i, res in enumerate(results)
+                           if i != 5)
+            self.assertEqual(len(contexts), len(asms) - 1)
+        self.assertEqual(llvm.parse_assembly_batch([]), [])
+
+    def test_parse_assembly_batch_generator(self):
+        # The strings produced by a generator are temporaries, which must
+        # be kept alive until parsed
+        asm = asm_sum.format(triple=llvm.get_default_triple())
+
+        def gen():
+            for i in range(200):
+                yield asm.replace("@sum", "@sum%d" % i)
+
+        results = llvm.parse_assembly_batch(gen(), threads=4)
+        self.assertEqual(len(results), 200)
+        for i, res in enumerate(results):
+            self.assertIsInstance(res, llvm.ModuleRef)
+            res.get_function("sum%d" % i)
+
     def test_nonalphanum_block_name(self):
         mod = ir.Module()
         ft = ir.FunctionType(ir.IntType(32), [])
@@ -531,6 +657,84 @@ class TestModuleRef(BaseTest):
             dest.link_in(src)
         self.assertIn("symbol multiply defined", str(cm.exception))
 
+    def link_runtime_modules(self):
+        dest = self.module("""
+            declare i32 @twice(i32)
+
+            define i32 @user(i32 %x) {{
+                %r = call i32 @twice(i32 %x)
+                ret i32 %r
+            }}
+            """)
+        runtime = self.module("""
+            declare i32 @add(i32, i32)
+
+            define i32 @twice(i32 %x) {{
+                %r = call i32 @add(i32 %x, i32 %x)
+                ret i32 %r
+            }}
+
+            define i32 @unused(i32 %x) {{
+                ret i32 %x
+            }}
+            """)
+        helpers = self.module("""
+            @count = global i32 0
+
+            define i32 @add(i32 %x, i32 %y) {{
+                %r = add i32 %x, %y
+                ret i32 %r
+            }}
+            """)
+        return dest, runtime, helpers
+
+    def test_link_in_only_needed(self):
+        dest, runtime, helpers = self.link_runtime_modules()
+        dest.link_in([runtime, helpers], only_needed=True)
+        self.assertTrue(runtime.closed and helpers.closed)
+        dest.verify()
+        defined = sorted(f.name for f in dest.functions
+                         if not f.is_declaration)
+        self.assertEqual(defined, ["add", "twice", "user"])
+        self.assertEqual(list(dest.global_variables), [])
+        linkages = {f.name: f.linkage for f in dest.functions}
+        self.assertEqual(linkages["twice"], llvm.Linkage.external)
+
+        dest, runtime, helpers = self.link_runtime_modules()
+        dest.link_in(runtime)
+        dest.link_in(helpers, preserve=True, only_needed=True)
+        self.assertFalse(helpers.closed)
+        defined = sorted(f.name for f in dest.functions
+                         if not f.is_declaration)
+        self.assertEqual(defined, ["add", "twice", "unused", "user"])
+
+    def test_link_in_internalize(self):
+        dest, runtime, helpers = self.link_runtime_modules()
+        dest.link_in((runtime, helpers), only_needed=True, internalize=True)
+        dest.verify()
+        linkages = {f.name: f.linkage for f in dest.functions}
+        self.assertEqual(linkages, {"user": llvm.Linkage.external,
+                                    "twice": llvm.Linkage.internal,
+                                    "add": llvm.Linkage.internal})
+
+        dest, runtime, helpers = self.link_runtime_modules()
+        dest.link_in([runtime, helpers], internalize=True)
+        self.assertEqual(
+            [gv.linkage for gv in dest.global_variables],
+            [llvm.Linkage.internal])
+        self.assertEqual(dest.get_function("user").linkage,
+                         llvm.Linkage.external)
+
+    def test_link_in_batch_error(self):
+        dest = self.module()
+        srcs = [self.module(asm_mul), self.module(asm_sum2),
+                self.module(asm_mul.replace("@mul", "@mul2"))]
+        with self.assertRaises(RuntimeError) as cm:
+            dest.link_in(srcs)
+        self.assertIn("symbol multiply defined", str(cm.exception))
+        # All the modules are destroyed
+        self.assertTrue(all(src.closed for src in srcs))
+
     def test_as_bitcode(self):
         mod = self.module()
         bc = mod.as_bitcode()
@@ -564,12 +768,171 @@ class TestModuleRef(BaseTest):
         mod.get_function("sum")
         mod.get_global_variable("glob")
 
+    def test_write_bitcode(self):
+        mod = self.module()
+        bc = mod.as_bitcode()
+        buf = bytearray(b"x")
+        mod.write_bitcode(buf)
+        self.assertEqual(buf, b"x" + bc)
+        with TemporaryDirectory() as tmpdir:
+            path = os.path.join(tmpdir, "sum.bc")
+            with open(path, "wb") as f:
+                f.write(b"x")
+                mod.write_bitcode(f)
+            with open(path, "rb") as f:
+                self.assertEqual(f.read(), b"x" + bc)
+            fd = os.open(path, os.O_WRONLY | os.O_TRUNC)
+            try:
+                mod.write_bitcode(fd)
+            finally:
+                os.close(fd)
+            with open(path, "rb") as f:
+                self.assertEqual(f.read(), bc)
+            fd = os.open(path, os.O_RDONLY)
+            try:
+                with self.assertRaises(OSError):
+                    mod.write_bitcode(fd)
+            finally:
+                os.close(fd)
+
+        # Errors of the writer are propagated
+        class Writer(object):
+            def write(self, data):
+                raise ZeroDivisionError
+
+        with self.assertRaises(ZeroDivisionError):
+            mod.write_bitcode(Writer())
+        with self.assertRaises(ValueError):
+            llvm.write_bitcode([])
+
+    def test_write_bitcode_modules(self):
+        mods = [self.module(asm, llvm.create_context())
+                for asm in (asm_sum, asm_mul)]
+        bc = llvm.write_bitcode(mods)
+        buf = bytearray()
+        llvm.write_bitcode(mods, buf)
+        self.assertEqual(buf, bc)
+        context = llvm.create_context()
+        parsed = llvm.parse_bitcode_modules(bc, context)
+        self.assertEqual(len(parsed), 2)
+        parsed[0].get_function("sum")
+        parsed[1].get_function("mul")
+        self.assertEqual(llvm.write_bitcode(parsed), bc)
+        # A single module is written as usual
+        [mod] = llvm.parse_bitcode_modules(mods[0].as_bitcode())
+        mod.get_function("sum")
+        with self.assertRaises(RuntimeError) as cm:
+            llvm.parse_bitcode_modules(b"")
+        self.assertIn("LLVM bitcode parsing error", str(cm.exception))
+
+    def lazy_module(self, **kwargs):
+        context = llvm.create_context()
+        mod = self.module(asm_sum, context)
+        mod.link_in(self.module(asm_mul, context))
+        return llvm.parse_bitcode(mod.as_bitcode(), llvm.create_context(),
+                                  lazy=True, **kwargs)
+
+    def test_parse_bitcode_lazy(self):
+        mod = self.lazy_module()
+        fsum = mod.get_function("sum")
+        fmul = mod.get_function("mul")
+        self.assertTrue(fsum.is_materializable)
+        self.assertFalse(fsum.is_declaration)
+        # Only function bodies are read lazily
+        self.assertFalse(mod.get_global_variable("glob").is_materializable)
+        # Iterating over blocks materializes the function
+        self.assertEqual(len(list(fsum.blocks)), 1)
+        self.assertFalse(fsum.is_materializable)
+        self.assertTrue(fmul.is_materializable)
+        fmul.materialize()
+        self.assertFalse(fmul.is_materializable)
+        mod.verify()
+
+    def test_blocks_not_lazy(self):
+        # Functions of modules not loaded lazily are never materialized
+        mod = self.module()
+        fn = mod.get_function("sum")
+        with mock.patch.object(llvm.ValueRef, 'materialize') as materialize:
+            self.assertEqual(len(list(fn.blocks)), 1)
+            fn.snapshot()
+        materialize.assert_not_called()
+        mod = self.lazy_module()
+        fn = mod.get_function("sum")
+        with mock.patch.object(llvm.ValueRef, 'materialize') as materialize:
+            list(fn.blocks)
+        materialize.assert_called_once_with()
+
+    def test_parse_bitcode_lazy_module_operations(self):
+        # Operations on the whole module materialize it
+        mod = self.lazy_module()
+        pm = llvm.create_module_pass_manager()
+        pm.run(mod)
+        self.assertFalse(mod.get_function("mul").is_materializable)
+        mod = self.lazy_module()
+        self.assertIn("define i32 @mul", str(mod.clone()))
+        bc = mod.as_bitcode()
+        self.assertEqual(
+            llvm.parse_bitcode(bc, llvm.create_context()).as_bitcode(), bc)
+        mod = self.lazy_module()
+        mod.materialize_all()
+        self.assertFalse(mod.get_function("sum").is_materializable)
+        # The linker materializes the functions it needs
+        dest = self.module(asm_sum_declare, mod._context)
+        dest.link_in(self.lazy_module_in(mod._context))
+        self.assertFalse(dest.get_function("sum").is_declaration)
+        # Compiling materializes as well
+        mod = self.lazy_module()
+        target_machine = self.target_machine(jit=False)
+        self.assertTrue(target_machine.emit_object(mod))
+
+    def lazy_module_in(self, context):
+        mod = self.module(asm_sum, llvm.create_context())
+        return llvm.parse_bitcode(mod.as_bitcode(), context, lazy=True)
+
+    def test_parse_bitcode_file(self):
+        bc = self.module(context=llvm.create_context()).as_bitcode()
+        with TemporaryDirectory() as tmpdir:
+            path = os.path.join(tmpdir, "sum.bc")
+            with open(path, "wb") as f:
+                f.write(bc)
+            mod = llvm.parse_bitcode_file(path, llvm.create_context())
+            self.assertFalse(mod.get_function("sum").is_materializable)
+            self.assertEqual(mod.as_bitcode(), bc)
+            mod = llvm.parse_bitcode_file(path, llvm.create_context(),
+                                          lazy=True)
+            self.assertTrue(mod.get_function("sum").is_materializable)
+            self.assertEqual(mod.as_bitcode(), bc)
+            with self.assertRaises(RuntimeError) as cm:
+                llvm.parse_bitcode_file(os.path.join(tmpdir, "nope.bc"))
+            self.assertIn("LLVM bitcode parsing error", str(cm.exception))
+
     def test_cloning(self):
         m = self.module()
         cloned = m.clone()
         self.assertIsNot(cloned, m)
         self.assertEqual(cloned.as_bitcode(), m.as_bitcode())
 
+    def test_cloning_subset(self):
+        m = self.module()
+        m.link_in(self.module(asm_mul))
+        cloned = m.clone(keep=["mul", "glob", "nope"])
+        cloned.verify()
+        self.assertFalse(cloned.get_function("mul").is_declaration)
+        self.assertTrue(cloned.get_function("sum").is_declaration)
+        self.assertFalse(cloned.get_global_variable("glob").is_declaration)
+        self.assertTrue(cloned.get_global_variable("mul_glob").is_declaration)
+        # The original module is untouched
+        self.assertFalse(m.get_function("sum").is_declaration)
+        self.assertFalse(m.get_global_variable("mul_glob").is_declaration)
+        # Only the kept functions of a lazy module are materialized
+        m = self.lazy_module()
+        cloned = m.clone(keep=["sum"])
+        cloned.verify()
+        self.assertIn("add i32", str(cloned.get_function("sum")))
+        self.assertTrue(cloned.get_function("mul").is_declaration)
+        self.assertFalse(m.get_function("sum").is_materializable)
+        self.assertTrue(m.get_function("mul").is_materializable)
+
 
 class JITTestMixin(object):
     """
@@ -755,6 +1118,210 @@ class JITTestMixin(object):
         self.assertEqual(len(notifies), 0)
         self.assertEqual(len(getbuffers), 1)
 
+    def compiled_sum_object(self):
+        objects = []
+        ee = self.jit(self.module())
+        ee.set_object_cache(lambda mod, buf: objects.append(buf))
+        self.get_sum(ee)
+        return objects[0]
+
+    def check_object_cache_buffer(self, buf):
+        # The engine compiles asm_mul unless it uses *buf*
+        ee = self.jit(self.module(asm_mul))
+        ee.set_object_cache(getbuffer_func=lambda mod: buf)
+        self.assertEqual(self.get_sum(ee)(2, -5), -3)
+        return ee
+
+    def test_object_cache_getbuffer_in_place(self):
+        obj = self.compiled_sum_object()
+        self.check_object_cache_buffer(obj)
+        buf = bytearray(obj)
+        ee = self.check_object_cache_buffer(buf)
+        # The engine holds the buffer
+        with self.assertRaises(BufferError):
+            buf.clear()
+        del ee
+        gc.collect()
+        buf.clear()
+        # A read-only buffer is used in place too, a misaligned one is
+        # copied, as is a non-contiguous one
+        view = memoryview(obj)
+        ee = self.check_object_cache_buffer(view)
+        with self.assertRaises(BufferError):
+            view.release()
+        del ee
+        gc.collect()
+        view.release()
+        self.check_object_cache_buffer(memoryview(b" " + obj)[1:])
+        self.check_object_cache_buffer(
+            memoryview(bytes(b for b in obj for _ in range(2)))[::2])
+
+    def test_object_cache_getbuffer_mmap(self):
+        obj = self.compiled_sum_object()
+        with TemporaryDirectory() as tmpdir:
+            path = os.path.join(tmpdir, "sum.o")
+            with open(path, "wb") as f:
+                f.write(obj)
+            # A path is loaded by LLVM
+            self.check_object_cache_buffer(path)
+            # A missing file lets the engine compile the module
+            ee = self.jit(self.module())
+            ee.set_object_cache(getbuffer_func=lambda mod: path + "x")
+            self.assertEqual(self.get_sum(ee)(2, -5), -3)
+            with open(path, "r+b") as f:
+                m = mmap.mmap(f.fileno(), 0)
+            ee = self.check_object_cache_buffer(m)
+            del ee
+            gc.collect()
+            m.close()
+            # A read-only map is used in place as well
+            with open(path, "rb") as f:
+                m = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+            ee = self.check_object_cache_buffer(m)
+            with self.assertRaises(BufferError):
+                m.close()
+            del ee
+            gc.collect()
+            m.close()
+
+    def test_disk_object_cache(self):
+        with TemporaryDirectory() as tmpdir:
+            cachedir = os.path.join(tmpdir, "cache")
+            cache = llvm.create_disk_object_cache(cachedir)
+            self.assertEqual(cache.directory, cachedir)
+            self.assertEqual(cache.stats, (0, 0, 0))
+
+            # Named types are renamed when the same IR is parsed again in
+            # a context, so use a context per engine, as another process
+            # would.
+            ee = self.jit(self.module(context=llvm.create_context()))
+            ee.set_disk_object_cache(cache)
+            self.assertEqual(self.get_sum(ee)(2, -5), -3)
+            self.assertEqual(cache.stats, (0, 1, 1))
+            files = os.listdir(cachedir)
+            self.assertEqual(len(files), 1)
+            self.assertTrue(files[0].startswith("llvmcache-"))
+
+            # Another engine, e.g. in another process, finds the object
+            cache = llvm.create_disk_object_cache(cachedir)
+            ee = self.jit(self.module(context=llvm.create_context()))
+            ee.set_disk_object_cache(cache)
+            self.assertEqual(self.get_sum(ee)(2, -5), -3)
+            self.assertEqual(cache.stats, (1, 0, 0))
+
+            # A different module is compiled
+            ee.add_module(self.module(asm_mul))
+            self.assertEqual(self.get_sum(ee, "mul")(2, -5), -10)
+            self.assertEqual(cache.stats, (1, 1, 1))
+            self.assertEqual(len(os.listdir(cachedir)), 2)
+
+    def check_disk_object_cache_reuse(self, **kwargs):
+        with TemporaryDirectory() as tmpdir:
+            cache = llvm.create_disk_object_cache(tmpdir, **kwargs)
+            for i in range(3):
+                ee = self.jit(self.module(context=llvm.create_context()))
+                ee.set_disk_object_cache(cache)
+                self.assertEqual(self.get_sum(ee)(2, -5), -3)
+            cache.flush()
+            self.assertEqual(cache.stats, (2, 1, 1))
+            [name] = os.listdir(tmpdir)
+            with open(os.path.join(tmpdir, name), "rb") as f:
+                data = f.read()
+            # The object is found by another cache, as in another process
+            other = llvm.create_disk_object_cache(tmpdir)
+            ee = self.jit(self.module(context=llvm.create_context()))
+            ee.set_disk_object_cache(other)
+            self.assertEqual(self.get_sum(ee)(2, -5), -3)
+            self.assertEqual(other.stats, (1, 0, 0))
+            return data
+
+    def test_disk_object_cache_background_writes(self):
+        data = self.check_disk_object_cache_reuse(background_writes=True,
+                                                  max_queued_writes=1)
+        self.assertFalse(data.startswith(b"LLVMPYZ"))
+
+    def test_disk_object_cache_compress(self):
+        if not ffi.lib.LLVMPY_IsCompressionAvailable():
+            with self.assertRaises(RuntimeError):
+                llvm.create_disk_object_cache("", compress=True)
+            self.skipTest("zlib is not available")
+        data = self.check_disk_object_cache_reuse(compress=True)
+        self.assertTrue(data.startswith(b"LLVMPYZ"))
+        data = self.check_disk_object_cache_reuse(compress=True,
+                                                  background_writes=True)
+        self.assertTrue(data.startswith(b"LLVMPYZ"))
+
+    def test_disk_object_cache_flush(self):
+        with TemporaryDirectory() as tmpdir:
+            cache = llvm.create_disk_object_cache(tmpdir,
+                                                  background_writes=True)
+            for asm in (asm_sum, asm_mul, asm_sum2):
+                ee = self.jit(self.module(asm))
+                ee.set_disk_object_cache(cache)
+                ee.finalize_object()
+            cache.flush()
+            self.assertEqual(cache.stats, (0, 3, 3))
+            self.assertEqual(len(os.listdir(tmpdir)), 3)
+            # Disposing of the cache writes the queued objects
+            ee = self.jit(self.module(asm_double_locale))
+            ee.set_disk_object_cache(cache)
+            ee.finalize_object()
+            # The cache can't be closed while an engine uses it
+            with self.assertRaises(RuntimeError):
+                cache.close()
+            self.assertFalse(cache.closed)
+            ee.close()
+            cache.close()
+            self.assertEqual(len(os.listdir(tmpdir)), 4)
+        with self.assertRaises(ValueError):
+            llvm.create_disk_object_cache(tmpdir, background_writes=True,
+                                          max_queued_writes=0)
+
+    def test_disk_object_cache_views(self):
+        # Each engine owns its view of the cache, released with the engine
+        with TemporaryDirectory() as tmpdir:
+            cache = llvm.create_disk_object_cache(tmpdir)
+            nviews = ffi.lib.LLVMPY_DiskObjectCacheNumViews
+            ee = self.jit(self.module())
+            ee.set_disk_object_cache(cache)
+            ee.set_disk_object_cache(cache)
+            self.assertEqual(nviews(cache), 1)
+            other = self.jit(self.module(asm_mul))
+            other.set_disk_object_cache(cache)
+            self.assertEqual(nviews(cache), 2)
+            other.close()
+            self.assertEqual(nviews(cache), 1)
+            ee.set_object_cache()
+            self.assertEqual(nviews(cache), 0)
+            ee.close()
+            cache.close()
+
+    def test_disk_object_cache_target_machine(self):
+        # Objects compiled for another target configuration are not reused
+        with TemporaryDirectory() as tmpdir:
+            cache = llvm.create_disk_object_cache(tmpdir)
+            ee = self.jit(self.module(context=llvm.create_context()))
+            ee.set_disk_object_cache(cache)
+            self.get_sum(ee)
+            target = llvm.Target.from_default_triple()
+            tm = target.create_target_machine(opt=0, jit=True)
+            mod = self.module(context=llvm.create_context())
+            ee = self.jit(mod, tm)
+            ee.set_disk_object_cache(cache)
+            self.get_sum(ee)
+            self.assertEqual(cache.stats, (0, 2, 2))
+
+    def test_disk_object_cache_max_size(self):
+        with TemporaryDirectory() as tmpdir:
+            cache = llvm.create_disk_object_cache(tmpdir, max_size=1)
+            ee = self.jit(self.module())
+            ee.set_disk_object_cache(cache)
+            self.get_sum(ee)
+            self.assertEqual(cache.stats.writes, 1)
+            # The object alone exceeds the cap, it is pruned right away
+            self.assertEqual([f for f in os.listdir(tmpdir)
+                              if f.startswith("llvmcache-")], [])
+
 
 class JITWithTMTestMixin(JITTestMixin):
 
@@ -793,6 +1360,145 @@ class TestMCJit(BaseTest, JITWithTMTestMixin):
         return llvm.create_mcjit_compiler(mod, target_machine)
 
 
+class TestLLJit(BaseTest):
+    """
+    Test JIT engines created with create_lljit_compiler().
+    """
+
+    def jit(self, mod, num_compile_threads=0, lazy=False):
+        target_machine = self.target_machine(jit=True)
+        return llvm.create_lljit_compiler(mod, target_machine,
+                                          num_compile_threads, lazy)
+
+    def get_sum(self, ee, func_name="sum"):
+        ee.finalize_object()
+        cfptr = ee.get_function_address(func_name)
+        self.assertTrue(cfptr)
+        return CFUNCTYPE(c_int, c_int, c_int)(cfptr)
+
+    def test_run_code(self):
+        mod = self.module()
+        with self.jit(mod) as ee:
+            self.assertIsInstance(ee, llvm.ExecutionEngine)
+            cfunc = self.get_sum(ee)
+            self.assertEqual(cfunc(2, -5), -3)
+
+    def test_close(self):
+        ee = self.jit(self.module())
+        ee.close()
+        ee.close()
+        with self.assertRaises(ctypes.ArgumentError):
+            ee.finalize_object()
+
+    def test_add_module(self):
+        mod = self.module()
+        ee = self.jit(mod)
+        mod2 = self.module(asm_mul)
+        ee.add_module(mod2)
+        with self.assertRaises(KeyError):
+            ee.add_module(mod2)
+        cfunc = self.get_sum(ee, "mul")
+        self.assertEqual(cfunc(2, -5), -10)
+        # The modules stay usable while the engine is alive
+        self.assertEqual(mod2.get_function("mul").name, "mul")
+        ee.close()
+        self.assertTrue(mod.closed)
+        self.assertTrue(mod2.closed)
+
+    def test_compile_threads(self):
+        ee = self.jit(self.module(), num_compile_threads=4)
+        ee.add_module(self.module(asm_mul))
+        ee.finalize_object()
+        self.assertEqual(self.get_sum(ee)(2, -5), -3)
+        self.assertEqual(self.get_sum(ee, "mul")(2, -5), -10)
+
+    def test_lazy(self):
+        # `broken` can't be linked, which only matters once it is compiled
+        mod = self.module(asm_lazy_broken)
+        ee = self.jit(mod)
+        with self.assertRaises(RuntimeError):
+            ee.finalize_object()
+
+        mod = self.module(asm_lazy_broken)
+        ee = self.jit(mod, lazy=True)
+        ee.add_module(self.module(asm_mul))
+        self.assertEqual(self.get_sum(ee)(2, -5), -3)
+        self.assertEqual(self.get_sum(ee, "mul")(2, -5), -10)
+        # Looking up the address only returns a stub
+        self.assertTrue(ee.get_function_address("broken"))
+
+    def test_lazy_compile_threads(self):
+        ee = self.jit(self.module(), num_compile_threads=2, lazy=True)
+        ee.add_module(self.module(asm_mul))
+        self.assertEqual(self.get_sum(ee)(2, -5), -3)
+        self.assertEqual(self.get_sum(ee, "mul")(2, -5), -10)
+
+    def test_lazy_global_ctors_dtors(self):
+        ee = self.jit(self.module(asm_global_ctors), lazy=True)
+        ee.run_static_constructors()
+        ptr_addr = ee.get_global_value_address("A")
+        ptr = ctypes.cast(ptr_addr, ctypes.POINTER(ctypes.c_int32))
+        self.assertEqual(ptr.contents.value, 10)
+        foo = ctypes.CFUNCTYPE(ctypes.c_int32)(
+            ee.get_function_address("foo"))
+        self.assertEqual(foo(), 12)
+        ee.run_static_destructors()
+        self.assertEqual(ptr.contents.value, 20)
+
+    def test_lookup_error(self):
+        ee = self.jit(self.module())
+        with self.assertRaises(RuntimeError) as raises:
+            ee.get_function_address("nonexistent")
+        self.assertIn("nonexistent", str(raises.exception))
+
+    def test_add_global_mapping(self):
+        mod = self.module(asm_sum_declare)
+        mod2 = self.module(TestObjectFile.mod_asm)
+        ee = self.jit(mod)
+        ee.add_module(mod2)
+        cb = CFUNCTYPE(c_int, c_int, c_int)(lambda a, b: a + b)
+        ee.add_global_mapping(mod.get_function("sum"),
+                              ctypes.cast(cb, ctypes.c_void_p).value)
+        sum_twice = self.get_sum(ee, "sum_twice")
+        self.assertEqual(sum_twice(2, 3), 10)
+
+    def test_global_ctors_dtors(self):
+        mod = self.module(asm_global_ctors)
+        ee = self.jit(mod)
+        ee.finalize_object()
+        ee.run_static_constructors()
+        ptr_addr = ee.get_global_value_address("A")
+        ptr = ctypes.cast(ptr_addr, ctypes.POINTER(ctypes.c_int32))
+        self.assertEqual(ptr.contents.value, 10)
+        ee.run_static_destructors()
+        self.assertEqual(ptr.contents.value, 20)
+
+    def test_target_data(self):
+        ee = self.jit(self.module())
+        td = ee.target_data
+        self.assertIs(ee.target_data, td)
+        self.assertEqual(str(td), str(self.target_machine(jit=True)
+                                      .target_data))
+
+    def test_add_object_file(self):
+        target_machine = self.target_machine(jit=False)
+        obj = llvm.ObjectFileRef.from_data(
+            target_machine.emit_object(self.module()))
+        ee = self.jit(self.module(TestObjectFile.mod_asm))
+        ee.add_object_file(obj)
+        sum_twice = self.get_sum(ee, "sum_twice")
+        self.assertEqual(sum_twice(2, 3), 10)
+
+    def test_unsupported(self):
+        ee = self.jit(self.module())
+        with self.assertRaises(NotImplementedError):
+            ee.remove_module(self.module(asm_mul))
+        with self.assertRaises(NotImplementedError):
+            ee.set_object_cache()
+        with self.assertRaises(NotImplementedError):
+            ee.set_disk_object_cache(None)
+
+
 class TestValueRef(BaseTest):
 
     def test_str(self):
@@ -986,6 +1692,78 @@ class TestValueRef(BaseTest):
                 self.assertEqual(list(args[0].attributes), [b'returned'])
                 self.assertEqual(list(args[1].attributes), [])
 
+    def test_module_snapshot(self):
+        mod = self.module()
+        mod.link_in(self.module(asm_attributes))
+        snap = mod.snapshot()
+        funcs = list(mod.functions)
+        self.assertEqual([snap.string(i) for i in snap.function_names],
+                         [f.name for f in funcs])
+        self.assertEqual(len(snap.function_blocks), len(funcs) + 1)
+        args = [a for f in funcs for a in f.arguments]
+        self.assertEqual([snap.string(i) for i in snap.argument_names],
+                         [a.name for a in args])
+        self.assertEqual([snap.type_name(i) for i in snap.argument_types],
+                         [str(a.type) for a in args])
+        insts = [i for f in funcs for b in f.blocks for i in b.instructions]
+        self.assertEqual([snap.string(i) for i in snap.instruction_opcodes],
+                         [i.opcode for i in insts])
+        self.assertEqual([snap.type_name(i) for i in snap.instruction_types],
+                         [str(i.type) for i in insts])
+        operands = [o for i in insts for o in i.operands]
+        self.assertEqual([snap.type_name(i) for i in snap.operand_types],
+                         [str(o.type) for o in operands])
+        self.assertEqual(list(snap.instruction_operands),
+                         [0, 2, 4, 5])
+
+    def test_function_snapshot(self):
+        mod = self.module("""
+            @glob = global i32 0
+
+            define i32 @count(i32 %n) {{
+            entry:
+                br label %loop
+            loop:
+                %i = phi i32 [0, %entry], [%next, %loop]
+                %next = add i32 %i, 1
+                %p = load i32, i32* @glob
+                %c = icmp slt i32 %next, %n
+                br i1 %c, label %loop, label %exit
+            exit:
+                ret i32 %next
+            }}
+            """)
+        snap = mod.get_function("count").snapshot()
+        self.assertEqual([snap.string(i) for i in snap.block_names],
+                         ["entry", "loop", "exit"])
+        self.assertEqual(list(snap.block_instructions), [0, 1, 6, 7])
+        self.assertEqual(list(snap.instruction_blocks),
+                         [0, 1, 1, 1, 1, 1, 2])
+        self.assertEqual([snap.string(i) for i in snap.instruction_names],
+                         ["", "i", "next", "p", "c", "", ""])
+
+        def operands(inst):
+            start, end = snap.instruction_operands[inst:inst + 2]
+            return [(llvm.OperandKind(snap.operand_kinds[k]),
+                     snap.operand_values[k]) for k in range(start, end)]
+
+        kind = llvm.OperandKind
+        # The phi refers to the later "next"
+        self.assertEqual(operands(1), [(kind.constant, snap.strings.index(
+            "i32 0")), (kind.instruction, 2)])
+        self.assertEqual(operands(2), [(kind.instruction, 1),
+                                       (kind.constant, snap.strings.index(
+                                           "i32 1"))])
+        self.assertEqual(operands(3), [(kind.global_value,
+                                        snap.strings.index("glob"))])
+        self.assertEqual(operands(4), [(kind.instruction, 2),
+                                       (kind.argument, 0)])
+        # The condition comes first, then the false and true targets
+        self.assertEqual(operands(5), [(kind.instruction, 4),
+                                       (kind.block, 2), (kind.block, 1)])
+        with self.assertRaises(ValueError):
+            mod.get_global_variable("glob").snapshot()
+
 
 class TestTarget(BaseTest):
 
@@ -1197,6 +1975,33 @@ class TestModulePassManager(BaseTest, PassManagerTestMixin):
         else:
             raise RuntimeError("expected IR not found")
 
+    def test_timings(self):
+        pm = self.pm()
+        with self.assertRaises(RuntimeError):
+            pm.get_timings()
+        pm = llvm.create_module_pass_manager(timing=True)
+        self.pmb().populate(pm)
+        pm.add_instruction_combining_pass()
+        self.assertEqual(pm.get_timings(), [])
+        mod = self.module(asm_sum2)
+        pm.run(mod)
+        pm.run(mod)
+        timings = {t.name: t for t in pm.get_timings()}
+        t = timings["instcombine"]
+        self.assertIsInstance(t, llvm.PassTiming)
+        # Once per function per run, for each instance of the pass
+        self.assertGreaterEqual(t.count, 4)
+        self.assertEqual(t.count % 2, 0)
+        self.assertGreaterEqual(t.wall_time, 0.0)
+        self.assertGreaterEqual(t.user_time, 0.0)
+        self.assertGreaterEqual(t.system_time, 0.0)
+        # Module passes run once per run
+        self.assertEqual(timings["globalopt"].count, 2)
+        walls = [t.wall_time for t in pm.get_timings()]
+        self.assertEqual(walls, sorted(walls, reverse=True))
+        pm.reset_timings()
+        self.assertEqual(pm.get_timings(), [])
+
 
 class TestFunctionPassManager(BaseTest, PassManagerTestMixin):
 
@@ -1224,6 +2029,57 @@ class TestFunctionPassManager(BaseTest, PassManagerTestMixin):
         self.assertIn("%.4", orig_asm)
         self.assertNotIn("%.4", opt_asm)
 
+    def test_timings(self):
+        mod = self.module()
+        fn = mod.get_function("sum")
+        pm = llvm.create_function_pass_manager(mod, timing=True)
+        pm.add_instruction_combining_pass()
+        pm.initialize()
+        for _ in range(3):
+            pm.run(fn)
+        pm.finalize()
+        timings = {t.name: t for t in pm.get_timings()}
+        self.assertEqual(timings["instcombine"].count, 3)
+        self.assertIn("%.4", str(self.module()))
+        self.assertNotIn("%.4", str(fn))
+
+
+class TestPipeline(BaseTest):
+
+    def test_close(self):
+        p = llvm.create_pipeline("default<O2>")
+        p.close()
+        p.close()
+
+    def test_str(self):
+        p = llvm.create_pipeline("function(sroa,instcombine)")
+        self.assertEqual(str(p), "function(sroa,instcombine)")
+
+    def test_run(self):
+        mod = self.module()
+        orig_asm = str(mod)
+        p = llvm.create_pipeline("default<O3>")
+        self.assertTrue(p.run(mod))
+        opt_asm = str(mod)
+        # Quick check that optimizations were run
+        self.assertIn("%.4", orig_asm)
+        self.assertNotIn("%.4", opt_asm)
+        mod.verify()
+
+    def test_run_function_passes(self):
+        mod = self.module()
+        p = llvm.create_pipeline("function(sroa,instcombine)",
+                                 self.target_machine(jit=False))
+        self.assertTrue(p.run(mod))
+        self.assertNotIn("%.4", str(mod))
+        # Nothing left to do the second time around
+        self.assertFalse(p.run(mod))
+
+    def test_bad_pipeline(self):
+        with self.assertRaises(ValueError) as raises:
+            llvm.create_pipeline("function(no-such-pass)")
+        self.assertIn("no-such-pass", str(raises.exception))
+
 
 class TestPasses(BaseTest, PassManagerTestMixin):
 
@@ -1250,6 +2106,109 @@ class TestPasses(BaseTest, PassManagerTestMixin):
         pm.add_basic_alias_analysis_pass()
 
 
+class TestTimeTrace(BaseTest):
+
+    def tearDown(self):
+        if llvm.is_time_trace_enabled():
+            llvm.finish_time_trace()
+        super(TestTimeTrace, self).tearDown()
+
+    def event_names(self, trace):
+        return {e['name'] for e in json.loads(trace)['traceEvents']}
+
+    def test_pipeline(self):
+        self.assertFalse(llvm.is_time_trace_enabled())
+        llvm.start_time_trace(granularity=0)
+        self.assertTrue(llvm.is_time_trace_enabled())
+        with llvm.time_trace_scope("Compile", "sum"):
+            mod = self.module()
+            pm = llvm.create_module_pass_manager()
+            pm.add_instruction_combining_pass()
+            pm.run(mod)
+            mod.link_in(self.module(asm_mul))
+            tm = self.target_machine(jit=False)
+            tm.emit_object(mod)
+            ee = llvm.create_mcjit_compiler(mod, self.target_machine(jit=True))
+            ee.finalize_object()
+        names = self.event_names(llvm.finish_time_trace())
+        self.assertFalse(llvm.is_time_trace_enabled())
+        for name in ("Compile", "ParseAssembly", "RunPassManager",
+                     "LinkModules", "EmitToMemory", "FinalizeObject"):
+            self.assertIn(name, names)
+            self.assertIn("Total " + name, names)
+
+    @unittest.skipIf(llvm.llvm_version_info < (10,),
+                     "time trace granularity requires LLVM 10")
+    def test_granularity(self):
+        llvm.start_time_trace(granularity=10 ** 9)
+        with llvm.time_trace_scope("Compile"):
+            self.module()
+        names = self.event_names(llvm.finish_time_trace())
+        self.assertNotIn("Compile", names)
+        self.assertIn("Total Compile", names)
+
+    def test_disabled(self):
+        with llvm.time_trace_scope("Compile"):
+            self.module()
+        with self.assertRaises(RuntimeError):
+            llvm.finish_time_trace()
+
+    def test_start_twice(self):
+        llvm.start_time_trace()
+        with self.assertRaises(RuntimeError):
+            llvm.start_time_trace()
+
+    def test_other_thread(self):
+        # From LLVM 11 only the thread which started the trace records
+        # sections.  Before that, the operations of all threads are
+        # recorded, but the time_trace_scope() sections of the other
+        # threads are not.
+        llvm.start_time_trace(granularity=0)
+
+        def other():
+            with llvm.time_trace_scope("Other"):
+                self.module(asm_mul)
+
+        t = threading.Thread(target=other)
+        t.start()
+        t.join()
+        self.module()
+        events = json.loads(llvm.finish_time_trace())['traceEvents']
+        parses = [e for e in events if e['name'] == "ParseAssembly"]
+        self.assertEqual(len(parses),
+                         1 if llvm.llvm_version_info >= (11,) else 2)
+        self.assertNotIn("Other", {e['name'] for e in events})
+
+    def test_compile_threads(self):
+        # Before LLVM 11 the calls are serialized while tracing, and
+        # compiling on threads other than the caller's is refused
+        shared = llvm.llvm_version_info < (11,)
+        asm = asm_sum.format(triple=llvm.get_default_triple())
+        tm = self.target_machine(jit=False)
+        ee = llvm.create_lljit_compiler(self.module(),
+                                        self.target_machine(jit=True), 2)
+        llvm.start_time_trace(granularity=0)
+        self.assertEqual(ffi._serialize_calls, shared)
+        mods = llvm.parse_assembly_batch([asm] * 4, threads=4)
+        for mod in mods:
+            self.assertNotIsInstance(mod, RuntimeError)
+        if shared:
+            with self.assertRaises(RuntimeError):
+                tm.emit_object_parallel(mods[0], 2)
+            with self.assertRaises(RuntimeError):
+                ee.finalize_object()
+        else:
+            self.assertEqual(len(tm.emit_object_parallel(mods[0], 2)), 2)
+            ee.finalize_object()
+        names = self.event_names(llvm.finish_time_trace())
+        self.assertIn("ParseAssemblyBatch", names)
+        self.assertFalse(ffi._serialize_calls)
+        # Once the trace is finished, they are allowed again
+        self.assertEqual(len(tm.emit_object_parallel(mods[0], 2)), 2)
+        ee.finalize_object()
+        self.assertTrue(ee.get_function_address("sum"))
+
+
 class TestDylib(BaseTest):
 
     def test_bad_library(self):
@@ -1304,6 +2263,56 @@ class TestAnalysis(BaseTest):
         self.assertIn(inst, dot_showing_inst)
         self.assertNotIn(inst, dot_without_inst)
 
+    def test_get_function_stats(self):
+        mod = self.module("""
+            declare void @NRT_incref(i8*)
+            declare void @NRT_decref(i8*)
+
+            define void @loops(i8* %p, i32 %n) {{
+            entry:
+                call void @NRT_incref(i8* %p)
+                br label %outer
+            outer:
+                %i = phi i32 [0, %entry], [%i1, %inner]
+                br label %inner
+            inner:
+                %j = phi i32 [0, %outer], [%j1, %inner]
+                %j1 = add i32 %j, 1
+                %c = icmp slt i32 %j1, %n
+                br i1 %c, label %inner, label %next
+            next:
+                %i1 = add i32 %i, 1
+                %d = icmp slt i32 %i1, %n
+                br i1 %d, label %outer, label %exit
+            exit:
+                call void @NRT_decref(i8* %p)
+                ret void
+            }}
+            """)
+        mod.link_in(self.module(asm_sum, mod._context))
+        stats = llvm.get_function_stats(mod)
+        self.assertEqual([st.name for st in stats], ["loops", "sum"])
+        loops, fsum = stats
+        self.assertEqual(loops.instructions, 13)
+        self.assertEqual(loops.blocks, 5)
+        self.assertEqual(loops.calls, 2)
+        self.assertEqual(loops.loops, 2)
+        self.assertEqual(loops.refops, 2)
+        self.assertEqual(loops.opcodes, {'call': 2, 'br': 4, 'phi': 2,
+                                         'add': 2, 'icmp': 2, 'ret': 1})
+        self.assertEqual(fsum, ("sum", 3, 1, 0, 0, 0, {'add': 2, 'ret': 1}))
+        # The refop functions are configurable
+        stats = llvm.get_function_stats(mod, incref_names=["my_incref"],
+                                        decref_names=["NRT_decref"])
+        self.assertEqual(stats[0].refops, 1)
+        stats = llvm.get_function_stats(mod, incref_names="NRT_incref")
+        self.assertEqual(stats[0].refops, 2)
+        stats = llvm.get_function_stats(mod, incref_names=[],
+                                        decref_names=[])
+        self.assertEqual(stats[0].refops, 0)
+        self.assertEqual(llvm.get_function_stats(
+            self.module(asm_sum_declare)), [])
+
 
 class TestTypeParsing(BaseTest):
     @contextmanager
@@ -1333,6 +2342,277 @@ class TestTypeParsing(BaseTest):
             gv.initializer = ir.Constant(typ, [1])
 
 
+class TestBuildIRModule(BaseTest):
+    """
+    Test building modules from llvmlite.ir without textual IR.
+    """
+
+    def check_build(self, mod, built_directly=True):
+        encoded = llvm.irstream._encode_module(mod)
+        self.assertEqual(encoded is not None, built_directly)
+        built = llvm.build_ir_module(mod, llvm.create_context())
+        parsed = llvm.parse_assembly(str(mod), llvm.create_context())
+        # Same IR but for the module identifier and source file name
+        self.assertEqual(str(built).splitlines()[2:],
+                         str(parsed).splitlines()[2:])
+        return built
+
+    def make_module(self):
+        ctx = ir.Context()
+        mod = ir.Module(name="built", context=ctx)
+        i32 = ir.IntType(32)
+        dbl = ir.DoubleType()
+        node = ctx.get_identified_type("node")
+        node.set_body(i32, node.as_pointer())
+        pair = ir.LiteralStructType([i32, dbl])
+        table = ir.GlobalVariable(mod, ir.ArrayType(i32, 3), "table")
+        table.initializer = ir.Constant(table.value_type, [1, 2, 3])
+        table.linkage = 'internal'
+        table.global_constant = True
+        ir.GlobalVariable(mod, node, "head").initializer = ir.Constant(
+            node, [ir.IntType(32)(5), ir.Constant(node.as_pointer(), None)])
+        text = ir.GlobalVariable(mod, ir.ArrayType(ir.IntType(8), 4), "text")
+        text.initializer = ir.Constant(text.value_type, bytearray(b'a"\n\0'))
+        wide = ir.GlobalVariable(mod, ir.IntType(128), "wide")
+        wide.initializer = ir.IntType(128)(-2 ** 100 + 3)
+        floats = ir.GlobalVariable(mod, ir.VectorType(ir.FloatType(), 3),
+                                   "floats")
+        floats.initializer = ir.Constant(floats.value_type,
+                                         [0.1, float('inf'), -0.0])
+        ir.GlobalVariable(mod, i32, "undef").linkage = 'internal'
+        ir.GlobalVariable(mod, i32, "extern")
+
+        ext = ir.Function(mod, ir.FunctionType(dbl, [dbl]), "ext")
+        ext.attributes.add('nounwind')
+        fn = ir.Function(mod, ir.FunctionType(i32, [i32, dbl]), "loop")
+        fn.calling_convention = 'fastcc'
+        fn.attributes.alignstack = 16
+        fn.args[0].add_attribute('signext')
+        entry = fn.append_basic_block("entry")
+        body = fn.append_basic_block("body")
+        out = fn.append_basic_block("out")
+        builder = ir.IRBuilder(entry)
+        acc = builder.alloca(i32, name="acc")
+        builder.store(i32(0), acc, align=4)
+        builder.branch(body)
+        builder.position_at_end(body)
+        i = builder.phi(i32, "i")
+        value = builder.add(builder.load(acc, align=4), i, flags=['nsw'])
+        ptr = builder.gep(table, [i32(0), i32(2)], inbounds=True)
+        value = builder.mul(value, builder.load(ptr))
+        call = builder.call(ext, [builder.fadd(fn.args[1], dbl(1.5),
+                                               flags=['fast'])], tail=True)
+        other = builder.fptosi(call, i32)
+        value = builder.select(builder.icmp_signed('<', value, other),
+                               value, other)
+        builder.store(value, acc)
+        # A phi incoming value defined after the phi
+        nxt = builder.add(i, fn.args[0], name="next")
+        i.add_incoming(i32(0), entry)
+        i.add_incoming(nxt, body)
+        switch = builder.switch(nxt, body)
+        switch.add_case(10, out)
+        builder.position_at_end(out)
+        agg = builder.insert_value(pair(None), nxt, 0)
+        builder.ret(builder.extract_value(agg, 0))
+        return mod
+
+    def test_build_ir_module(self):
+        mod = self.make_module()
+        built = self.check_build(mod)
+        built.verify()
+        self.assertEqual(built.name, "built")
+        linkages = {gv.name: gv.linkage for gv in built.global_variables}
+        self.assertEqual(linkages["undef"], llvm.Linkage.internal)
+        self.assertEqual(linkages["extern"], llvm.Linkage.external)
+
+    def test_build_ir_module_jit(self):
+        mod = ir.Module()
+        mod.triple = llvm.get_process_triple()
+        i32 = ir.IntType(32)
+        fn = ir.Function(mod, ir.FunctionType(i32, [i32, i32]), "sum")
+        builder = ir.IRBuilder(fn.append_basic_block())
+        builder.ret(builder.add(*fn.args))
+        engine = llvm.create_mcjit_compiler(llvm.build_ir_module(mod),
+                                            self.target_machine(jit=True))
+        engine.finalize_object()
+        cfptr = engine.get_function_address("sum")
+        cfunc = CFUNCTYPE(c_int, c_int, c_int)(cfptr)
+        self.assertEqual(cfunc(2, -5), -3)
+
+    def test_build_ir_module_fallback(self):
+        # Metadata is parsed from textual IR
+        mod = self.make_module()
+        mod.add_named_metadata("llvmlite.tests", ["build"])
+        self.check_build(mod, built_directly=False)
+
+    def test_build_ir_module_errors(self):
+        # Errors are reported by the assembly parser
+        i32 = ir.IntType(32)
+        mod = ir.Module()
+        fn = ir.Function(mod, ir.FunctionType(i32, [i32.as_pointer()]), "f")
+        builder = ir.IRBuilder(fn.append_basic_block())
+        builder.ret(builder.load(fn.args[0], align=3))
+        with self.assertRaises(RuntimeError) as cm:
+            llvm.build_ir_module(mod)
+        self.assertIn("alignment is not a power of two", str(cm.exception))
+
+        mod = ir.Module()
+        fn = ir.Function(mod, ir.FunctionType(i32, [i32]), "f")
+        builder = ir.IRBuilder(fn.append_basic_block())
+        value = builder.add(fn.args[0], i32(1))
+        builder.ret(value)
+        builder.remove(value)
+        with self.assertRaises(RuntimeError) as cm:
+            llvm.build_ir_module(mod)
+        self.assertIn("use of undefined value", str(cm.exception))
+
+
+class TestFFILocking(BaseTest):
+    """
+    Test the choice of locks made by the libllvmlite wrapper.
+    """
+
+    def test_module_locks(self):
+        ctx1 = llvm.create_context()
+        ctx2 = llvm.create_context()
+        mod1 = self.module(context=ctx1)
+        mod1b = self.module(asm_mul, context=ctx1)
+        mod2 = self.module(context=ctx2)
+        # Modules share the lock of their context only
+        self.assertEqual(mod1._ffi_locks, ctx1._ffi_locks)
+        self.assertEqual(mod1b._ffi_locks, ctx1._ffi_locks)
+        self.assertNotEqual(mod1._ffi_locks, mod2._ffi_locks)
+        # The values of a module use the lock of its context
+        fn = mod1.get_function("sum")
+        self.assertEqual(fn._ffi_locks, ctx1._ffi_locks)
+        for block in fn.blocks:
+            for insn in block.instructions:
+                self.assertEqual(insn._ffi_locks, ctx1._ffi_locks)
+        # All the modules of the global context share one lock
+        self.assertEqual(self.module()._ffi_locks,
+                         self.module(asm_mul)._ffi_locks)
+
+    def test_type_and_attribute_locks(self):
+        ctx = llvm.create_context()
+        mod = self.module(asm_attributes, context=ctx)
+        # Types and attribute iterators use the lock of the context too
+        for fn in mod.functions:
+            self.assertEqual(fn.type._ffi_locks, ctx._ffi_locks)
+            self.assertEqual(fn.type.element_type._ffi_locks,
+                             ctx._ffi_locks)
+            self.assertEqual(fn.attributes._ffi_locks, ctx._ffi_locks)
+        for tp in mod.struct_types:
+            self.assertEqual(tp._ffi_locks, ctx._ffi_locks)
+
+    def test_arg_locks(self):
+        ctx1 = llvm.create_context()
+        ctx2 = llvm.create_context()
+        mod1 = self.module(context=ctx1)
+        mod2 = self.module(context=ctx2)
+        locks = ffi._get_arg_locks((mod1, b"abc", mod2, mod1))
+        self.assertEqual(len(locks), 2)
+        self.assertEqual(locks, sorted(locks, key=id))
+        self.assertEqual(ffi._get_arg_locks((b"abc", 1)), [])
+
+    def test_global_lock_order(self):
+        # A callback making a global call while the context lock is held
+        # must not deadlock with a global call on that context, which
+        # takes the context lock first as well.
+        ctx = llvm.create_context()
+        mod = self.module(context=ctx)
+        ee = llvm.create_mcjit_compiler(mod, self.target_machine(jit=True))
+        in_callback = threading.Event()
+        errors = []
+
+        def notify(mod, buf):
+            in_callback.set()
+            # Let the other thread block on the context lock
+            time.sleep(0.2)
+            llvm.get_process_triple()
+
+        def compile():
+            try:
+                ee.set_object_cache(notify)
+                ee.finalize_object()
+            except Exception as e:
+                errors.append(e)
+
+        pm = llvm.create_function_pass_manager(
+            self.module(asm_mul, context=ctx))
+
+        def add_pass():
+            try:
+                in_callback.wait()
+                pm.add_refprune_pass()
+            except Exception as e:
+                errors.append(e)
+
+        threads = [threading.Thread(target=compile, daemon=True),
+                   threading.Thread(target=add_pass, daemon=True)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join(timeout=30)
+            self.assertFalse(t.is_alive(), "deadlock")
+        self.assertEqual(errors, [])
+
+    def test_serialized_calls(self):
+        # While calls are serialized, as when tracing before LLVM 11, even
+        # the threadsafe functions take the global lock
+        holding = threading.Event()
+        release = threading.Event()
+
+        def hold():
+            with ffi.lib._lock:
+                holding.set()
+                release.wait()
+
+        holder = threading.Thread(target=hold)
+        holder.start()
+        holding.wait()
+        try:
+            with mock.patch.object(ffi, '_serialize_calls', True):
+                call = threading.Thread(target=ffi.lib.LLVMPY_GetOpcodeCount)
+                call.start()
+                call.join(0.2)
+                self.assertTrue(call.is_alive())
+                release.set()
+                call.join()
+        finally:
+            release.set()
+            holder.join()
+
+    def test_parallel_contexts(self):
+        # Parse, optimize and compile in separate contexts concurrently
+        target_machine = self.target_machine(jit=False)
+        asm = asm_sum.format(triple=llvm.get_default_triple())
+        results = []
+        errors = []
+
+        def work():
+            try:
+                ctx = llvm.create_context()
+                for _ in range(5):
+                    mod = llvm.parse_assembly(asm, ctx)
+                    pm = llvm.create_module_pass_manager()
+                    pm.add_instruction_combining_pass()
+                    pm.run(mod)
+                    results.append(target_machine.emit_object(mod))
+                    mod.close()
+            except Exception as e:
+                errors.append(e)
+
+        threads = [threading.Thread(target=work) for _ in range(4)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        self.assertEqual(errors, [])
+        self.assertEqual(len(results), 20)
+        self.assertEqual(len(set(results)), 1)
+
+
 class TestGlobalConstructors(TestMCJit):
     def test_global_ctors_dtors(self):
         # test issue #303
@@ -1475,6 +2755,35 @@ class TestObjectFile(BaseTest):
 
         self.assertEqual(sum_twice(2, 3), 10)
 
+    def test_emit_object_parallel(self):
+        target_machine = self.target_machine(jit=False)
+        mod = self.module(asm_sum)
+        mod.link_in(self.module(asm_mul))
+        before = str(mod)
+        objs = target_machine.emit_object_parallel(mod, 3)
+        self.assertEqual(len(objs), 3)
+        # The module is not modified by the split
+        self.assertEqual(str(mod), before)
+
+        jit = llvm.create_mcjit_compiler(self.module(self.mod_asm),
+                                         target_machine)
+        for obj_bin in objs:
+            self.assertIsInstance(obj_bin, bytes)
+            jit.add_object_file(llvm.ObjectFileRef.from_data(obj_bin))
+        sum_twice = CFUNCTYPE(c_int, c_int, c_int)(
+            jit.get_function_address("sum_twice"))
+        self.assertEqual(sum_twice(2, 3), 10)
+        mul = CFUNCTYPE(c_int, c_int, c_int)(jit.get_function_address("mul"))
+        self.assertEqual(mul(2, 3), 6)
+
+        with self.assertRaises(ValueError):
+            target_machine.emit_object_parallel(mod, 0)
+
+        # The module is split itself when consumed
+        objs2 = target_machine.emit_object_parallel(mod, 3, consume=True)
+        self.assertEqual(objs2, objs)
+        self.assertTrue(mod.closed)
+
     def test_add_object_file_from_filesystem(self):
         target_machine = self.target_machine(jit=False)
         mod = self.module()
@@ -243,6 +243,28 @@ define void @main(i8* %ptr, i8* %other) {
         # not pruned
         self.assertIn("call void @NRT_decref(i8* %other)", str(mod))
 
+    per_bb_ir_5 = r"""
+define void @main(i8* %a, i8* %b, i8* %c) {
+    call void @NRT_incref(i8* %a)
+    call void @NRT_incref(i8* %b)
+    call void @NRT_incref(i8* %c)
+    call void @NRT_incref(i8* %a)
+    call void @NRT_decref(i8* %c)
+    call void @NRT_decref(i8* %b)
+    call void @NRT_decref(i8* %a)
+    call void @NRT_decref(i8* %b)
+    ret void
+}
+"""
+
+    def test_per_bb_5(self):
+        mod, stats = self.check(self.per_bb_ir_5)
+        self.assertEqual(stats.basicblock, 6)
+        # not pruned
+        self.assertIn("call void @NRT_incref(i8* %a)", str(mod))
+        self.assertIn("call void @NRT_decref(i8* %b)", str(mod))
+        self.assertNotIn("@NRT_incref(i8* %c)", str(mod))
+
 
 class TestDiamond(BaseTestByIR):
     refprune_bitmask = llvm.RefPruneSubpasses.DIAMOND
@@ -342,6 +364,30 @@ bb_D:
         mod, stats = self.check(self.per_diamond_5)
         self.assertEqual(stats.diamond, 4)
 
+    per_diamond_6 = r"""
+define void @main(i8* %a, i8* %b, i8* %c, i1 %cond) {
+bb_A:
+    call void @NRT_incref(i8* %a)
+    call void @NRT_incref(i8* %b)
+    br i1 %cond, label %bb_B, label %bb_C
+bb_B:
+    call void @NRT_incref(i8* %c)     ; unrelated incref will not affect prune
+    br label %bb_D
+bb_C:
+    br label %bb_D
+bb_D:
+    call void @NRT_decref(i8* %b)
+    call void @NRT_decref(i8* %a)
+    ret void
+}
+"""
+
+    def test_per_diamond_6(self):
+        mod, stats = self.check(self.per_diamond_6)
+        self.assertEqual(stats.diamond, 4)
+        # not pruned
+        self.assertIn("call void @NRT_incref(i8* %c)", str(mod))
+
 
 class TestFanout(BaseTestByIR):
     """More complex cases are tested in TestRefPrunePass
@@ -407,6 +453,68 @@ bb_C:
         mod, stats = self.check(self.fanout_3)
         self.assertEqual(stats.fanout, 6)
 
+    def make_diamonds(self, n):
+        # n diamonds in a row after the incref, 2 ** n paths to the decrefs
+        blocks = ["""
+bb_0:
+    call void @NRT_incref(i8* %ptr)
+    br label %bb_1"""]
+        for i in range(1, n + 1):
+            blocks.append(f"""
+bb_{i}:
+    br i1 %cond, label %bb_{i}_l, label %bb_{i}_r
+bb_{i}_l:
+    br label %bb_{i + 1}
+bb_{i}_r:
+    br label %bb_{i + 1}""")
+        blocks.append(f"""
+bb_{n + 1}:
+    br i1 %cond, label %bb_B, label %bb_C
+bb_B:
+    call void @NRT_decref(i8* %ptr)
+    ret void
+bb_C:
+    call void @NRT_decref(i8* %ptr)
+    ret void""")
+        return ("define void @main(i8* %ptr, i1 %cond) {"
+                + "".join(blocks) + "\n}\n")
+
+    def test_fanout_deep(self):
+        # Deeper than the depth the search was once limited to
+        mod, stats = self.check(self.make_diamonds(40))
+        self.assertEqual(stats.fanout, 3)
+        self.assertNotIn("NRT_incref(i8* %ptr)", str(mod))
+
+    def make_unrelated_increfs(self, n):
+        # n increfs without fanout before one with a fanout 12 blocks away
+        blocks = ["\nbb_0:"]
+        blocks += ["\n    call void @NRT_incref(i8* %other)"] * n
+        blocks.append("""
+    call void @NRT_incref(i8* %ptr)
+    br label %bb_1""")
+        for i in range(1, 10):
+            blocks.append(f"""
+bb_{i}:
+    br label %bb_{i + 1}""")
+        blocks.append("""
+bb_10:
+    br i1 %cond, label %bb_B, label %bb_C
+bb_B:
+    call void @NRT_decref(i8* %ptr)
+    ret void
+bb_C:
+    call void @NRT_decref(i8* %ptr)
+    ret void""")
+        return ("define void @main(i8* %ptr, i8* %other, i1 %cond) {"
+                + "".join(blocks) + "\n}\n")
+
+    def test_fanout_many_unrelated_increfs(self):
+        # The failed searches of other increfs don't prevent pruning
+        for n in (50, 100, 1000):
+            mod, stats = self.check(self.make_unrelated_increfs(n))
+            self.assertEqual(stats.fanout, 3)
+            self.assertNotIn("NRT_incref(i8* %ptr)", str(mod))
+
 
 class TestFanoutRaise(BaseTestByIR):
     refprune_bitmask = llvm.RefPruneSubpasses.FANOUT_RAISE
@@ -487,5 +595,442 @@ bb_C:
         self.assertEqual(stats.fanout_raise, 0)
 
 
+class TestLoopHoist(BaseTestByIR):
+    refprune_bitmask = llvm.RefPruneSubpasses.LOOP_HOIST
+
+    def refops_of(self, mod, block_name):
+        mod.verify()
+        [bb] = [bb for bb in mod.get_function('main').blocks
+                if bb.name == block_name]
+        return [str(i).split('@')[1].split('(')[0]
+                for i in bb.instructions if i.opcode == 'call'
+                and 'NRT_' in str(i)]
+
+    loop_hoist_1 = r"""
+define void @main(i8* %ptr, i8* %other, i1 %cond) {
+entry:
+    br label %loop
+loop:
+    call void @NRT_incref(i8* %ptr)
+    call void @NRT_decref(i8* %other)  ; the hoisted pair keeps %ptr alive
+    call void @NRT_decref(i8* %ptr)
+    br i1 %cond, label %loop, label %exit
+exit:
+    ret void
+}
+"""
+
+    def test_loop_hoist_1(self):
+        mod, stats = self.check(self.loop_hoist_1)
+        self.assertEqual(stats.hoisted, 1)
+        self.assertEqual(self.refops_of(mod, 'entry'), ['NRT_incref'])
+        self.assertEqual(self.refops_of(mod, 'loop'), ['NRT_decref'])
+        self.assertEqual(self.refops_of(mod, 'exit'), ['NRT_decref'])
+        self.assertIn("call void @NRT_decref(i8* %other)", str(mod))
+
+    loop_hoist_2 = r"""
+define void @main(i8* %ptr, i1 %cond) {
+entry:
+    br label %header
+header:
+    br i1 %cond, label %body, label %exit   ; exit before the refops
+body:
+    call void @NRT_incref(i8* %ptr)
+    call void @NRT_decref(i8* %ptr)
+    br label %header
+exit:
+    ret void
+}
+"""
+
+    def test_loop_hoist_2(self):
+        mod, stats = self.check(self.loop_hoist_2)
+        self.assertEqual(stats.hoisted, 1)
+        self.assertEqual(self.refops_of(mod, 'body'), [])
+        self.assertEqual(self.refops_of(mod, 'entry'), ['NRT_incref'])
+        self.assertEqual(self.refops_of(mod, 'exit'), ['NRT_decref'])
+
+    loop_hoist_3 = r"""
+define void @main(i8* %ptr, i1 %cond) {
+entry:
+    br label %header
+header:
+    call void @NRT_incref(i8* %ptr)
+    br i1 %cond, label %body, label %exit   ; exit between the refops
+body:
+    call void @NRT_decref(i8* %ptr)
+    br label %header
+exit:
+    ret void
+}
+"""
+
+    def test_loop_hoist_3(self):
+        mod, stats = self.check(self.loop_hoist_3)
+        self.assertEqual(stats.hoisted, 0)
+
+    loop_hoist_4 = r"""
+define void @main(i8** %ptrs, i1 %cond) {
+entry:
+    br label %loop
+loop:
+    %ptr = load i8*, i8** %ptrs    ; not loop invariant
+    call void @NRT_incref(i8* %ptr)
+    call void @NRT_decref(i8* %ptr)
+    br i1 %cond, label %loop, label %exit
+exit:
+    ret void
+}
+"""
+
+    def test_loop_hoist_4(self):
+        mod, stats = self.check(self.loop_hoist_4)
+        self.assertEqual(stats.hoisted, 0)
+
+    loop_hoist_5 = r"""
+define void @main(i8* %ptr, i8* %other, i1 %cond) {
+entry:
+    br label %body
+body:
+    call void @NRT_incref(i8* %ptr)
+    call void @NRT_decref(i8* %other)
+    br label %latch
+latch:
+    call void @NRT_decref(i8* %ptr)
+    br i1 %cond, label %body, label %exit
+exit:
+    ret void
+}
+"""
+
+    def test_loop_hoist_all(self):
+        # Only hoisting applies with the decref of %other in between
+        self.refprune_bitmask = (llvm.RefPruneSubpasses.ALL |
+                                 llvm.RefPruneSubpasses.LOOP_HOIST)
+        mod, stats = self.check(self.loop_hoist_5)
+        self.assertEqual(stats, llvm.PruneStats(0, 0, 0, 0, 1))
+        self.assertEqual(self.refops_of(mod, 'body'), ['NRT_decref'])
+        self.assertEqual(self.refops_of(mod, 'latch'), [])
+
+    def test_loop_hoist_not_in_all(self):
+        # Loop hoisting is opt-in
+        self.refprune_bitmask = llvm.RefPruneSubpasses.ALL
+        mod, stats = self.check(self.loop_hoist_5)
+        self.assertEqual(stats, llvm.PruneStats(0, 0, 0, 0, 0))
+        self.assertEqual(self.refops_of(mod, 'body'),
+                         ['NRT_incref', 'NRT_decref'])
+        self.assertEqual(self.refops_of(mod, 'latch'), ['NRT_decref'])
+
+
+class TestCallSummaries(BaseTestByIR):
+    refprune_bitmask = llvm.RefPruneSubpasses.PER_BB
+
+    helpers = r"""
+define void @neutral(i8* %x) {
+    call void @NRT_incref(i8* %x)
+    call void @NRT_decref(i8* %x)
+    ret void
+}
+
+define i8* @returns(i8* %x) {
+    call void @NRT_incref(i8* %x)
+    ret i8* %x
+}
+
+define void @consumes(i8* %x) {
+    call void @NRT_decref(i8* %x)
+    ret void
+}
+
+define void @wraps(i8* %x) {
+    call void @consumes(i8* %x)
+    ret void
+}
+
+define void @recurses(i8* %x, i1 %cond) {
+entry:
+    br i1 %cond, label %again, label %done
+again:
+    call void @recurses(i8* %x, i1 false)
+    ret void
+done:
+    call void @NRT_decref(i8* %x)
+    ret void
+}
+"""
+
+    def check(self, irmod):
+        return super().check(f"{self.helpers}\n{irmod}")
+
+    def main_refops(self, mod):
+        return [str(i).strip() for bb in mod.get_function('main').blocks
+                for i in bb.instructions if 'NRT_' in str(i)]
+
+    call_per_bb_1 = r"""
+define void @main(i8* %ptr) {
+    call void @NRT_incref(i8* %ptr)
+    call void @neutral(i8* %ptr)
+    %ret = call i8* @returns(i8* %ptr)
+    call void @NRT_decref(i8* %ptr)
+    ret void
+}
+"""
+
+    def test_call_per_bb_1(self):
+        # the pairs around the neutral and returning calls are pruned, as
+        # is the balanced pair in @neutral
+        mod, stats = self.check(self.call_per_bb_1)
+        self.assertEqual(stats.basicblock, 4)
+        self.assertEqual(self.main_refops(mod), [])
+
+    call_per_bb_2 = r"""
+define void @main(i8* %ptr, i8* %other) {
+    call void @NRT_incref(i8* %ptr)
+    call void @NRT_incref(i8* %other)
+    call void @consumes(i8* %ptr)
+    call void @NRT_decref(i8* %ptr)
+    call void @NRT_decref(i8* %other)
+    ret void
+}
+"""
+
+    def test_call_per_bb_2(self):
+        # %ptr is kept alive across the call releasing it, %other is not
+        mod, stats = self.check(self.call_per_bb_2)
+        self.assertEqual(stats.basicblock, 4)
+        self.assertEqual(self.main_refops(mod), [
+            "call void @NRT_incref(i8* %ptr)",
+            "call void @NRT_decref(i8* %ptr)",
+        ])
+
+    call_per_bb_3 = r"""
+define void @main(i8* %ptr, i8* %other) {
+    call void @NRT_incref(i8* %ptr)
+    call void @NRT_incref(i8* %other)
+    call void @wraps(i8* %ptr)
+    call void @recurses(i8* %other, i1 true)
+    call void @NRT_decref(i8* %ptr)
+    call void @NRT_decref(i8* %other)
+    ret void
+}
+"""
+
+    def test_call_per_bb_3(self):
+        # the effects of callees are summarized transitively
+        mod, stats = self.check(self.call_per_bb_3)
+        self.assertEqual(stats.basicblock, 2)
+        self.assertEqual(len(self.main_refops(mod)), 4)
+
+    call_per_bb_4 = r"""
+define void @branchy(i8* %x, i1 %cond) {
+entry:
+    call void @NRT_incref(i8* %x)
+    br i1 %cond, label %left, label %right
+left:
+    call void @NRT_decref(i8* %x)
+    ret void
+right:
+    call void @NRT_decref(i8* %x)
+    ret void
+}
+
+define void @main(i8* %ptr, i1 %cond) {
+    call void @NRT_incref(i8* %ptr)
+    call void @branchy(i8* %ptr, i1 %cond)
+    call void @NRT_decref(i8* %ptr)
+    ret void
+}
+"""
+
+    def test_call_per_bb_4(self):
+        # a callee balancing its refops on every path from its entry is
+        # neutral, even though no block of it is balanced; the pair in
+        # @neutral is pruned too
+        mod, stats = self.check(self.call_per_bb_4)
+        self.assertEqual(stats.basicblock, 4)
+        self.assertEqual(self.main_refops(mod), [])
+
+    call_per_bb_5 = r"""
+define void @loops(i8* %x, i1 %cond) {
+entry:
+    br label %loop
+loop:
+    call void @NRT_incref(i8* %x)
+    br i1 %cond, label %loop, label %exit
+exit:
+    call void @NRT_decref(i8* %x)
+    ret void
+}
+
+define void @main(i8* %ptr, i1 %cond) {
+    call void @NRT_incref(i8* %ptr)
+    call void @loops(i8* %ptr, i1 %cond)
+    call void @NRT_decref(i8* %ptr)
+    ret void
+}
+"""
+
+    def test_call_per_bb_5(self):
+        # the paths through the loop of the callee disagree on its increfs
+        # outstanding, so it may release the pointer
+        mod, stats = self.check(self.call_per_bb_5)
+        self.assertEqual(stats.basicblock, 2)
+        self.assertEqual(len(self.main_refops(mod)), 2)
+
+    call_diamond_1 = r"""
+define void @main(i8* %ptr, i8* %other, i1 %cond) {
+bb_A:
+    call void @NRT_incref(i8* %ptr)
+    br i1 %cond, label %bb_B, label %bb_C
+bb_B:
+    call void @{callee}(i8* %other)
+    br label %bb_D
+bb_C:
+    br label %bb_D
+bb_D:
+    call void @NRT_decref(i8* %ptr)
+    ret void
+}
+"""
+
+    def test_call_diamond_1(self):
+        # a call releasing any pointer counts as a decref between the pair
+        self.refprune_bitmask = llvm.RefPruneSubpasses.DIAMOND
+        ir = self.call_diamond_1.replace('{callee}', 'neutral')
+        mod, stats = self.check(ir)
+        self.assertEqual(stats.diamond, 2)
+        ir = self.call_diamond_1.replace('{callee}', 'consumes')
+        mod, stats = self.check(ir)
+        self.assertEqual(stats.diamond, 0)
+
+
+class TestRefPruneStats(BaseTestByIR):
+    refprune_bitmask = llvm.RefPruneSubpasses.ALL
+
+    stats_ir = r"""
+define void @per_bb(i8* %ptr) {
+    call void @NRT_incref(i8* %ptr)
+    call void @NRT_decref(i8* %ptr)
+    ret void
+}
+
+define void @diamond(i8* %ptr) {
+bb_A:
+    call void @NRT_incref(i8* %ptr)
+    br label %bb_B
+bb_B:
+    call void @NRT_decref(i8* %ptr)
+    ret void
+}
+
+define void @untouched(i8* %ptr) {
+    call void @NRT_incref(i8* %ptr)
+    ret void
+}
+"""
+
+    def make_pm(self):
+        pm = llvm.ModulePassManager()
+        pm.add_refprune_pass(self.refprune_bitmask)
+        return pm
+
+    def test_per_pass_manager(self):
+        pm1 = self.make_pm()
+        pm2 = self.make_pm()
+        self.assertEqual(pm1.get_refprune_stats(), llvm.PruneStats(0, 0, 0, 0))
+        self.assertEqual(pm1.get_refprune_function_stats(), {})
+
+        before = llvm.dump_refprune_stats()
+        mod = llvm.parse_assembly(f"{self.prologue}\n{self.stats_ir}")
+        pm1.run(mod)
+        after = llvm.dump_refprune_stats()
+
+        stats = pm1.get_refprune_stats()
+        self.assertEqual(stats, llvm.PruneStats(2, 2, 0, 0, 0))
+        self.assertEqual(stats, after - before)
+        self.assertEqual(pm2.get_refprune_stats(), llvm.PruneStats(0, 0, 0, 0))
+
+        fstats = pm1.get_refprune_function_stats()
+        self.assertEqual(set(fstats), {'per_bb', 'diamond', 'untouched'})
+        self.assertEqual(fstats['per_bb'].runs, 1)
+        self.assertEqual(fstats['per_bb'].pruned, llvm.PruneStats(2, 0, 0, 0))
+        self.assertEqual(fstats['diamond'].pruned, llvm.PruneStats(0, 2, 0, 0))
+        self.assertEqual(fstats['untouched'].pruned,
+                         llvm.PruneStats(0, 0, 0, 0))
+        for fs in fstats.values():
+            self.assertIsInstance(fs, llvm.FunctionPruneStats)
+            self.assertTrue(all(t >= 0 for t in fs.times))
+
+        # Functions of the same name are accumulated
+        mod = llvm.parse_assembly(f"{self.prologue}\n{self.stats_ir}")
+        pm1.run(mod)
+        fstats = pm1.get_refprune_function_stats()
+        self.assertEqual(fstats['per_bb'].runs, 2)
+        self.assertEqual(fstats['per_bb'].pruned, llvm.PruneStats(4, 0, 0, 0))
+        self.assertEqual(pm1.get_refprune_stats(), llvm.PruneStats(4, 4, 0, 0))
+
+    def test_stats_outlive_pass_manager(self):
+        pm = self.make_pm()
+        stats = pm._refprune_stats
+        del pm
+        self.assertEqual(stats.get_stats(), llvm.PruneStats(0, 0, 0, 0))
+
+
+class TestRefOpNames(BaseTestByIR):
+    refprune_bitmask = llvm.RefPruneSubpasses.ALL
+
+    names_ir = r"""
+declare void @my_incref(i8* %ptr)
+declare void @my_decref(i8* %ptr)
+declare void @my_decref_other(i8* %ptr)
+
+define void @main(i8* %ptr, i8* %other) {
+    call void @my_incref(i8* %ptr)
+    call void @NRT_incref(i8* %ptr)
+    call void @my_incref(i8* %other)
+    call void @NRT_decref(i8* %ptr)
+    call void @my_decref(i8* %ptr)
+    call void @my_decref_other(i8* %other)
+    ret void
+}
+"""
+
+    def run_with_names(self, **kwargs):
+        mod = llvm.parse_assembly(f"{self.prologue}\n{self.names_ir}")
+        pm = llvm.ModulePassManager()
+        pm.add_refprune_pass(self.refprune_bitmask, **kwargs)
+        pm.run(mod)
+        return str(mod), pm.get_refprune_stats()
+
+    def test_default_names(self):
+        ir, stats = self.run_with_names()
+        self.assertEqual(stats.basicblock, 2)
+        self.assertNotIn("@NRT_incref(i8* %ptr)", ir)
+        self.assertIn("call void @my_incref(i8* %ptr)", ir)
+
+    def test_custom_names(self):
+        ir, stats = self.run_with_names(
+            incref_names=['my_incref'],
+            decref_names=['my_decref', 'my_decref_other', 'missing'])
+        self.assertEqual(stats.basicblock, 4)
+        self.assertIn("call void @NRT_incref(i8* %ptr)", ir)
+        self.assertNotIn("@my_incref", ir.split('define')[-1])
+        self.assertNotIn("@my_decref", ir.split('define')[-1])
+
+    def test_single_names(self):
+        # A single name is not taken as a sequence of characters
+        ir, stats = self.run_with_names(incref_names='my_incref',
+                                        decref_names='my_decref')
+        self.assertEqual(stats.basicblock, 2)
+        self.assertIn("call void @NRT_incref(i8* %ptr)", ir)
+        self.assertNotIn("@my_incref(i8* %ptr)", ir)
+        self.assertNotIn("@my_decref(i8* %ptr)", ir)
+
+    def test_no_callees(self):
+        ir, stats = self.run_with_names(incref_names=['missing'],
+                                        decref_names=[])
+        self.assertEqual(stats, llvm.PruneStats(0, 0, 0, 0))
+
+
 if __name__ == '__main__':
     unittest.main()